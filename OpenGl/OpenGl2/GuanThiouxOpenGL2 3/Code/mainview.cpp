@@ -107,29 +107,12 @@ void MainView::getUniforms(QOpenGLShaderProgram *shaderProgram) {
 }
 
 void MainView::loadMesh() {
+    // Welded vertices, each shared by the triangles that index it
     Model model(":/models/cat.obj");
-    QVector<QVector3D> vertexCoords = model.getVertices();
-    QVector<QVector3D> normals = model.getNormals();
-    QVector<QVector2D> mappings = model.getTextureCoords();
-
-    QVector<float> meshData;
-    meshData.reserve(8 * vertexCoords.size());
-
-    for (int i = 0; i < vertexCoords.size(); i++){
-        QVector3D coord = vertexCoords[i];
-        QVector3D normal = normals[i];
-        QVector2D mapping = mappings[i];
-        meshData.append(coord.x());
-        meshData.append(coord.y());
-        meshData.append(coord.z());
-        meshData.append(normal.x());
-        meshData.append(normal.y());
-        meshData.append(normal.z());
-        meshData.append(mapping.x());
-        meshData.append(mapping.y());
-    }
+    QVector<float> meshData = model.getVNTInterleaved_indexed();
+    QVector<unsigned> indices = model.getIndices();
 
-    meshSize = vertexCoords.size();
+    meshSize = indices.size();
 
     // Generate VAO
     glGenVertexArrays(1, &meshVAO);
@@ -154,6 +137,11 @@ void MainView::loadMesh() {
     glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 8 * sizeof(float), reinterpret_cast<void*>(6 * sizeof(float)));
     glEnableVertexAttribArray(2);
 
+    // Generate the element buffer, the VAO keeps it bound
+    glGenBuffers(1, &meshIBO);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIBO);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned), indices.data(), GL_STATIC_DRAW);
+
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     glBindVertexArray(0);
 }
@@ -196,7 +184,7 @@ void MainView::paintGL() {
     glUniformMatrix3fv(uniformNormalTransform, 1, GL_FALSE, normalTransform.data());
 
     glBindVertexArray(meshVAO);
-    glDrawArrays(GL_TRIANGLES, 0, meshSize);
+    glDrawElements(GL_TRIANGLES, meshSize, GL_UNSIGNED_INT, 0);
 
     if (shadingMode == NORMAL) normalShaderProgram.release();
     else if (shadingMode == PHONG) phongShaderProgram.release();
@@ -238,6 +226,7 @@ void MainView::updateModelTransforms() {
 
 void MainView::destroyModelBuffers() {
     glDeleteBuffers(1, &meshVBO);
+    glDeleteBuffers(1, &meshIBO);
     glDeleteVertexArrays(1, &meshVAO);
 }
 
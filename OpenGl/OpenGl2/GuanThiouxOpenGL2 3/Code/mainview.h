@@ -69,7 +69,8 @@ private:
     // Mesh values
     GLuint meshVAO;
     GLuint meshVBO;
-    GLuint meshSize;
+    GLuint meshIBO;
+    GLuint meshSize;    // number of indices
     QMatrix4x4 meshTransform;
     QMatrix3x3 normalTransform;
 
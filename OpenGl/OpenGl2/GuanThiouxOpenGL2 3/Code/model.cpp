@@ -4,7 +4,34 @@
 #include <QFile>
 #include <QTextStream>
 
-Model::Model(QString filename) {
+#include <cmath>
+#include <cstring>
+
+Model::WeldKey::WeldKey(QVector3D const &coord, QVector3D const &normal, QVector2D const &texCoord) {
+    float const floats[8] = {
+        coord.x(), coord.y(), coord.z(),
+        normal.x(), normal.y(), normal.z(),
+        texCoord.x(), texCoord.y()
+    };
+
+    for (int i = 0; i != 8; ++i) {
+        // Adding 0 turns -0 into 0, which compares equal to it
+        float value = floats[i] + 0.f;
+        std::memcpy(&values[i], &value, sizeof(values[i]));
+    }
+}
+
+Model::WeldCell::WeldCell(QVector3D const &coord, float epsilon, int neighbours) {
+    for (int axis = 0; axis != 3; ++axis) {
+        double scaled = coord[axis] / (2.0 * epsilon);
+        double cell = std::floor(scaled);
+        index[axis] = static_cast<qint64>(cell);
+        if (neighbours >> axis & 1)
+            index[axis] += scaled - cell < 0.5 ? -1 : 1;
+    }
+}
+
+Model::Model(QString filename, float weldEpsilon) : weldEpsilon(weldEpsilon) {
     qDebug() << ":: Loading model:" << filename;
     QFile file(filename);
     if(file.open(QIODevice::ReadOnly)) {
@@ -224,6 +251,10 @@ void Model::parseFace(QStringList tokens) {
  * Make sure that the indices from the vertices align with those
  * of the normals and the texture coordinates, create extra vertices
  * if vertex has multiple normals or texturecoords
+ *
+ * Corners are welded through a hash of their values, or of the grid
+ * cells near their position when welding within an epsilon, so this
+ * takes linear time in the number of corners
  */
 void Model::alignData() {
     QVector<QVector3D> verts = QVector<QVector3D>();
@@ -232,7 +263,12 @@ void Model::alignData() {
     norms.reserve(vertices_indexed.size());
     QVector<QVector2D> texcs = QVector<QVector2D>();
     texcs.reserve(vertices_indexed.size());
-    QVector<Vertex> vs = QVector<Vertex>();
+    QHash<WeldKey, unsigned> welded;
+    QMultiHash<WeldCell, unsigned> cells;
+    if (weldEpsilon > 0.f)
+        cells.reserve(vertices_indexed.size());
+    else
+        welded.reserve(vertices_indexed.size());
 
     QVector<unsigned> ind = QVector<unsigned>();
     ind.reserve(indices.size());
@@ -242,7 +278,7 @@ void Model::alignData() {
     for (int i = 0; i != indices.size(); ++i) {
         QVector3D v = vertices_indexed[indices[i]];
 
-        QVector3D n = QVector2D(0,0);
+        QVector3D n = QVector3D(0,0,0);
         if ( hNorms ) {
             n = norm[normal_indices[i]];
         }
@@ -252,20 +288,33 @@ void Model::alignData() {
             t = tex[texcoord_indices[i]];
         }
 
-        Vertex k = Vertex(v,n,t);
-        if (vs.contains(k)) {
+        int found = -1;
+        if (weldEpsilon > 0.f) {
+            found = findNear(cells, verts, norms, texcs, v, n, t);
+        } else {
+            auto exact = welded.constFind(WeldKey(v,n,t));
+            if (exact != welded.constEnd())
+                found = exact.value();
+        }
+
+        if (found != -1) {
             // Vertex already exists, use that index
-            ind.append(vs.indexOf(k));
+            ind.append(found);
         } else {
             // Create a new vertex
             verts.append(v);
             norms.append(n);
             texcs.append(t);
-            vs.append(k);
+            if (weldEpsilon > 0.f)
+                cells.insert(WeldCell(v, weldEpsilon), currentIndex);
+            else
+                welded.insert(WeldKey(v,n,t), currentIndex);
             ind.append(currentIndex);
             ++currentIndex;
         }
     }
+    qDebug() << ":: Welded" << indices.size() << "corners into" << currentIndex << "vertices";
+
     // Remove old data
     vertices_indexed.clear();
     normals_indexed.clear();
@@ -279,6 +328,41 @@ void Model::alignData() {
     indices = ind;
 }
 
+/**
+ * @brief Model::findNear
+ *
+ * Looks through the welded vertices in the cells the values can be
+ * within weldEpsilon of, see WeldCell
+ */
+int Model::findNear(QMultiHash<WeldCell, unsigned> const &cells,
+                    QVector<QVector3D> const &verts, QVector<QVector3D> const &norms,
+                    QVector<QVector2D> const &texcs, QVector3D const &v,
+                    QVector3D const &n, QVector2D const &t) const {
+    float const values[8] = {
+        v.x(), v.y(), v.z(), n.x(), n.y(), n.z(), t.x(), t.y()
+    };
+
+    int nearest = -1;
+    for (int neighbours = 0; neighbours != 8; ++neighbours) {
+        WeldCell cell(v, weldEpsilon, neighbours);
+        for (auto it = cells.constFind(cell); it != cells.constEnd() && it.key() == cell; ++it) {
+            int idx = it.value();
+            float const other[8] = {
+                verts[idx].x(), verts[idx].y(), verts[idx].z(),
+                norms[idx].x(), norms[idx].y(), norms[idx].z(),
+                texcs[idx].x(), texcs[idx].y()
+            };
+
+            bool near = true;
+            for (int i = 0; i != 8 && near; ++i)
+                near = std::fabs(values[i] - other[i]) <= weldEpsilon;
+            if (near && (nearest == -1 || idx < nearest))
+                nearest = idx;
+        }
+    }
+    return nearest;
+}
+
 /**
  * @brief Model::unpackIndexes
  *
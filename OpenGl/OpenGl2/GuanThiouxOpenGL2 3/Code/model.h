@@ -1,6 +1,7 @@
 #ifndef MODEL_H
 #define MODEL_H
 
+#include <QHash>
 #include <QString>
 #include <QStringList>
 #include <QVector>
@@ -19,7 +20,11 @@
 class Model
 {
 public:
-    Model(QString filename);
+    // Corners whose position, normal and texture coordinate are equal are
+    // welded into one indexed vertex. With a weldEpsilon above 0, a corner
+    // is welded to the first vertex whose values all lie within weldEpsilon
+    // of its own instead.
+    Model(QString filename, float weldEpsilon = 0.f);
 
     // Used for glDrawArrays()
     QVector<QVector3D> getVertices();
@@ -47,27 +52,53 @@ public:
     void unitize();
 
 private:
-    // A Vertex class for vertex comparison
-    struct Vertex {
-
-        QVector3D coord;
-        QVector3D normal;
-        QVector2D texCoord;
-
-        Vertex() : coord(), normal(), texCoord(){}
-        Vertex(QVector3D coords, QVector3D normal, QVector3D texc): coord(coords), normal(normal), texCoord(texc){}
-
-        bool operator==(const Vertex &other) const {
-            if (other.coord != coord)
-                return false;
-            if (other.normal != normal)
-                return false;
-            if (other.texCoord != texCoord)
-                return false;
+    // Hash key of a vertex for exact welding: the bits of its eight values
+    struct WeldKey {
+
+        quint32 values[8];
+
+        WeldKey(QVector3D const &coord, QVector3D const &normal, QVector2D const &texCoord);
+
+        bool operator==(const WeldKey &other) const {
+            for (int i = 0; i != 8; ++i)
+                if (values[i] != other.values[i])
+                    return false;
             return true;
         }
+
+        friend uint qHash(const WeldKey &key, uint seed = 0) {
+            return qHashBits(key.values, sizeof(key.values), seed);
+        }
     };
 
+    // Cell of a vertex position in a grid with sides of twice the weld
+    // epsilon, for welding within it. Along each axis, a position within
+    // epsilon of another lies in the same cell or in the neighbouring cell
+    // nearest to that other position.
+    struct WeldCell {
+
+        qint64 index[3];
+
+        // Bit i of neighbours moves to the neighbour along axis i
+        WeldCell(QVector3D const &coord, float epsilon, int neighbours = 0);
+
+        bool operator==(const WeldCell &other) const {
+            return index[0] == other.index[0] && index[1] == other.index[1]
+                && index[2] == other.index[2];
+        }
+
+        friend uint qHash(const WeldCell &cell, uint seed = 0) {
+            return qHashBits(cell.index, sizeof(cell.index), seed);
+        }
+    };
+
+    // Index of the first welded vertex within weldEpsilon of the values,
+    // searching the cells near the position, or -1 if there is none
+    int findNear(QMultiHash<WeldCell, unsigned> const &cells,
+                 QVector<QVector3D> const &verts, QVector<QVector3D> const &norms,
+                 QVector<QVector2D> const &texcs, QVector3D const &v,
+                 QVector3D const &n, QVector2D const &t) const;
+
     // OBJ parsing
     void parseVertex(QStringList tokens);
     void parseNormal(QStringList tokens);
@@ -96,6 +127,8 @@ private:
 
     bool hNorms = false;
     bool hTexs = false;
+
+    float weldEpsilon;
 };
 
 #endif // MODEL_H
@@ -0,0 +1,61 @@
+#include "benchmark.h"
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+using json = nlohmann::json;
+
+Benchmark::Benchmark(string const &filter)
+:
+    d_filter(filter),
+    d_results(json::array()),
+    d_sink(0.0)
+{}
+
+bool Benchmark::selected(string const &name) const
+{
+    return name.find(d_filter) != string::npos;
+}
+
+void Benchmark::annotate(string const &key, json const &value)
+{
+    if (!d_results.empty())
+        d_results.back()[key] = value;
+}
+
+json const &Benchmark::results() const
+{
+    return d_results;
+}
+
+void Benchmark::report(string const &name, double raysPerOp,
+                       unsigned long iterations, vector<double> &seconds)
+{
+    sort(seconds.begin(), seconds.end());
+    double median = seconds[seconds.size() / 2];
+    double nsPerOp = median * 1E9 / iterations;
+
+    json result = {
+        {"name", name},
+        {"iterations", iterations},
+        {"batches", seconds.size()},
+        {"ns_per_op", nsPerOp},
+        {"min_ns_per_op", seconds.front() * 1E9 / iterations},
+        {"max_ns_per_op", seconds.back() * 1E9 / iterations}
+    };
+
+    cerr << left << setw(32) << name << right << setw(14) << fixed
+         << setprecision(1) << nsPerOp << " ns/op";
+
+    if (raysPerOp > 0.0)
+    {
+        double raysPerSecond = raysPerOp * iterations / median;
+        result["rays_per_second"] = raysPerSecond;
+        cerr << setw(16) << setprecision(0) << raysPerSecond << " rays/s";
+    }
+    cerr << '\n';
+
+    d_results.push_back(result);
+}
@@ -0,0 +1,71 @@
+#ifndef BENCHMARK_H_
+#define BENCHMARK_H_
+
+#include "../src/json/json.h"
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Minimal timing harness. Every benchmark is calibrated to batches of at
+// least minBatchSeconds, timed over a fixed number of batches, and reported
+// by its median batch. Results are collected as JSON.
+class Benchmark
+{
+    std::string d_filter;
+    nlohmann::json d_results;
+    double d_sink;              // keeps results of timed code alive
+
+    static unsigned const s_batches = 5;
+    static constexpr double s_minBatchSeconds = 0.1;
+
+    public:
+        // only benchmarks whose name contains filter are run
+        explicit Benchmark(std::string const &filter = "");
+
+        // Time op(iteration), which returns a value that must not be
+        // optimized away. raysPerOp is the number of rays one call
+        // traces, 0 for benchmarks that are not about rays.
+        template <typename Op>
+        void run(std::string const &name, double raysPerOp, Op op);
+
+        bool selected(std::string const &name) const;
+
+        // add a field to the result of the last benchmark that ran
+        void annotate(std::string const &key, nlohmann::json const &value);
+
+        nlohmann::json const &results() const;
+
+    private:
+        void report(std::string const &name, double raysPerOp,
+                    unsigned long iterations, std::vector<double> &seconds);
+};
+
+template <typename Op>
+void Benchmark::run(std::string const &name, double raysPerOp, Op op)
+{
+    if (!selected(name))
+        return;
+
+    using Clock = std::chrono::steady_clock;
+    auto batch = [&](unsigned long iterations)
+    {
+        Clock::time_point start = Clock::now();
+        for (unsigned long idx = 0; idx != iterations; ++idx)
+            d_sink += op(idx);
+        return std::chrono::duration<double>(Clock::now() - start).count();
+    };
+
+    // Grow the batch until it is long enough to time reliably
+    unsigned long iterations = 1;
+    while (batch(iterations) < s_minBatchSeconds)
+        iterations *= 2;
+
+    std::vector<double> seconds;
+    for (unsigned idx = 0; idx != s_batches; ++idx)
+        seconds.push_back(batch(iterations));
+
+    report(name, raysPerOp, iterations, seconds);
+}
+
+#endif
@@ -0,0 +1,490 @@
+#include "benchmark.h"
+
+#include "../src/denoiser.h"
+#include "../src/hit.h"
+#include "../src/image.h"
+#include "../src/light.h"
+#include "../src/material.h"
+#include "../src/objloader.h"
+#include "../src/ray.h"
+#include "../src/scene.h"
+#include "../src/threadpool.h"
+#include "../src/triple.h"
+#include "../src/shapes/mesh.h"
+#include "../src/shapes/quad.h"
+#include "../src/shapes/solvers.h"
+#include "../src/shapes/sphere.h"
+#include "../src/shapes/spherecloud.h"
+#include "../src/shapes/triangle.h"
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace
+{
+    double const PI = 3.14159265358979323846;
+
+    // All inputs come from this seed, so runs are comparable
+    unsigned const SEED = 20211;
+
+    // Rays from random points around the origin, aimed at random points
+    // in [-1, 1]^3. About half of them hit a unit sized shape there.
+    vector<Ray> randomRays(unsigned count)
+    {
+        mt19937 rng(SEED);
+        uniform_real_distribution<double> unit(-1.0, 1.0);
+
+        vector<Ray> rays;
+        rays.reserve(count);
+        while (rays.size() != count)
+        {
+            Vector dir(unit(rng), unit(rng), unit(rng));
+            if (dir.length_2() > 1.0 or dir.length_2() < 1E-6)
+                continue;
+
+            Point from = 5.0 * dir.normalized();
+            Point to(unit(rng), unit(rng), unit(rng));
+            rays.emplace_back(from, (to - from).normalized());
+        }
+        return rays;
+    }
+
+    // Write a latitude/longitude sphere with 4 * rings^2 triangles
+    // as OBJ, since meshes can only be loaded from a file.
+    void writeSphereObj(string const &filename, unsigned rings)
+    {
+        ofstream obj(filename);
+        unsigned segments = 2 * rings;
+        for (unsigned ring = 0; ring <= rings; ++ring)
+            for (unsigned seg = 0; seg <= segments; ++seg)
+            {
+                double theta = PI * ring / rings;
+                double phi = 2.0 * PI * seg / segments;
+                Vector v(sin(theta) * cos(phi), cos(theta), sin(theta) * sin(phi));
+                obj << "v " << v.x << ' ' << v.y << ' ' << v.z << '\n'
+                    << "vn " << v.x << ' ' << v.y << ' ' << v.z << '\n';
+            }
+
+        auto idx = [segments](unsigned ring, unsigned seg)
+        {
+            unsigned one = ring * (segments + 1) + seg + 1;
+            return to_string(one) + "//" + to_string(one);
+        };
+        for (unsigned ring = 0; ring != rings; ++ring)
+            for (unsigned seg = 0; seg != segments; ++seg)
+            {
+                obj << "f " << idx(ring, seg) << ' ' << idx(ring + 1, seg)
+                    << ' ' << idx(ring + 1, seg + 1) << '\n'
+                    << "f " << idx(ring, seg) << ' ' << idx(ring + 1, seg + 1)
+                    << ' ' << idx(ring, seg + 1) << '\n';
+            }
+    }
+
+    // Write the triangles of an OBJ file, each split into four at its edge
+    // midpoints the given number of times
+    void writeSubdividedObj(string const &filename, string const &source,
+                            unsigned levels)
+    {
+        OBJLoader model(source);
+        vector<Vertex> vertices = model.vertex_data();
+        vector<Point> corners;
+        for (Vertex const &vertex : vertices)
+            corners.emplace_back(vertex.x, vertex.y, vertex.z);
+
+        for (unsigned level = 0; level != levels; ++level)
+        {
+            vector<Point> split;
+            for (size_t tri = 0; tri + 2 < corners.size(); tri += 3)
+            {
+                Point const &a = corners[tri];
+                Point const &b = corners[tri + 1];
+                Point const &c = corners[tri + 2];
+                Point ab = (a + b) / 2.0;
+                Point bc = (b + c) / 2.0;
+                Point ca = (c + a) / 2.0;
+                for (Point const &corner : {a, ab, ca, ab, b, bc, ca, bc, c, ab, bc, ca})
+                    split.push_back(corner);
+            }
+            corners.swap(split);
+        }
+
+        ofstream obj(filename);
+        obj << "vn 0 0 1\n";
+        for (Point const &corner : corners)
+            obj << "v " << corner.x << ' ' << corner.y << ' ' << corner.z << '\n';
+        for (size_t idx = 1; idx + 2 <= corners.size(); idx += 3)
+            obj << "f " << idx << "//1 " << idx + 1 << "//1 " << idx + 2 << "//1\n";
+    }
+
+    // A grid of spheres of every material kind above a floor, in the
+    // pixel coordinates of the fixed camera at (200, 200, 1000).
+    void buildScene(Scene &scene)
+    {
+        scene.setEye(Point(200, 200, 1000));
+        scene.setRecursionDepth(2);
+        scene.setRenderShadows(true);
+        scene.addLight(Light(Point(-200, 600, 1500), Color(0.6, 0.6, 0.6)));
+        scene.addLight(Light(Point(600, 600, 1500), Color(0.4, 0.4, 0.4)));
+
+        ObjectPtr floor(new Quad(Point(0, 0, 0), Point(400, 0, 0),
+                                 Point(400, 400, -200), Point(0, 400, -200)));
+        floor->material = scene.addMaterial(Material(Color(0.8, 0.8, 0.8), 0.2, 0.8, 0.3, 4));
+        scene.addObject(floor);
+
+        for (unsigned row = 0; row != 4; ++row)
+            for (unsigned col = 0; col != 4; ++col)
+            {
+                Point pos(50 + 100 * col, 50 + 100 * row, 100 + 20 * row);
+                ObjectPtr sphere(new Sphere(pos, 35));
+                Color color(0.2 + 0.2 * col, 0.8 - 0.2 * row, 0.5);
+                switch ((row + col) % 3)
+                {
+                    case 0:     // diffuse
+                        sphere->material = scene.addMaterial(Material(color, 0.2, 0.8, 0.0, 1));
+                    break;
+                    case 1:     // reflective
+                        sphere->material = scene.addMaterial(Material(color, 0.2, 0.7, 0.5, 64));
+                    break;
+                    default:    // transparent
+                        sphere->material = scene.addMaterial(Material(color, 0.2, 0.3, 0.5, 8, 1.5));
+                    break;
+                }
+                scene.addObject(sphere);
+            }
+    }
+
+    vector<Ray> cameraRays(unsigned width, unsigned height)
+    {
+        Point eye(200, 200, 1000);
+        vector<Ray> rays;
+        rays.reserve(width * height);
+        for (unsigned y = 0; y != height; ++y)
+            for (unsigned x = 0; x != width; ++x)
+            {
+                Point pixel(x + 0.5, height - 1 - y + 0.5, 0);
+                rays.emplace_back(eye, (pixel - eye).normalized());
+            }
+        return rays;
+    }
+
+    // Intersection kernel of a single shape over the random rays
+    void benchShape(Benchmark &bench, string const &name, Object &shape)
+    {
+        vector<Ray> rays = randomRays(4096);
+        bench.run(name, 1.0, [&](unsigned long idx)
+        {
+            Hit hit(shape.intersect(rays[idx % rays.size()]));
+            return isnan(hit.t) ? 0.0 : hit.t;
+        });
+    }
+
+    char const *const LAYOUTS[] = {"full", "quantized8", "quantized16"};
+
+    // Whether any layout of the mesh is selected, so a mesh is only built
+    // when one of its benchmarks runs
+    bool meshSelected(Benchmark const &bench, string const &name)
+    {
+        for (char const *layoutName : LAYOUTS)
+        {
+            if (bench.selected("MeshBVH/" + name + "/" + layoutName))
+                return true;
+        }
+        return false;
+    }
+
+    // Mesh intersection with each BVH layout, reporting node memory
+    void benchMeshLayouts(Benchmark &bench, string const &name,
+                          string const &objname, double scale)
+    {
+        for (char const *layoutName : LAYOUTS)
+        {
+            string fullName = "MeshBVH/" + name + "/" + layoutName;
+            if (!bench.selected(fullName))
+                continue;
+
+            MeshBVH::Layout layout;
+            MeshBVH::parseLayout(layoutName, layout);
+            Mesh mesh(objname, Point(), Vector(), Vector(scale, scale, scale),
+                      layout, cout);
+
+            benchShape(bench, fullName, mesh);
+            bench.annotate("triangles", mesh.numTriangles());
+            bench.annotate("bvh_bytes", mesh.bvhBytes());
+            cerr << "    " << mesh.numTriangles() << " triangles, "
+                 << mesh.bvhBytes() << " bytes of BVH nodes\n";
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    string filter;
+    string ofname;
+    string meshname;
+    for (int idx = 1; idx < argc; ++idx)
+    {
+        string arg = argv[idx];
+        if (arg == "--filter" and idx + 1 < argc)
+            filter = argv[++idx];
+        else if (arg == "--out" and idx + 1 < argc)
+            ofname = argv[++idx];
+        else if (arg == "--mesh" and idx + 1 < argc)
+            meshname = argv[++idx];
+        else
+        {
+            cerr << "Usage: " << argv[0]
+                 << " [--filter name-part] [--out results.json]"
+                    " [--mesh model.obj]\n";
+            return 1;
+        }
+    }
+
+    // Results go to stdout, anything the renderer reports goes to stderr
+    ostream out(cout.rdbuf());
+    cout.rdbuf(cerr.rdbuf());
+
+    Benchmark bench(filter);
+
+// =============================================================================
+// -- Kernels ------------------------------------------------------------------
+// =============================================================================
+
+    {
+        mt19937 rng(SEED);
+        uniform_real_distribution<double> coef(-10.0, 10.0);
+        vector<double> coefs(3 * 4096);
+        for (double &value : coefs)
+            value = coef(rng);
+
+        bench.run("Solvers::quadratic", 0.0, [&](unsigned long idx)
+        {
+            double const *abc = &coefs[3 * (idx % 4096)];
+            double x0 = 0.0;
+            double x1 = 0.0;
+            Solvers::quadratic(abc[0], abc[1], abc[2], x0, x1);
+            return x0 + x1;
+        });
+    }
+
+    Sphere sphere(Point(0, 0, 0), 1.0);
+    benchShape(bench, "Sphere::intersect", sphere);
+
+    Quad quad(Point(-1, -1, 0), Point(1, -1, 0), Point(1, 1, 0), Point(-1, 1, 0));
+    benchShape(bench, "Quad::intersect", quad);
+
+    Triangle triangle(Point(-1, -1, 0), Point(1, -1, 0), Point(0, 1, 0));
+    benchShape(bench, "Triangle::intersect", triangle);
+
+    for (unsigned rings : {8u, 32u})
+    {
+        string name = "Mesh::intersect/" + to_string(2 * rings * 2 * rings) + "tris";
+        if (!bench.selected(name))
+            continue;
+
+        string objname = "ray_bench_mesh.obj";
+        writeSphereObj(objname, rings);
+        Mesh mesh(objname, Point(), Vector(), Vector(1, 1, 1), MeshBVH::FULL,
+                  cout);
+        remove(objname.c_str());
+
+        benchShape(bench, name, mesh);
+    }
+
+    {
+        // Unit cube of particles, about 30 per ray
+        mt19937 rng(SEED);
+        uniform_real_distribution<double> unit(-1.0, 1.0);
+        SphereCloud cloud({0});
+        for (unsigned idx = 0; idx != 100000; ++idx)
+            cloud.add(Point(unit(rng), unit(rng), unit(rng)), 0.005);
+        cloud.build();
+
+        benchShape(bench, "SphereCloud::intersect/100000", cloud);
+    }
+
+// =============================================================================
+// -- Mesh BVH layouts ---------------------------------------------------------
+// =============================================================================
+
+    // Dense synthetic spheres, and optionally a given model as is and with
+    // every triangle split into 16
+    for (unsigned rings : {64u, 256u})
+    {
+        string name = "sphere" + to_string(4 * rings * rings);
+        if (!meshSelected(bench, name))
+            continue;
+
+        string objname = "ray_bench_mesh.obj";
+        writeSphereObj(objname, rings);
+        benchMeshLayouts(bench, name, objname, 1.0);
+        remove(objname.c_str());
+    }
+
+    if (!meshname.empty())
+    {
+        benchMeshLayouts(bench, "model", meshname, 1.5);
+
+        string objname = "ray_bench_mesh.obj";
+        if (meshSelected(bench, "model16x"))
+        {
+            writeSubdividedObj(objname, meshname, 2);
+            benchMeshLayouts(bench, "model16x", objname, 1.5);
+            remove(objname.c_str());
+        }
+    }
+
+// =============================================================================
+// -- Dispatch -----------------------------------------------------------------
+// =============================================================================
+
+    // The same spheres intersected through Object::intersect on shared
+    // pointers, as objects were stored before, and statically from a
+    // contiguous array, as Scene stores them now
+    {
+        mt19937 rng(SEED);
+        uniform_real_distribution<double> unit(-1.0, 1.0);
+        vector<ObjectPtr> pointers;
+        vector<Sphere> values;
+        for (unsigned idx = 0; idx != 64; ++idx)
+        {
+            Point center(unit(rng), unit(rng), unit(rng));
+            pointers.push_back(ObjectPtr(new Sphere(center, 0.1)));
+            values.emplace_back(center, 0.1);
+        }
+
+        vector<Ray> rays = randomRays(4096);
+        bench.run("dispatch/virtual/64spheres", 1.0, [&](unsigned long idx)
+        {
+            double closest = numeric_limits<double>::infinity();
+            for (ObjectPtr const &obj : pointers)
+                closest = min(closest, obj->intersect(rays[idx % rays.size()]).t);
+            return closest;
+        });
+
+        bench.run("dispatch/static/64spheres", 1.0, [&](unsigned long idx)
+        {
+            double closest = numeric_limits<double>::infinity();
+            for (Sphere const &sphere : values)
+                closest = min(closest, sphere.intersect(rays[idx % rays.size()]).t);
+            return closest;
+        });
+    }
+
+// =============================================================================
+// -- Scene --------------------------------------------------------------------
+// =============================================================================
+
+    Scene scene;
+    buildScene(scene);
+    vector<Ray> rays = cameraRays(400, 400);
+
+    bench.run("Scene::castRay", 1.0, [&](unsigned long idx)
+    {
+        pair<Object const *, Hit> hit = scene.castRay(rays[idx % rays.size()]);
+        return hit.first ? hit.second.t : 0.0;
+    });
+
+    bench.run("Scene::trace", 1.0, [&](unsigned long idx)
+    {
+        return scene.trace(rays[idx % rays.size()], 2).r;
+    });
+
+    {
+        Image img(400, 400);
+        for (unsigned y = 0; y != img.height(); ++y)
+            for (unsigned x = 0; x != img.width(); ++x)
+                img(x, y) = Color(x / 400.0, y / 400.0, 0.5);
+
+        string pngname = "ray_bench.png";
+        bench.run("Image::write_png/400x400", 0.0, [&](unsigned long)
+        {
+            img.write_png(pngname);
+            return 0.0;
+        });
+        bench.run("Image::write_png/level1", 0.0, [&](unsigned long)
+        {
+            img.write_png(pngname, 1);
+            return 0.0;
+        });
+
+        ThreadPool pool;
+        bench.run("Image::write_png/parallel", 0.0, [&](unsigned long)
+        {
+            img.write_png(pngname, 6, &pool);
+            return 0.0;
+        });
+        remove(pngname.c_str());
+
+        for (string extension : {".ppm", ".pfm", ".exr"})
+        {
+            string name = "ray_bench" + extension;
+            bench.run("Image::write/" + extension.substr(1), 0.0, [&](unsigned long)
+            {
+                img.write(name);
+                return 0.0;
+            });
+            remove(name.c_str());
+        }
+    }
+
+// =============================================================================
+// -- End to end ---------------------------------------------------------------
+// =============================================================================
+
+    ThreadPool pool;
+    for (unsigned size : {100u, 200u, 400u})
+    {
+        string name = "Scene::render/" + to_string(size) + "x" + to_string(size);
+        bench.run(name, size * size, [&](unsigned long)
+        {
+            Image img(size, size);
+            scene.render(img, pool);
+            return img(0, 0).r;
+        });
+    }
+
+    {
+        // Noisy gradient over two surfaces, the edge between them is kept
+        Image img(400, 400);
+        GuideBuffer guides(400, 400);
+        mt19937 rng(5);
+        uniform_real_distribution<double> noise(-0.2, 0.2);
+        for (unsigned y = 0; y != img.height(); ++y)
+            for (unsigned x = 0; x != img.width(); ++x)
+            {
+                unsigned pixel = y * img.width() + x;
+                bool left = x < img.width() / 2;
+                guides.normal[left ? 0 : 2][pixel] = 1.0f;
+                guides.depth[pixel] = left ? 500.0f : 800.0f;
+                guides.albedo[1][pixel] = 0.5f;
+                img(x, y) = Color(0.5 + noise(rng), y / 400.0, left ? 0.2 : 0.8);
+            }
+
+        Denoiser denoiser;
+        bench.run("Denoiser::apply/400x400", 0.0, [&](unsigned long)
+        {
+            Image filtered(img);
+            denoiser.apply(filtered, guides, pool);
+            return filtered(0, 0).r;
+        });
+    }
+
+    json results = {
+        {"threads", pool.size()},
+        {"benchmarks", bench.results()}
+    };
+
+    if (ofname.empty())
+        out << results.dump(4) << '\n';
+    else
+        ofstream(ofname) << results.dump(4) << '\n';
+}
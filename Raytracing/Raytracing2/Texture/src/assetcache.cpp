@@ -0,0 +1,107 @@
+#include "assetcache.h"
+
+#include "image.h"
+
+#include <exception>
+#include <sstream>
+
+using namespace std;
+
+AssetCache::AssetCache()
+:
+    d_requests(0)
+{}
+
+shared_ptr<Texture const> AssetCache::texture(string const &filename)
+{
+    return fetch(d_textures, filename, [&]
+    {
+        return make_shared<Texture const>(filename);
+    });
+}
+
+shared_ptr<Mesh::Geometry const> AssetCache::mesh(string const &filename,
+                                                  Point const &position,
+                                                  Vector const &rotation,
+                                                  Vector const &scale,
+                                                  MeshBVH::Layout layout,
+                                                  ostream &log)
+{
+    ostringstream key;
+    key.precision(17);
+    key << filename << '\n' << layout;
+    for (Triple const *triple : {&position, &rotation, &scale})
+        key << ' ' << triple->x << ' ' << triple->y << ' ' << triple->z;
+
+    return fetch(d_meshes, key.str(), [&]
+    {
+        return Mesh::build(filename, position, rotation, scale, layout, log);
+    });
+}
+
+unsigned AssetCache::textures()
+{
+    lock_guard<mutex> lock(d_mutex);
+    return d_textures.count;
+}
+
+unsigned AssetCache::meshes()
+{
+    lock_guard<mutex> lock(d_mutex);
+    return d_meshes.count;
+}
+
+unsigned AssetCache::requests()
+{
+    lock_guard<mutex> lock(d_mutex);
+    return d_requests;
+}
+
+template <typename Asset, typename Load>
+shared_ptr<Asset const> AssetCache::fetch(Loads<Asset> &loads,
+                                          string const &key, Load load)
+{
+    promise<shared_ptr<Asset const>> loading;
+    shared_future<shared_ptr<Asset const>> asset;
+    bool first;
+    {
+        lock_guard<mutex> lock(d_mutex);
+        ++d_requests;
+
+        Entry<Asset> &entry = loads.entries[key];
+        if (shared_ptr<Asset const> loaded = entry.loaded.lock())
+            return loaded;
+
+        // Not loaded, or freed since: load it unless another scene is
+        first = !entry.loading.valid();
+        if (first)
+        {
+            ++loads.count;
+            entry.loading = loading.get_future().share();
+        }
+        asset = entry.loading;
+    }
+
+    // Load outside the lock, other assets need not wait for this one
+    if (!first)
+        return asset.get();
+
+    shared_ptr<Asset const> loaded;
+    try
+    {
+        loaded = load();
+        loading.set_value(loaded);
+    }
+    catch (...)
+    {
+        loading.set_exception(current_exception());
+        return asset.get();         // throws, the failure is kept
+    }
+
+    // The future would keep the asset alive, only a weak pointer stays.
+    lock_guard<mutex> lock(d_mutex);
+    Entry<Asset> &entry = loads.entries[key];
+    entry.loaded = loaded;
+    entry.loading = shared_future<shared_ptr<Asset const>>();
+    return loaded;
+}
@@ -0,0 +1,71 @@
+#ifndef ASSETCACHE_H_
+#define ASSETCACHE_H_
+
+#include "triple.h"
+#include "shapes/mesh.h"
+
+#include <future>
+#include <map>
+#include <iosfwd>
+#include <memory>
+#include <mutex>
+#include <string>
+
+class Texture;
+
+// Decoded textures and built meshes, shared by the scenes read in one
+// process. An asset is loaded by the first scene asking for it; scenes
+// asking for it meanwhile wait for that load instead of repeating it, and
+// later scenes get it as long as some scene still holds it. The cache
+// itself holds no asset, so those no scene uses are freed and memory
+// follows the scenes in flight, not the whole batch. Failed loads throw
+// for every scene asking, they are not retried.
+class AssetCache
+{
+    template <typename Asset>
+    struct Entry
+    {
+        // valid while loading, or for good if the load failed
+        std::shared_future<std::shared_ptr<Asset const>> loading;
+        std::weak_ptr<Asset const> loaded;
+    };
+
+    template <typename Asset>
+    struct Loads
+    {
+        std::map<std::string, Entry<Asset>> entries;
+        unsigned count = 0;         // loads started, reloads included
+    };
+
+    std::mutex d_mutex;             // guards the maps and counters
+    Loads<Texture> d_textures;
+    Loads<Mesh::Geometry> d_meshes;
+    unsigned d_requests;
+
+    public:
+        AssetCache();
+
+        std::shared_ptr<Texture const> texture(std::string const &filename);
+
+        // meshes are keyed by file, pose and layout, see Mesh::build. The
+        // load is reported on the log of the scene that does it.
+        std::shared_ptr<Mesh::Geometry const> mesh(std::string const &filename,
+                                                   Point const &position,
+                                                   Vector const &rotation,
+                                                   Vector const &scale,
+                                                   MeshBVH::Layout layout,
+                                                   std::ostream &log);
+
+        // loads of each, an asset freed and asked for again counts twice
+        unsigned textures();
+        unsigned meshes();
+        unsigned requests();            // of both, including loads
+
+    private:
+        // the asset of the key, calling load if it is not there yet
+        template <typename Asset, typename Load>
+        std::shared_ptr<Asset const> fetch(Loads<Asset> &loads,
+                                           std::string const &key, Load load);
+};
+
+#endif
@@ -0,0 +1,96 @@
+#include "batchrenderer.h"
+
+#include "filename.h"
+#include "raytracer.h"
+
+#include "json/json.h"
+
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using namespace std;
+using json = nlohmann::json;
+
+BatchRenderer::BatchRenderer(ostream &out, unsigned numThreads)
+:
+    d_pool(numThreads),
+    d_out(out)
+{}
+
+unsigned BatchRenderer::run(string const &manifest)
+{
+    ifstream infile(manifest);
+    if (!infile)
+        throw runtime_error("Could not open manifest " + manifest + ".");
+    json entries;
+    infile >> entries;
+    if (!entries.is_array())
+        throw runtime_error("The manifest must be an array of scenes.");
+
+    vector<pair<string, string>> jobs;
+    for (json const &entry : entries)
+    {
+        string scene = entry.at("scene");
+        string output = entry.value("output", "");
+        if (output.empty())
+        {
+            // replace .json with .png, or append it
+            output = stripExtension(scene) + ".png";
+        }
+        jobs.emplace_back(scene, output);
+    }
+
+    auto start = chrono::steady_clock::now();
+
+    // One scene per pool thread, and one more that is parsing while the
+    // others trace. Scenes wait for their tiles on these threads, never on
+    // the pool's own.
+    atomic<unsigned> next(0);
+    atomic<unsigned> failed(0);
+    vector<thread> renders;
+    for (unsigned idx = 0; idx != min<size_t>(d_pool.size() + 1, jobs.size()); ++idx)
+        renders.emplace_back([&]
+        {
+            for (unsigned job = next++; job < jobs.size(); job = next++)
+                if (!render(jobs[job].first, jobs[job].second))
+                    ++failed;
+        });
+
+    for (thread &render : renders)
+        render.join();
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    d_out << "Rendered " << jobs.size() - failed << " of " << jobs.size()
+          << " scenes in " << elapsed.count() << " s, loading "
+          << d_assets.textures() << " textures and " << d_assets.meshes()
+          << " meshes for " << d_assets.requests() << " uses.\n";
+    return failed;
+}
+
+bool BatchRenderer::render(string const &scene, string const &output)
+{
+    ostringstream log;
+    Raytracer raytracer(&d_assets, log, log);
+
+    bool done = false;
+    try
+    {
+        done = raytracer.readScene(scene) and raytracer.renderToFile(output, d_pool);
+    }
+    catch (exception const &ex)
+    {
+        log << "Error: " << ex.what() << '\n';
+    }
+
+    lock_guard<mutex> lock(d_outMutex);
+    d_out << "== " << scene << " -> " << output << (done ? "" : " FAILED")
+          << '\n' << log.str();
+    return done;
+}
@@ -0,0 +1,40 @@
+#ifndef BATCHRENDERER_H_
+#define BATCHRENDERER_H_
+
+#include "assetcache.h"
+#include "threadpool.h"
+
+#include <iosfwd>
+#include <mutex>
+#include <string>
+
+// Renders the scenes of a manifest in one process. The manifest is a JSON
+// array of entries
+//
+//   {"scene": "room.json", "output": "room.png"}
+//
+// where the output defaults to the scene file with a .png extension.
+// Several scenes are read and rendered at a time, so one scene's parsing
+// overlaps another's tracing, and their tiles share one pool. Textures
+// and meshes are loaded once for all scenes. The messages of a scene are
+// written together once it is done, followed by a summary of the batch.
+class BatchRenderer
+{
+    ThreadPool d_pool;
+    AssetCache d_assets;
+    std::ostream &d_out;
+    std::mutex d_outMutex;
+
+    public:
+        explicit BatchRenderer(std::ostream &out, unsigned numThreads = 0);
+
+        // render the scenes of the manifest and return the number that
+        // failed. Throws if the manifest cannot be read.
+        unsigned run(std::string const &manifest);
+
+    private:
+        // render one scene, returns false if it failed
+        bool render(std::string const &scene, std::string const &output);
+};
+
+#endif
@@ -0,0 +1,164 @@
+#include "checkpoint.h"
+
+#include "image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[4] = {'C', 'K', 'P', '1'};
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t width;
+        uint32_t height;
+        uint32_t tileSize;
+        uint64_t key;
+    };
+
+    // Followed by a done flag per tile and the pixels of the done tiles,
+    // row by row
+}
+
+Checkpoint::Checkpoint(string const &filename, double interval, unsigned width,
+                       unsigned height, unsigned tileSize, uint64_t key,
+                       ostream &err)
+:
+    d_filename(filename),
+    d_interval(interval),
+    d_width(width),
+    d_height(height),
+    d_tileSize(tileSize),
+    d_key(key),
+    d_done(((width + tileSize - 1) / tileSize) * ((height + tileSize - 1) / tileSize)),
+    d_lastWrite(chrono::steady_clock::now()),
+    d_err(err)
+{}
+
+bool Checkpoint::read(Image &img)
+{
+    ifstream infile(d_filename, ios::binary);
+    if (!infile)
+        return false;
+
+    Header header;
+    if (!infile.read(reinterpret_cast<char *>(&header), sizeof(header)))
+        return false;
+
+    if (memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        or header.width != d_width or header.height != d_height
+        or header.tileSize != d_tileSize or header.key != d_key
+        or img.width() != d_width or img.height() != d_height)
+        return false;
+
+    vector<unsigned char> done(d_done.size());
+    if (!infile.read(reinterpret_cast<char *>(done.data()), done.size()))
+        return false;
+
+    // Read into a copy, a truncated file changes nothing
+    Image restored(img);
+    for (unsigned tile = 0; tile != done.size(); ++tile)
+    {
+        if (!done[tile])
+            continue;
+
+        unsigned x0, y0, x1, y1;
+        bounds(tile, x0, y0, x1, y1);
+        for (unsigned y = y0; y != y1; ++y)
+            if (!infile.read(reinterpret_cast<char *>(&restored(x0, y)),
+                             (x1 - x0) * sizeof(RGB32F)))
+                return false;
+    }
+
+    img = restored;
+    d_done.swap(done);
+    return true;
+}
+
+bool Checkpoint::write(Image const &img)
+{
+    string tmpname = d_filename + ".tmp";
+    {
+        ofstream outfile(tmpname, ios::binary);
+        if (!outfile)
+            return false;
+
+        Header header;
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.width = d_width;
+        header.height = d_height;
+        header.tileSize = d_tileSize;
+        header.key = d_key;
+
+        outfile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        outfile.write(reinterpret_cast<char const *>(d_done.data()), d_done.size());
+        for (unsigned tile = 0; tile != d_done.size(); ++tile)
+        {
+            if (!d_done[tile])
+                continue;
+
+            unsigned x0, y0, x1, y1;
+            bounds(tile, x0, y0, x1, y1);
+            for (unsigned y = y0; y != y1; ++y)
+                outfile.write(reinterpret_cast<char const *>(&img(x0, y)),
+                              (x1 - x0) * sizeof(RGB32F));
+        }
+
+        if (!outfile.flush())
+            return false;
+    }
+
+    if (rename(tmpname.c_str(), d_filename.c_str()) != 0)
+        return false;
+    d_lastWrite = chrono::steady_clock::now();
+    return true;
+}
+
+bool Checkpoint::done(unsigned tile) const
+{
+    return d_done.at(tile);
+}
+
+unsigned Checkpoint::finished() const
+{
+    return count(d_done.begin(), d_done.end(), 1);
+}
+
+unsigned Checkpoint::tiles() const
+{
+    return d_done.size();
+}
+
+void Checkpoint::finish(unsigned tile, Image const &img)
+{
+    d_done.at(tile) = 1;
+
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - d_lastWrite;
+    if (elapsed.count() >= d_interval and !write(img))
+    {
+        d_err << "Warning: could not write checkpoint " << d_filename << ".\n";
+        d_lastWrite = chrono::steady_clock::now();
+    }
+}
+
+void Checkpoint::remove() const
+{
+    std::remove(d_filename.c_str());
+}
+
+void Checkpoint::bounds(unsigned tile, unsigned &x0, unsigned &y0,
+                        unsigned &x1, unsigned &y1) const
+{
+    unsigned columns = (d_width + d_tileSize - 1) / d_tileSize;
+    x0 = tile % columns * d_tileSize;
+    y0 = tile / columns * d_tileSize;
+    x1 = min(x0 + d_tileSize, d_width);
+    y1 = min(y0 + d_tileSize, d_height);
+}
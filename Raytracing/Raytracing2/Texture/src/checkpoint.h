@@ -0,0 +1,63 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+class Image;
+
+// Progress of a long render: which tiles are finished, and their pixels.
+// Scene::render reports every finished tile and the checkpoint file is
+// rewritten when the interval has passed since the last write. A restarted
+// render of the same scene (see key) and image size reads it back and only
+// renders the remaining tiles.
+class Checkpoint
+{
+    std::string d_filename;
+    double d_interval;                  // seconds between writes
+    unsigned d_width;
+    unsigned d_height;
+    unsigned d_tileSize;
+    std::uint64_t d_key;                // hash of the scene
+
+    std::vector<unsigned char> d_done;  // per tile, in row-major order
+    std::chrono::steady_clock::time_point d_lastWrite;
+    std::ostream &d_err;                // failed writes are reported here
+
+    public:
+        Checkpoint(std::string const &filename, double interval,
+                   unsigned width, unsigned height, unsigned tileSize,
+                   std::uint64_t key, std::ostream &err);
+
+        // Restore the finished tiles of a file written by write() into img.
+        // Returns false, leaving both untouched, if the file is missing or
+        // was made for another image size, tiling or key.
+        bool read(Image &img);
+
+        // Write the finished tiles of img, replacing the file as a whole so
+        // an interrupted write leaves the previous checkpoint intact.
+        // Returns false if the file could not be written.
+        bool write(Image const &img);
+
+        // tiles in row-major order, as Scene::render queues them
+        bool done(unsigned tile) const;
+        unsigned finished() const;
+        unsigned tiles() const;
+
+        // Mark a tile finished, writing the file if the interval has passed.
+        // A failed write is reported, the render goes on.
+        void finish(unsigned tile, Image const &img);
+
+        // Delete the file, once the image itself is written
+        void remove() const;
+
+    private:
+        // Pixel rectangle [x0, x1) x [y0, y1) of a tile
+        void bounds(unsigned tile, unsigned &x0, unsigned &y0, unsigned &x1,
+                    unsigned &y1) const;
+};
+
+#endif
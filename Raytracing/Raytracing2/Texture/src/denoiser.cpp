@@ -0,0 +1,209 @@
+#include "denoiser.h"
+
+#include "image.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstddef>
+#include <future>
+
+using namespace std;
+
+namespace
+{
+    // B3 spline, the a-trous kernel is its outer product
+    float const KERNEL[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+
+    // (1 + e / 16)^-16, which is close to exp(-e) for the small e that
+    // matter and falls off fast for large ones. Unlike exp, it needs no
+    // calls or branches, so the filter loops vectorize.
+    inline float falloff(float e)
+    {
+        float base = 1.0f + e * (1.0f / 16);
+        base *= base;
+        base *= base;
+        base *= base;
+        base *= base;
+        return 1.0f / base;
+    }
+}
+
+constexpr float GuideBuffer::MISS;
+
+GuideBuffer::GuideBuffer(unsigned width, unsigned height)
+:
+    width(width),
+    height(height),
+    depth(width * height, MISS)
+{
+    for (unsigned channel = 0; channel != 3; ++channel)
+    {
+        normal[channel].assign(width * height, 0.0f);
+        albedo[channel].assign(width * height, 0.0f);
+    }
+}
+
+Denoiser::Denoiser(unsigned iterations, float sigmaColor, float sigmaNormal,
+                   float sigmaDepth, float sigmaAlbedo)
+:
+    d_iterations(iterations),
+    d_sigmaColor(sigmaColor),
+    d_sigmaNormal(sigmaNormal),
+    d_sigmaDepth(sigmaDepth),
+    d_sigmaAlbedo(sigmaAlbedo)
+{}
+
+void Denoiser::apply(Image &img, GuideBuffer const &guides, ThreadPool &pool) const
+{
+    unsigned w = img.width();
+    unsigned h = img.height();
+
+    vector<float> in[3];
+    vector<float> out[3];
+    for (unsigned channel = 0; channel != 3; ++channel)
+    {
+        in[channel].resize(w * h);
+        out[channel].resize(w * h);
+    }
+
+    for (unsigned y = 0; y != h; ++y)
+        for (unsigned x = 0; x != w; ++x)
+        {
+            RGB32F const &pixel = img(x, y);
+            in[0][y * w + x] = pixel.r;
+            in[1][y * w + x] = pixel.g;
+            in[2][y * w + x] = pixel.b;
+        }
+
+    // A few bands per thread, every pass waits for all of them
+    unsigned bands = min(h, 4 * pool.size());
+    for (unsigned pass = 0; pass != d_iterations; ++pass)
+    {
+        float sigma = d_sigmaColor / (1 << pass);
+        float colorWeight = 1.0f / (sigma * sigma);
+
+        vector<future<void>> jobs;
+        for (unsigned band = 0; band != bands; ++band)
+        {
+            unsigned y0 = h * band / bands;
+            unsigned y1 = h * (band + 1) / bands;
+            jobs.push_back(pool.submit([&, pass, colorWeight, y0, y1]
+            {
+                filterRows(in, out, guides, 1 << pass, colorWeight, y0, y1);
+            }));
+        }
+        for (future<void> &job : jobs)
+            job.get();
+
+        for (unsigned channel = 0; channel != 3; ++channel)
+            in[channel].swap(out[channel]);
+    }
+
+    for (unsigned y = 0; y != h; ++y)
+        for (unsigned x = 0; x != w; ++x)
+        {
+            RGB32F &pixel = img(x, y);
+            pixel.r = in[0][y * w + x];
+            pixel.g = in[1][y * w + x];
+            pixel.b = in[2][y * w + x];
+        }
+}
+
+void Denoiser::filterRows(vector<float> const (&in)[3], vector<float> (&out)[3],
+                          GuideBuffer const &guides, unsigned step,
+                          float colorWeight, unsigned y0, unsigned y1) const
+{
+    int const w = guides.width;
+    int const h = guides.height;
+
+    float const normalWeight = 1.0f / (d_sigmaNormal * d_sigmaNormal);
+    float const depthWeight = 1.0f / (d_sigmaDepth * d_sigmaDepth);
+    float const albedoWeight = 1.0f / (d_sigmaAlbedo * d_sigmaAlbedo);
+
+    // Plain pointers per plane, so the loops over x can be vectorized
+    float const *const red = in[0].data();
+    float const *const green = in[1].data();
+    float const *const blue = in[2].data();
+    float const *const normalX = guides.normal[0].data();
+    float const *const normalY = guides.normal[1].data();
+    float const *const normalZ = guides.normal[2].data();
+    float const *const albedoR = guides.albedo[0].data();
+    float const *const albedoG = guides.albedo[1].data();
+    float const *const albedoB = guides.albedo[2].data();
+    float const *const depth = guides.depth.data();
+
+    // Sums are kept for spans of a row in local arrays, which the
+    // compiler knows do not overlap the planes
+    int const SPAN = 64;
+    float sumR[SPAN];
+    float sumG[SPAN];
+    float sumB[SPAN];
+    float weights[SPAN];
+
+    for (int y = y0; y != static_cast<int>(y1); ++y)
+        for (int x0 = 0; x0 < w; x0 += SPAN)
+        {
+            int const x1 = min(x0 + SPAN, w);
+            fill(sumR, sumR + SPAN, 0.0f);
+            fill(sumG, sumG + SPAN, 0.0f);
+            fill(sumB, sumB + SPAN, 0.0f);
+            fill(weights, weights + SPAN, 0.0f);
+
+            ptrdiff_t const p = y * w + x0;             // p + x is pixel x0 + x
+            for (int dy = -2; dy <= 2; ++dy)
+            {
+                int qy = y + dy * static_cast<int>(step);
+                if (qy < 0 or qy >= h)
+                    continue;
+
+                for (int dx = -2; dx <= 2; ++dx)
+                {
+                    int const offset = dx * static_cast<int>(step);
+                    ptrdiff_t const q = p + (qy - y) * w + offset;  // its tap
+                    float const kernel = KERNEL[dy + 2] * KERNEL[dx + 2];
+
+                    // taps must stay within the row
+                    ptrdiff_t const begin = max(x0, -offset) - x0;
+                    ptrdiff_t const end = min(x1, w - offset) - x0;
+                    for (ptrdiff_t x = begin; x < end; ++x)
+                    {
+                        float dr = red[q + x] - red[p + x];
+                        float dg = green[q + x] - green[p + x];
+                        float db = blue[q + x] - blue[p + x];
+
+                        float nx = normalX[q + x] - normalX[p + x];
+                        float ny = normalY[q + x] - normalY[p + x];
+                        float nz = normalZ[q + x] - normalZ[p + x];
+
+                        float ar = albedoR[q + x] - albedoR[p + x];
+                        float ag = albedoG[q + x] - albedoG[p + x];
+                        float ab = albedoB[q + x] - albedoB[p + x];
+
+                        // squared difference relative to both depths,
+                        // large between a hit and a miss
+                        float dz = depth[q + x] - depth[p + x];
+                        float dz2 = dz * dz / (depth[q + x] * depth[p + x]);
+
+                        float weight = kernel * falloff(
+                            (dr * dr + dg * dg + db * db) * colorWeight
+                          + (nx * nx + ny * ny + nz * nz) * normalWeight
+                          + dz2 * depthWeight
+                          + (ar * ar + ag * ag + ab * ab) * albedoWeight);
+
+                        weights[x] += weight;
+                        sumR[x] += weight * red[q + x];
+                        sumG[x] += weight * green[q + x];
+                        sumB[x] += weight * blue[q + x];
+                    }
+                }
+            }
+
+            // The center tap has a positive weight, so no sum is zero
+            for (int x = 0; x != x1 - x0; ++x)
+            {
+                out[0][p + x] = sumR[x] / weights[x];
+                out[1][p + x] = sumG[x] / weights[x];
+                out[2][p + x] = sumB[x] / weights[x];
+            }
+        }
+}
@@ -0,0 +1,55 @@
+#ifndef DENOISER_H_
+#define DENOISER_H_
+
+#include <vector>
+
+class Image;
+class ThreadPool;
+
+// Surface properties seen through each pixel, averaged over its samples:
+// the normal facing the eye, the distance of the hit and the material
+// color there. Pixels without hits have a depth of MISS and zero normal
+// and albedo.
+struct GuideBuffer
+{
+    static constexpr float MISS = 1E18f;
+
+    unsigned width;
+    unsigned height;
+    std::vector<float> normal[3];   // planar, one value per pixel
+    std::vector<float> depth;
+    std::vector<float> albedo[3];
+
+    GuideBuffer(unsigned width, unsigned height);
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010). Every pass
+// blurs with a 5x5 B3 spline kernel whose taps are 1, 2, 4, ... pixels
+// apart. Taps are weighted down by how much their color, normal, relative
+// depth and albedo differ from the center's, so edges stay sharp. The
+// color tolerance halves every pass. Rows are filtered as planar float
+// arrays on the thread pool.
+class Denoiser
+{
+    unsigned d_iterations;
+    float d_sigmaColor;
+    float d_sigmaNormal;
+    float d_sigmaDepth;
+    float d_sigmaAlbedo;
+
+    public:
+        Denoiser(unsigned iterations = 5, float sigmaColor = 0.5f,
+                 float sigmaNormal = 0.1f, float sigmaDepth = 0.05f,
+                 float sigmaAlbedo = 0.1f);
+
+        void apply(Image &img, GuideBuffer const &guides, ThreadPool &pool) const;
+
+    private:
+        // one pass over the rows [y0, y1) with taps step pixels apart
+        void filterRows(std::vector<float> const (&in)[3],
+                        std::vector<float> (&out)[3],
+                        GuideBuffer const &guides, unsigned step,
+                        float colorWeight, unsigned y0, unsigned y1) const;
+};
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef FILENAME_H_
+#define FILENAME_H_
+
+#include <string>
+
+// Where the extension of a file name starts: its last dot, if that is in
+// the last path component, else the end of the name. So "out/v1.2/img"
+// has no extension.
+inline std::string::size_type extensionPos(std::string const &filename)
+{
+    std::string::size_type dot = filename.find_last_of('.');
+    std::string::size_type slash = filename.find_last_of('/');
+    if (dot == std::string::npos or (slash != std::string::npos and dot < slash))
+        return filename.size();
+    return dot;
+}
+
+// the file name without its extension, if it has one
+inline std::string stripExtension(std::string const &filename)
+{
+    return filename.substr(0, extensionPos(filename));
+}
+
+#endif
@@ -0,0 +1,147 @@
+#include "gbuffer.h"
+
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[4] = {'G', 'B', 'F', '2'};
+
+    // Fields are stored one after the other in native byte order, the
+    // padding of the structs is never written
+    size_t const HEADER_BYTES = 4 + 3 * 4 + 8;
+    size_t const SAMPLE_BYTES = 4 + 4 + 6 * 8;
+
+    template <typename Value>
+    void put(vector<char> &out, Value const &value)
+    {
+        char const *bytes = reinterpret_cast<char const *>(&value);
+        out.insert(out.end(), bytes, bytes + sizeof(value));
+    }
+
+    template <typename Value>
+    void get(char const *&in, Value &value)
+    {
+        memcpy(&value, in, sizeof(value));
+        in += sizeof(value);
+    }
+}
+
+GBuffer::GBuffer(unsigned width, unsigned height, unsigned samplesPerPixel,
+                 uint64_t key)
+:
+    d_samples(static_cast<size_t>(width) * height * samplesPerPixel),
+    d_width(width),
+    d_height(height),
+    d_samplesPerPixel(samplesPerPixel),
+    d_key(key),
+    d_complete(false)
+{}
+
+bool GBuffer::read(string const &filename)
+{
+    ifstream infile(filename, ios::binary);
+    if (!infile)
+        return false;
+
+    vector<char> bytes(HEADER_BYTES);
+    if (!infile.read(bytes.data(), bytes.size()))
+        return false;
+
+    char const *in = bytes.data();
+    char magic[4];
+    uint32_t width;
+    uint32_t height;
+    uint32_t samplesPerPixel;
+    uint64_t key;
+    get(in, magic);
+    get(in, width);
+    get(in, height);
+    get(in, samplesPerPixel);
+    get(in, key);
+
+    if (memcmp(magic, MAGIC, sizeof(MAGIC)) != 0
+        or width != d_width or height != d_height
+        or samplesPerPixel != d_samplesPerPixel or key != d_key)
+        return false;
+
+    // A row of samples at a time
+    vector<Sample> samples(d_samples.size());
+    size_t const perRow = static_cast<size_t>(d_width) * d_samplesPerPixel;
+    bytes.resize(perRow * SAMPLE_BYTES);
+    for (size_t first = 0; first != samples.size(); first += perRow)
+    {
+        if (!infile.read(bytes.data(), bytes.size()))
+            return false;
+
+        in = bytes.data();
+        for (size_t idx = first; idx != first + perRow; ++idx)
+        {
+            Sample &sample = samples[idx];
+            get(in, sample.object);
+            get(in, sample.part);
+            get(in, sample.t);
+            get(in, sample.N);
+            get(in, sample.uv);
+        }
+    }
+
+    d_samples.swap(samples);
+    d_complete = true;
+    return true;
+}
+
+void GBuffer::write(string const &filename) const
+{
+    ofstream outfile(filename, ios::binary);
+    if (!outfile)
+        throw runtime_error("Could not open " + filename + " for writing.");
+
+    vector<char> bytes;
+    bytes.reserve(HEADER_BYTES);
+    bytes.insert(bytes.end(), MAGIC, MAGIC + sizeof(MAGIC));
+    put(bytes, static_cast<uint32_t>(d_width));
+    put(bytes, static_cast<uint32_t>(d_height));
+    put(bytes, static_cast<uint32_t>(d_samplesPerPixel));
+    put(bytes, d_key);
+    outfile.write(bytes.data(), bytes.size());
+
+    size_t const perRow = static_cast<size_t>(d_width) * d_samplesPerPixel;
+    for (size_t first = 0; first != d_samples.size(); first += perRow)
+    {
+        bytes.clear();
+        for (size_t idx = first; idx != first + perRow; ++idx)
+        {
+            Sample const &sample = d_samples[idx];
+            put(bytes, sample.object);
+            put(bytes, sample.part);
+            put(bytes, sample.t);
+            put(bytes, sample.N);
+            put(bytes, sample.uv);
+        }
+        outfile.write(bytes.data(), bytes.size());
+    }
+}
+
+bool GBuffer::complete() const
+{
+    return d_complete;
+}
+
+void GBuffer::markComplete()
+{
+    d_complete = true;
+}
+
+GBuffer::Sample const &GBuffer::operator()(unsigned x, unsigned y, unsigned n) const
+{
+    return d_samples.at(index(x, y, n));
+}
+
+GBuffer::Sample &GBuffer::operator()(unsigned x, unsigned y, unsigned n)
+{
+    return d_samples.at(index(x, y, n));
+}
@@ -0,0 +1,58 @@
+#ifndef GBUFFER_H_
+#define GBUFFER_H_
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Primary visibility of every sample of an image: which object the eye ray
+// hit, where, and the surface normal and texture coordinates there. As long
+// as geometry and camera are unchanged (see key), a render can shade from
+// this buffer instead of intersecting the primary rays again.
+class GBuffer
+{
+    public:
+        struct Sample
+        {
+            std::int32_t object;    // index in the scene, NO_OBJECT on a miss
+            std::uint32_t part;     // primitive hit within the object
+            double t;               // distance of hit
+            double N[3];            // normal at hit
+            double uv[2];           // texture coordinates at hit
+        };
+
+        static std::int32_t const NO_OBJECT = -1;
+
+    private:
+        std::vector<Sample> d_samples;
+        unsigned d_width;
+        unsigned d_height;
+        unsigned d_samplesPerPixel;
+        std::uint64_t d_key;        // hash of geometry and camera
+        bool d_complete;
+
+    public:
+        GBuffer(unsigned width, unsigned height, unsigned samplesPerPixel,
+                std::uint64_t key);
+
+        // Load a buffer written by write(). Returns false, leaving this
+        // buffer untouched, if the file is missing or was made for another
+        // image size, sampling rate or key.
+        bool read(std::string const &filename);
+        void write(std::string const &filename) const;
+
+        // complete: every sample has been filled in by a render
+        bool complete() const;
+        void markComplete();
+
+        Sample const &operator()(unsigned x, unsigned y, unsigned n) const;
+        Sample &operator()(unsigned x, unsigned y, unsigned n);
+
+    private:
+        inline size_t index(unsigned x, unsigned y, unsigned n) const
+        {
+            return (static_cast<size_t>(y) * d_width + x) * d_samplesPerPixel + n;
+        }
+};
+
+#endif
@@ -0,0 +1,55 @@
+#include "hash.h"
+
+#include <fstream>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    uint64_t const OFFSET_BASIS = 14695981039346656037ull;
+    uint64_t const PRIME = 1099511628211ull;
+}
+
+Hash::Hash()
+:
+    d_value(OFFSET_BASIS)
+{}
+
+Hash &Hash::add(void const *data, size_t size)
+{
+    unsigned char const *bytes = static_cast<unsigned char const *>(data);
+    for (size_t idx = 0; idx != size; ++idx)
+        d_value = (d_value ^ bytes[idx]) * PRIME;
+    return *this;
+}
+
+Hash &Hash::add(string const &text)
+{
+    // the length first, so consecutive strings cannot run into each other
+    add(static_cast<uint64_t>(text.size()));
+    return add(text.data(), text.size());
+}
+
+Hash &Hash::add(uint64_t value)
+{
+    // little endian, so the value does not depend on the platform
+    unsigned char bytes[8];
+    for (unsigned byte = 0; byte != 8; ++byte)
+        bytes[byte] = value >> (8 * byte) & 0xFF;
+    return add(bytes, sizeof bytes);
+}
+
+Hash &Hash::addFile(string const &filename)
+{
+    ifstream file(filename, ios::binary);
+    vector<char> block(1 << 16);
+    while (file.read(block.data(), block.size()) or file.gcount() != 0)
+        add(block.data(), file.gcount());
+    return *this;
+}
+
+uint64_t Hash::value() const
+{
+    return d_value;
+}
@@ -0,0 +1,28 @@
+#ifndef HASH_H_
+#define HASH_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// 64-bit FNV-1a over a sequence of bytes. Unlike std::hash its values are
+// the same in every build and on every platform, so they can key files
+// that outlive the program: caches, checkpoints and cluster files.
+class Hash
+{
+    std::uint64_t d_value;
+
+    public:
+        Hash();
+
+        Hash &add(void const *data, std::size_t size);
+        Hash &add(std::string const &text);
+        Hash &add(std::uint64_t value);
+
+        // the bytes of a file, read in blocks; nothing if it cannot be read
+        Hash &addFile(std::string const &filename);
+
+        std::uint64_t value() const;
+};
+
+#endif
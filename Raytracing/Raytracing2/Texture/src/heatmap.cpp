@@ -0,0 +1,96 @@
+#include "heatmap.h"
+
+#include "image.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+using namespace std;
+
+Heatmap::Heatmap(unsigned width, unsigned height, Metric metric)
+:
+    d_cost(static_cast<size_t>(width) * height),
+    d_width(width),
+    d_height(height),
+    d_metric(metric)
+{}
+
+bool Heatmap::parseMetric(string const &name, Metric &metric)
+{
+    if (name == "time")
+        metric = TIME;
+    else if (name == "rays")
+        metric = RAYS;
+    else if (name == "tests")
+        metric = TESTS;
+    else
+        return false;
+    return true;
+}
+
+Heatmap::Metric Heatmap::metric() const
+{
+    return d_metric;
+}
+
+double Heatmap::measure() const
+{
+    RenderStats const &stats = RenderStats::local();
+    switch (d_metric)
+    {
+        case TIME:
+            return chrono::duration<double, nano>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+        case RAYS:
+            return stats.counters[RenderStats::PRIMARY_RAYS]
+                 + stats.counters[RenderStats::SHADOW_RAYS]
+                 + stats.counters[RenderStats::REFLECTION_RAYS]
+                 + stats.counters[RenderStats::REFRACTION_RAYS];
+        default:
+            return stats.counters[RenderStats::SPHERE_TESTS]
+                 + stats.counters[RenderStats::QUAD_TESTS]
+                 + stats.counters[RenderStats::TRIANGLE_TESTS]
+                 + stats.counters[RenderStats::NODE_VISITS];
+    }
+}
+
+double Heatmap::operator()(unsigned x, unsigned y) const
+{
+    return d_cost.at(index(x, y));
+}
+
+double &Heatmap::operator()(unsigned x, unsigned y)
+{
+    return d_cost.at(index(x, y));
+}
+
+Image Heatmap::toImage() const
+{
+    Image img(d_width, d_height);
+    if (d_cost.empty())
+        return img;
+
+    auto range = minmax_element(d_cost.begin(), d_cost.end());
+    double low = log1p(max(*range.first, 0.0));
+    double high = log1p(max(*range.second, 0.0));
+    double scale = high > low ? 1.0 / (high - low) : 0.0;
+
+    for (unsigned y = 0; y != d_height; ++y)
+        for (unsigned x = 0; x != d_width; ++x)
+        {
+            // Each channel ramps up over its own third of the range
+            double level = 3.0 * (log1p(max((*this)(x, y), 0.0)) - low) * scale;
+            img(x, y) = Color(min(level, 1.0),
+                              min(max(level - 1.0, 0.0), 1.0),
+                              min(max(level - 2.0, 0.0), 1.0));
+        }
+
+    return img;
+}
+
+void Heatmap::write_png(string const &filename) const
+{
+    toImage().write_png(filename);
+}
@@ -0,0 +1,55 @@
+#ifndef HEATMAP_H_
+#define HEATMAP_H_
+
+#include <string>
+#include <vector>
+
+class Image;
+
+// Per-pixel cost of a render, measured as wall-clock nanoseconds, rays
+// traced or intersection tests. Ray and test counts come from RenderStats,
+// so they stay zero when the counters are compiled out.
+class Heatmap
+{
+    public:
+        enum Metric
+        {
+            TIME,
+            RAYS,
+            TESTS
+        };
+
+    private:
+        std::vector<double> d_cost;
+        unsigned d_width;
+        unsigned d_height;
+        Metric d_metric;
+
+    public:
+        Heatmap(unsigned width, unsigned height, Metric metric);
+
+        // "time", "rays" or "tests", returns false for anything else
+        static bool parseMetric(std::string const &name, Metric &metric);
+
+        Metric metric() const;
+
+        // Running total of the metric on the calling thread, the cost of
+        // a pixel is the difference of the totals after and before it
+        double measure() const;
+
+        double operator()(unsigned x, unsigned y) const;
+        double &operator()(unsigned x, unsigned y);
+
+        // False colors on a log scale, from black for the cheapest pixel
+        // through red and yellow to white for the most expensive one
+        Image toImage() const;
+        void write_png(std::string const &filename) const;
+
+    private:
+        inline size_t index(unsigned x, unsigned y) const
+        {
+            return static_cast<size_t>(y) * d_width + x;
+        }
+};
+
+#endif
@@ -9,11 +9,13 @@ class Hit
     public:
         double t;   // distance of hit
         Vector N;   // Normal at hit
+        unsigned part;  // primitive hit within an object made of several
 
-        Hit(double time, Vector const &normal)
+        Hit(double time, Vector const &normal, unsigned part = 0)
         :
             t(time),
-            N(normal)
+            N(normal),
+            part(part)
         {}
 
         static Hit const NO_HIT()
@@ -1,29 +1,351 @@
 #include "image.h"
 
+#include "filename.h"
+#include "threadpool.h"
+
 #include "lode/lodepng.h"
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
 #include <fstream>
+#include <sstream>
 
 using namespace std;
 
-Image::Image(unsigned width, unsigned height)
+namespace
+{
+    // Clamped to [0, 1] first, NaN becomes 0
+    unsigned char toByte(double channel)
+    {
+        return static_cast<unsigned char>(min(max(0.0, channel), 1.0) * 255.0);
+    }
+
+    // in lower case, including the dot
+    string extensionOf(string const &filename)
+    {
+        string extension = filename.substr(extensionPos(filename));
+        for (char &ch : extension)
+            ch = tolower(ch);
+        return extension;
+    }
+
+    // Big endian, as PNG and zlib store numbers
+    void putBigEndian(vector<unsigned char> &out, uint32_t value)
+    {
+        for (unsigned shift = 32; shift != 0; shift -= 8)
+            out.push_back(value >> (shift - 8) & 0xFF);
+    }
+
+    // Little endian output for the raw formats
+    void putU16(vector<unsigned char> &out, uint16_t value)
+    {
+        out.push_back(value & 0xFF);
+        out.push_back(value >> 8);
+    }
+
+    void putU32(vector<unsigned char> &out, uint32_t value)
+    {
+        for (unsigned byte = 0; byte != 4; ++byte)
+            out.push_back(value >> (8 * byte) & 0xFF);
+    }
+
+    void putU64(vector<unsigned char> &out, uint64_t value)
+    {
+        putU32(out, value & 0xFFFFFFFF);
+        putU32(out, value >> 32);
+    }
+
+    void putFloat(vector<unsigned char> &out, float value)
+    {
+        uint32_t bits;
+        memcpy(&bits, &value, sizeof bits);
+        putU32(out, bits);
+    }
+
+    void putString(vector<unsigned char> &out, char const *str)
+    {
+        out.insert(out.end(), str, str + strlen(str) + 1);
+    }
+
+    void putAttribute(vector<unsigned char> &out, char const *name,
+                      char const *type, uint32_t size)
+    {
+        putString(out, name);
+        putString(out, type);
+        putU32(out, size);
+    }
+
+    string pfmHeader(unsigned width, unsigned height)
+    {
+        ostringstream header;
+        header << "PF\n" << width << ' ' << height << "\n-1.0\n";
+        return header.str();
+    }
+
+    void putPfmRow(vector<unsigned char> &out, Image const &img, unsigned y)
+    {
+        for (unsigned x = 0; x != img.width(); ++x)
+        {
+            RGB32F const &pixel = img(x, y);
+            putFloat(out, pixel.r);
+            putFloat(out, pixel.g);
+            putFloat(out, pixel.b);
+        }
+    }
+
+    // Header and offset table of a single part, uncompressed scanline
+    // OpenEXR file with half B, G and R channels (channels are listed
+    // alphabetically). Rows are of fixed size, so the offsets are known
+    // before any row is written; the rows follow in order, see putExrRow.
+    vector<unsigned char> exrHeader(unsigned width, unsigned height,
+                                    vector<pair<string, string>> const &text)
+    {
+        vector<unsigned char> exr = {0x76, 0x2f, 0x31, 0x01};
+        putU32(exr, 2);                     // version 2, no flags
+
+        char const *const channels[] = {"B", "G", "R"};
+        putAttribute(exr, "channels", "chlist", 3 * 18 + 1);
+        for (char const *channel : channels)
+        {
+            putString(exr, channel);
+            putU32(exr, 1);                 // HALF
+            putU32(exr, 0);                 // pLinear and reserved
+            putU32(exr, 1);                 // x and y sampling
+            putU32(exr, 1);
+        }
+        exr.push_back(0);
+
+        putAttribute(exr, "compression", "compression", 1);
+        exr.push_back(0);                   // NO_COMPRESSION
+        for (char const *window : {"dataWindow", "displayWindow"})
+        {
+            putAttribute(exr, window, "box2i", 16);
+            putU32(exr, 0);
+            putU32(exr, 0);
+            putU32(exr, width - 1);
+            putU32(exr, height - 1);
+        }
+        putAttribute(exr, "lineOrder", "lineOrder", 1);
+        exr.push_back(0);                   // INCREASING_Y
+        putAttribute(exr, "pixelAspectRatio", "float", 4);
+        putFloat(exr, 1.0);
+        putAttribute(exr, "screenWindowCenter", "v2f", 8);
+        putFloat(exr, 0.0);
+        putFloat(exr, 0.0);
+        putAttribute(exr, "screenWindowWidth", "float", 4);
+        putFloat(exr, 1.0);
+        for (auto const &entry : text)
+        {
+            putAttribute(exr, entry.first.c_str(), "string", entry.second.size());
+            exr.insert(exr.end(), entry.second.begin(), entry.second.end());
+        }
+        exr.push_back(0);                   // end of the header
+
+        uint32_t rowBytes = width * 3 * 2;
+        uint64_t offset = exr.size() + height * 8ul;
+        for (unsigned y = 0; y != height; ++y)
+            putU64(exr, offset + y * (8ul + rowBytes));
+        return exr;
+    }
+
+    // One chunk per scanline: y, size and the row of each channel in turn
+    void putExrRow(vector<unsigned char> &out, Image const &img, unsigned y)
+    {
+        unsigned const width = img.width();
+        putU32(out, y);
+        putU32(out, width * 3 * 2);
+
+        // A channel is converted in one loop and stored in another, which
+        // keeps the conversion free of stores to single bytes
+        vector<uint16_t> halfs(width);
+        RGB32F const *row = &img(0, y);
+        for (float RGB32F::*channel : {&RGB32F::b, &RGB32F::g, &RGB32F::r})
+        {
+            for (unsigned x = 0; x != width; ++x)
+                halfs[x] = toHalf(row[x].*channel);
+            for (uint16_t half : halfs)
+                putU16(out, half);
+        }
+    }
+
+    // Window size, nice match length and lazy matching of levels 1 to 9,
+    // level 6 is lodepng's default
+    struct CompressionLevel
+    {
+        unsigned windowsize;
+        unsigned nicematch;
+        unsigned lazymatching;
+    };
+
+    CompressionLevel const LEVELS[9] = {
+        {256, 16, 0},
+        {512, 32, 0},
+        {1024, 32, 0},
+        {1024, 64, 1},
+        {2048, 96, 1},
+        {2048, 128, 1},
+        {4096, 192, 1},
+        {8192, 258, 1},
+        {32768, 258, 1}
+    };
+
+    void setCompressionLevel(LodePNGCompressSettings &settings, unsigned level)
+    {
+        if (level == 0)
+        {
+            settings.btype = 0;     // stored blocks
+            return;
+        }
+
+        CompressionLevel const &values = LEVELS[min(level, 9u) - 1];
+        settings.windowsize = values.windowsize;
+        settings.nicematch = values.nicematch;
+        settings.lazymatching = values.lazymatching;
+    }
+
+    // Bands of the filtered scanlines are deflated in parallel. Their size
+    // is fixed, so the file does not depend on the number of threads.
+    size_t const BAND_BYTES = 1 << 16;
+
+    // custom_context points to the ThreadPool pointer
+    unsigned parallelZlib(unsigned char **out, size_t *outsize,
+                          unsigned char const *in, size_t insize,
+                          LodePNGCompressSettings const *settings)
+    {
+        ThreadPool &pool = **static_cast<ThreadPool *const *>(settings->custom_context);
+
+        size_t numBands = max<size_t>(1, (insize + BAND_BYTES - 1) / BAND_BYTES);
+        vector<unsigned char *> parts(numBands, nullptr);
+        vector<size_t> partSizes(numBands, 0);
+        vector<unsigned> errors(numBands, 0);
+
+        vector<future<void>> bands;
+        for (size_t band = 0; band != numBands; ++band)
+            bands.push_back(pool.submit([&, band]
+            {
+                size_t begin = band * BAND_BYTES;
+                size_t end = min(insize, begin + BAND_BYTES);
+                errors[band] = lodepng_deflate_part(&parts[band], &partSizes[band],
+                                                    in + begin, end - begin,
+                                                    settings, band + 1 == numBands);
+            }));
+        for (auto &band : bands)
+            band.get();
+
+        // zlib header as lodepng writes it, the deflate data and the
+        // Adler-32 checksum (big endian) of all input
+        vector<unsigned char> stream = {0x78, 0x01};
+        unsigned error = 0;
+        for (size_t band = 0; band != numBands; ++band)
+        {
+            stream.insert(stream.end(), parts[band], parts[band] + partSizes[band]);
+            free(parts[band]);
+            if (error == 0)
+                error = errors[band];
+        }
+        putBigEndian(stream, lodepng_update_adler32(1, in, insize));
+
+        *out = static_cast<unsigned char *>(malloc(stream.size()));
+        if (*out == nullptr)
+            return 83;              // lodepng's allocation error
+        memcpy(*out, stream.data(), stream.size());
+        *outsize = stream.size();
+        return error;
+    }
+}
+
+// --- Pixel formats -----------------------------------------------------------
+
+RGB32F::RGB32F(Color const &color)
 :
-    d_pixels(width * height),
-    d_width(width),
-    d_height(height)
+    r(color.r),
+    g(color.g),
+    b(color.b)
 {}
 
-Image::Image(string const &filename)
+RGB32F::operator Color() const
 {
-    read_png(filename);
+    return Color(r, g, b);
 }
 
+RGBA8::RGBA8(Color const &color)
+:
+    r(toByte(color.r)),
+    g(toByte(color.g)),
+    b(toByte(color.b))
+{}
+
+RGBA8::operator Color() const
+{
+    return Color(r / 255.0, g / 255.0, b / 255.0);
+}
+
+// Computes every case and selects one, without branches, so the loops over
+// pixels that call it can be vectorized
+
+uint16_t toHalf(float value)
+{
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof bits);
+    uint32_t sign = bits >> 16 & 0x8000;
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    // Rebias the exponent from 127 to 15, round off 13 mantissa bits to
+    // nearest even. Rounding up to 65520 carries into infinity.
+    uint32_t normal = (magnitude - 0x38000000 + 0xFFF + (magnitude >> 13 & 1)) >> 13;
+
+    // Subnormal, in steps of 2^-24: adding 0.5 rounds to such a step and
+    // leaves the count in the low mantissa bits
+    float scaled;
+    memcpy(&scaled, &magnitude, sizeof scaled);
+    scaled += 0.5f;
+    uint32_t subnormal;
+    memcpy(&subnormal, &scaled, sizeof subnormal);
+    subnormal -= 0x3F000000;
+
+    // infinity stays, NaN stays NaN
+    uint32_t special = magnitude > 0x7F800000 ? 0x7E00 : 0x7C00;
+
+    uint32_t half = magnitude < 0x38800000 ? subnormal
+                    : magnitude < 0x47800000 ? normal : special;
+    return sign | half;
+}
+
+// --- BasicImage --------------------------------------------------------------
+
+template <typename Pixel>
+BasicImage<Pixel>::BasicImage(unsigned width, unsigned height)
+:
+    d_pixels(width * height),
+    d_width(width),
+    d_height(height),
+    d_firstRow(0),
+    d_rows(height)
+{}
+
+template <typename Pixel>
+BasicImage<Pixel>::BasicImage(unsigned width, unsigned height,
+                              unsigned firstRow, unsigned rows)
+:
+    d_pixels(width * rows),
+    d_width(width),
+    d_height(height),
+    d_firstRow(firstRow),
+    d_rows(rows)
+{}
+
 // normal accessors
-void Image::put_pixel(unsigned x, unsigned y, Color const &c)
+template <typename Pixel>
+void BasicImage<Pixel>::put_pixel(unsigned x, unsigned y, Color const &c)
 {
     (*this)(x, y) = c;
 }
-Color Image::get_pixel(unsigned x, unsigned y) const
+template <typename Pixel>
+Color BasicImage<Pixel>::get_pixel(unsigned x, unsigned y) const
 {
     return (*this)(x, y);
 }
@@ -31,69 +353,326 @@ Color Image::get_pixel(unsigned x, unsigned y) const
 // Handier accessors
 // Usage: color = img(x,y);
 //        img(x,y) = color;
-Color const&Image::operator()(unsigned x, unsigned y) const
+template <typename Pixel>
+Pixel const &BasicImage<Pixel>::operator()(unsigned x, unsigned y) const
 {
     return d_pixels.at(index(x, y));
 }
-Color &Image::operator()(unsigned x, unsigned y)
+template <typename Pixel>
+Pixel &BasicImage<Pixel>::operator()(unsigned x, unsigned y)
 {
     return d_pixels.at(index(x, y));
 }
 
-unsigned Image::width() const
+template <typename Pixel>
+unsigned BasicImage<Pixel>::width() const
 {
     return d_width;
 }
 
-unsigned Image::height() const
+template <typename Pixel>
+unsigned BasicImage<Pixel>::height() const
 {
     return d_height;
 }
 
-unsigned Image::size() const
+template <typename Pixel>
+unsigned BasicImage<Pixel>::firstRow() const
+{
+    return d_firstRow;
+}
+
+template <typename Pixel>
+unsigned BasicImage<Pixel>::rows() const
+{
+    return d_rows;
+}
+
+template <typename Pixel>
+unsigned BasicImage<Pixel>::size() const
+{
+    return d_width * d_rows;
+}
+
+template <typename Pixel>
+vector<Pixel> const &BasicImage<Pixel>::pixels() const
 {
-    return d_width * d_height;
+    return d_pixels;
 }
 
 // Normalized accessors, unsignederval is (0...1, 0...1)
 // usefull for texture access
-Color const &Image::colorAt(float x, float y) const
+template <typename Pixel>
+Color BasicImage<Pixel>::colorAt(float x, float y) const
 {
     return d_pixels.at(findex(x, y));
 }
 
-void Image::write_png(std::string const &filename) const
+template class BasicImage<RGB32F>;
+template class BasicImage<RGBA8>;
+
+// --- Image -------------------------------------------------------------------
+
+void Image::addText(string const &key, string const &value)
+{
+    d_text.emplace_back(key, value);
+}
+
+bool Image::write(string const &filename, unsigned level, ThreadPool *pool) const
 {
+    string extension = extensionOf(filename);
+    if (extension == ".ppm")
+        return write_ppm(filename);
+    if (extension == ".pfm")
+        return write_pfm(filename);
+    if (extension == ".exr")
+        return write_exr(filename);
+    return write_png(filename, level, pool);
+}
+
+bool Image::write_png(string const &filename, unsigned level, ThreadPool *pool) const
+{
+    vector<unsigned char> image = quantized();
+
+    // lodepng picks the smallest color type that holds the pixels, RGBA
+    // input (as before) and RGB input give the same file
+    lodepng::State state;
+    state.info_raw.colortype = LCT_RGB;
+    setCompressionLevel(state.encoder.zlibsettings, level);
+    for (auto const &text : d_text)
+        lodepng_add_text(&state.info_png, text.first.c_str(), text.second.c_str());
+    if (pool)
+    {
+        state.encoder.zlibsettings.custom_zlib = parallelZlib;
+        state.encoder.zlibsettings.custom_context = &pool;
+    }
+
+    vector<unsigned char> png;
+    unsigned error = lodepng::encode(png, image, d_width, d_height, state);
+    if (!error)
+        error = lodepng::save_file(png, filename);
+    return error == 0;
+}
+
+bool Image::write_ppm(string const &filename) const
+{
+    vector<unsigned char> image = quantized();
+
+    ofstream file(filename, ios::binary);
+    file << "P6\n";
+    for (auto const &text : d_text)
+        file << "# " << text.first << ": " << text.second << '\n';
+    file << d_width << ' ' << d_height << "\n255\n";
+    file.write(reinterpret_cast<char const *>(image.data()), image.size());
+    return file.good();
+}
+
+bool Image::write_pfm(string const &filename) const
+{
+    // Unclamped floats, little endian (negative scale), bottom row first
     vector<unsigned char> image;
-    image.reserve(size() * 4);  // reserves size (less allocations)
-    for (Color pixel : d_pixels)
+    image.reserve(size() * 12);
+    for (unsigned y = d_height; y-- != 0; )
+        putPfmRow(image, *this, y);
+
+    ofstream file(filename, ios::binary);
+    file << pfmHeader(d_width, d_height);
+    file.write(reinterpret_cast<char const *>(image.data()), image.size());
+    return file.good();
+}
+
+bool Image::write_exr(string const &filename) const
+{
+    vector<unsigned char> exr = exrHeader(d_width, d_height, d_text);
+    exr.reserve(exr.size() + d_height * (8ul + d_width * 3 * 2));
+    for (unsigned y = 0; y != d_height; ++y)
+        putExrRow(exr, *this, y);
+
+    ofstream file(filename, ios::binary);
+    file.write(reinterpret_cast<char const *>(exr.data()), exr.size());
+    return file.good();
+}
+
+vector<unsigned char> Image::quantized() const
+{
+    vector<unsigned char> image(size() * 3);
+    unsigned char *out = image.data();
+    for (RGB32F const &pixel : d_pixels)
     {
-        image.push_back(static_cast<unsigned char>(pixel.r * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.g * 255.0));
-        image.push_back(static_cast<unsigned char>(pixel.b * 255.0));
-        image.push_back(255);   // alpha is always 1
+        *out++ = toByte(pixel.r);
+        *out++ = toByte(pixel.g);
+        *out++ = toByte(pixel.b);
     }
+    return image;
+}
+
+// --- Texture -----------------------------------------------------------------
 
-    lodepng::encode(filename, image, d_width, d_height);
+Texture::Texture(string const &filename)
+{
+    read_png(filename);
 }
 
-void Image::read_png(std::string const &filename)
+void Texture::read_png(string const &filename)
 {
     vector<unsigned char> image;
     lodepng::decode(image, d_width, d_height, filename);
-    d_pixels.reserve(size());
+    d_firstRow = 0;
+    d_rows = d_height;
 
-    auto imgIter = image.begin();
-    while (imgIter != image.end())
+    // lodepng decodes to RGBA8, the layout of the texels
+    static_assert(sizeof(RGBA8) == 4, "texels are copied as decoded");
+    d_pixels.resize(size());
+    memcpy(d_pixels.data(), image.data(), min(image.size(), size() * sizeof(RGBA8)));
+}
+
+// --- ImageStream -------------------------------------------------------------
+
+ImageStream::ImageStream(string const &filename, unsigned width,
+                         unsigned height, unsigned level)
+:
+    d_file(filename, ios::binary),
+    d_width(width),
+    d_height(height),
+    d_level(level),
+    d_format(formatOf(filename)),
+    d_dataStart(0),
+    d_nextRow(0),
+    d_adler(1)
+{
+    if (d_format == PPM)
+    {
+        d_file << "P6\n" << width << ' ' << height << "\n255\n";
+        return;
+    }
+    if (d_format == PFM)
+    {
+        d_file << pfmHeader(width, height);
+        d_dataStart = d_file.tellp();
+        return;
+    }
+    if (d_format == EXR)
+    {
+        // the offsets of all rows are known up front
+        vector<unsigned char> header = exrHeader(width, height, {});
+        d_file.write(reinterpret_cast<char const *>(header.data()), header.size());
+        return;
+    }
+
+    unsigned char const signature[] = {137, 80, 78, 71, 13, 10, 26, 10};
+    d_file.write(reinterpret_cast<char const *>(signature), sizeof signature);
+
+    // 8-bit RGB, no interlacing
+    vector<unsigned char> header;
+    putBigEndian(header, width);
+    putBigEndian(header, height);
+    header.insert(header.end(), {8, LCT_RGB, 0, 0, 0});
+    writeChunk("IHDR", header);
+}
+
+bool ImageStream::write(Image const &band)
+{
+    if (band.firstRow() != d_nextRow or band.width() != d_width
+        or band.rows() == 0 or d_nextRow + band.rows() > d_height)
+        return false;
+
+    bool first = d_nextRow == 0;
+    d_nextRow += band.rows();
+
+    if (d_format == PNG)
+        return writePng(band, first);
+
+    vector<unsigned char> rows;
+    if (d_format == PPM)
+        rows = band.quantized();
+    else if (d_format == EXR)
+    {
+        rows.reserve(band.rows() * (8ul + d_width * 3 * 2));
+        for (unsigned y = band.firstRow(); y != d_nextRow; ++y)
+            putExrRow(rows, band, y);
+    }
+    else
     {
-        double r = (*imgIter) / 255.0;
-        ++imgIter;
-        double g = (*imgIter) / 255.0;
-        ++imgIter;
-        double b = (*imgIter) / 255.0;
-        ++imgIter;
-        // Ignore Alpha
-        ++imgIter;
-        d_pixels.push_back(Color(r, g, b));
+        // PFM stores rows bottom up, so the band goes bottom row first, to
+        // its fixed place after the header
+        unsigned lastRow = d_nextRow - 1;
+        rows.reserve(band.size() * 12);
+        for (unsigned y = d_nextRow; y-- != band.firstRow(); )
+            putPfmRow(rows, band, y);
+        d_file.seekp(d_dataStart + streamoff(d_height - 1 - lastRow) * d_width * 12);
     }
+
+    d_file.write(reinterpret_cast<char const *>(rows.data()), rows.size());
+    return d_file.good();
+}
+
+bool ImageStream::good() const
+{
+    return d_file.good();
+}
+
+ImageStream::Format ImageStream::formatOf(string const &filename)
+{
+    string extension = extensionOf(filename);
+    return extension == ".ppm" ? PPM
+         : extension == ".pfm" ? PFM
+         : extension == ".exr" ? EXR
+         : PNG;
+}
+
+bool ImageStream::writePng(Image const &band, bool first)
+{
+    vector<unsigned char> rows = band.quantized();
+
+    LodePNGEncoderSettings settings;
+    lodepng_encoder_settings_init(&settings);
+    setCompressionLevel(settings.zlibsettings, d_level);
+
+    LodePNGColorMode color;
+    lodepng_color_mode_init(&color);
+    color.colortype = LCT_RGB;
+    color.bitdepth = 8;
+
+    // Filtering continues from the last row of the previous band
+    vector<unsigned char> filtered(band.rows() * (1 + 3 * d_width));
+    unsigned error = lodepng_filter_rows(filtered.data(), rows.data(),
+        first ? nullptr : d_lastRow.data(), d_width, band.rows(), &color,
+        &settings);
+    d_lastRow.assign(rows.end() - 3 * d_width, rows.end());
+    d_adler = lodepng_update_adler32(d_adler, filtered.data(), filtered.size());
+
+    // Each band is a run of deflate blocks in its own IDAT chunk, the
+    // first one opens the zlib stream and the last one closes it
+    bool last = d_nextRow == d_height;
+    unsigned char *deflated = nullptr;
+    size_t deflatedSize = 0;
+    if (!error)
+        error = lodepng_deflate_part(&deflated, &deflatedSize, filtered.data(),
+                                     filtered.size(), &settings.zlibsettings,
+                                     last);
+
+    vector<unsigned char> data;
+    if (first)
+        data = {0x78, 0x01};
+    data.insert(data.end(), deflated, deflated + deflatedSize);
+    free(deflated);
+    if (last)
+        putBigEndian(data, d_adler);
+
+    writeChunk("IDAT", data);
+    if (last)
+        writeChunk("IEND", {});
+    return error == 0 and d_file.good();
+}
+
+void ImageStream::writeChunk(char const *type, vector<unsigned char> const &data)
+{
+    vector<unsigned char> chunk;
+    chunk.reserve(data.size() + 12);
+    putBigEndian(chunk, data.size());
+    chunk.insert(chunk.end(), type, type + 4);
+    chunk.insert(chunk.end(), data.begin(), data.end());
+    putBigEndian(chunk, lodepng_crc32(&chunk[4], data.size() + 4));
+
+    d_file.write(reinterpret_cast<char const *>(chunk.data()), chunk.size());
 }
@@ -3,18 +3,72 @@
 
 #include "triple.h"
 
+#include <cstdint>
+#include <fstream>
 #include <string>
+#include <utility>
 #include <vector>
 
-class Image
+class ThreadPool;
+
+// Pixel formats, each converts from and to Color
+struct RGB32F       // float RGB, for renders
 {
-    std::vector<Color> d_pixels;
-    unsigned d_width;
-    unsigned d_height;
+    float r = 0.0f;
+    float g = 0.0f;
+    float b = 0.0f;
+
+    RGB32F() = default;
+    RGB32F(Color const &color);
+    operator Color() const;
+};
+
+struct RGBA8        // 8 bits per channel, for textures as decoded
+{
+    unsigned char r = 0;
+    unsigned char g = 0;
+    unsigned char b = 0;
+    unsigned char a = 255;
+
+    RGBA8() = default;
+    RGBA8(Color const &color);
+    operator Color() const;
+};
+
+// IEEE 754 half precision, rounding to nearest even, as EXR output stores it
+std::uint16_t toHalf(float value);
+
+// Pixels of one format. Instantiated for the formats above.
+template <typename Pixel>
+class BasicImage
+{
+    protected:
+        std::vector<Pixel> d_pixels;
+        unsigned d_width;
+        unsigned d_height;
+
+        // A band holds only the rows [d_firstRow, d_firstRow + d_rows)
+        unsigned d_firstRow;
+        unsigned d_rows;
 
     public:
-        Image(unsigned width = 0, unsigned height = 0);
-        Image(std::string const &filename);
+        BasicImage(unsigned width = 0, unsigned height = 0);
+
+        // A band of rows of a width x height image, accessed with the
+        // coordinates of the whole image
+        BasicImage(unsigned width, unsigned height, unsigned firstRow,
+                   unsigned rows);
+
+        // Converts every pixel of another format
+        template <typename Other>
+        explicit BasicImage(BasicImage<Other> const &other)
+        :
+            d_pixels(other.pixels().begin(), other.pixels().end()),
+            d_width(other.width()),
+            d_height(other.height()),
+            d_firstRow(other.firstRow()),
+            d_rows(other.rows())
+        {}
 
         // normal accessors
         void put_pixel(unsigned x, unsigned y, Color const &c);
@@ -23,24 +77,26 @@ class Image
         // Handier accessors
         // Usage: color = img(x,y);
         //        img(x,y) = color;
-        Color const &operator()(unsigned x, unsigned y) const;
-        Color &operator()(unsigned x, unsigned y);
+        Pixel const &operator()(unsigned x, unsigned y) const;
+        Pixel &operator()(unsigned x, unsigned y);
 
         unsigned width() const;
         unsigned height() const;
-        unsigned size() const;
+        unsigned firstRow() const;
+        unsigned rows() const;
+        unsigned size() const;      // of the rows held
+
+        // the rows held, top to bottom
+        std::vector<Pixel> const &pixels() const;
 
         // Normalized accessors, unsignederval is (0...1, 0...1)
         // usefull for texture access
-        Color const &colorAt(float x, float y) const;
-
-        void write_png(std::string const &filename) const;
-        void read_png(std::string const &filename);
+        Color colorAt(float x, float y) const;
 
-    private:
+    protected:
         inline unsigned index(unsigned x, unsigned y) const
         {
-            return y * d_width + x;
+            return (y - d_firstRow) * d_width + x;
         }
 
         inline unsigned findex(float x, float y) const
@@ -49,7 +105,91 @@ class Image
                 static_cast<unsigned>(x * (d_width - 1)),
                 static_cast<unsigned>(y * (d_height - 1)));
         }
+};
+
+// Render target: float RGB, written to file in several formats
+class Image: public BasicImage<RGB32F>
+{
+    // Key and value pairs written with the pixels
+    std::vector<std::pair<std::string, std::string>> d_text;
+
+    public:
+        using BasicImage::BasicImage;
+
+        // Stored as tEXt chunks in PNG, comment lines in PPM and string
+        // attributes in EXR; PFM has no room for it. Values are one line.
+        void addText(std::string const &key, std::string const &value);
+
+        // The format follows the extension: .ppm, .pfm (floats) and .exr
+        // (uncompressed halfs) are written straight from the pixels,
+        // anything else as PNG. Returns false if the file was not written.
+        bool write(std::string const &filename, unsigned level = 6,
+                   ThreadPool *pool = nullptr) const;
+
+        // Compression level 0 (stored) to 9, 6 is lodepng's default. Given
+        // a pool, bands of scanlines are deflated in parallel as independent
+        // blocks; the file does not depend on the number of threads.
+        bool write_png(std::string const &filename, unsigned level = 6,
+                       ThreadPool *pool = nullptr) const;
+        bool write_ppm(std::string const &filename) const;
+        bool write_pfm(std::string const &filename) const;
+        bool write_exr(std::string const &filename) const;
+
+        // The rows held as 8-bit RGB, as the writers store them
+        std::vector<unsigned char> quantized() const;
+};
+
+// Decoded PNG, kept as its 8-bit texels
+class Texture: public BasicImage<RGBA8>
+{
+    public:
+        Texture(std::string const &filename);
+
+        void read_png(std::string const &filename);
+};
+
+// Writes an image a band of rows at a time, top to bottom, holding no more
+// than one band of converted rows. The format follows the extension, as for
+// Image::write: the PNG deflate stream is continued with every band, EXR
+// rows are of fixed size so the offset table is written up front, and PFM
+// bands are written bottom up to their place in the file.
+class ImageStream
+{
+    enum Format
+    {
+        PPM,
+        PNG,
+        PFM,
+        EXR
+    };
+
+    std::ofstream d_file;
+    unsigned d_width;
+    unsigned d_height;
+    unsigned d_level;
+    Format d_format;
+    std::streamoff d_dataStart;             // PFM: the first pixel byte
+
+    unsigned d_nextRow;                     // rows written so far
+    unsigned d_adler;                       // of the filtered scanlines
+    std::vector<unsigned char> d_lastRow;   // unfiltered, for the next band
+
+    public:
+        // level as for Image::write_png
+        ImageStream(std::string const &filename, unsigned width,
+                    unsigned height, unsigned level = 6);
+
+        // Append a band, it must start at the next row. Returns false if
+        // writing failed.
+        bool write(Image const &band);
+
+        bool good() const;
+
+    private:
+        static Format formatOf(std::string const &filename);
 
+        bool writePng(Image const &band, bool first);
+        void writeChunk(char const *type, std::vector<unsigned char> const &data);
 };
 
 #endif
@@ -0,0 +1,84 @@
+#include "imagediff.h"
+
+#include "image.h"
+#include "triple.h"
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+using namespace std;
+
+namespace
+{
+    // The value write_png stores for a channel, back in 0..1
+    double quantize(double channel)
+    {
+        return static_cast<unsigned char>(channel * 255.0) / 255.0;
+    }
+
+    double linearize(double srgb)
+    {
+        return srgb <= 0.04045 ? srgb / 12.92 : pow((srgb + 0.055) / 1.055, 2.4);
+    }
+
+    // sRGB color to CIELAB under the D65 white point
+    Triple toLab(Color const &color)
+    {
+        double r = linearize(quantize(color.r));
+        double g = linearize(quantize(color.g));
+        double b = linearize(quantize(color.b));
+
+        double xyz[3] = {
+            (0.4124 * r + 0.3576 * g + 0.1805 * b) / 0.95047,
+            (0.2126 * r + 0.7152 * g + 0.0722 * b) / 1.00000,
+            (0.0193 * r + 0.1192 * g + 0.9505 * b) / 1.08883
+        };
+        for (double &value : xyz)
+            value = value > 216.0 / 24389.0
+                    ? cbrt(value) : (24389.0 / 27.0 * value + 16.0) / 116.0;
+
+        return Triple(116.0 * xyz[1] - 16.0,
+                      500.0 * (xyz[0] - xyz[1]),
+                      200.0 * (xyz[1] - xyz[2]));
+    }
+}
+
+ImageDiff::ImageDiff(Image const &image, Texture const &reference)
+:
+    pixels(image.size())
+{
+    if (image.width() != reference.width()
+        or image.height() != reference.height())
+    {
+        maxError = 1.0;
+        meanDeltaE = maxDeltaE = numeric_limits<double>::infinity();
+        noticeable = pixels;
+        return;
+    }
+
+    double sumDeltaE = 0.0;
+    for (unsigned y = 0; y != image.height(); ++y)
+        for (unsigned x = 0; x != image.width(); ++x)
+        {
+            Color lhs = image(x, y);
+            Color rhs = reference(x, y);
+            for (unsigned idx = 0; idx != 3; ++idx)
+                maxError = max(maxError,
+                    fabs(quantize(lhs.data[idx]) - quantize(rhs.data[idx])));
+
+            double deltaE = (toLab(lhs) - toLab(rhs)).length();
+            sumDeltaE += deltaE;
+            maxDeltaE = max(maxDeltaE, deltaE);
+            if (deltaE > NOTICEABLE)
+                ++noticeable;
+        }
+
+    if (pixels != 0)
+        meanDeltaE = sumDeltaE / pixels;
+}
+
+double ImageDiff::noticeableFraction() const
+{
+    return pixels == 0 ? 0.0 : static_cast<double>(noticeable) / pixels;
+}
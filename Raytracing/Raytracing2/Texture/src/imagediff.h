@@ -0,0 +1,26 @@
+#ifndef IMAGEDIFF_H_
+#define IMAGEDIFF_H_
+
+class Image;
+class Texture;
+
+// Difference between a render and a reference image, both compared as the
+// 8 bit values write_png stores. Perceptual error is the CIE76 colour
+// difference (delta E) in CIELAB, where about 2.3 is just noticeable.
+struct ImageDiff
+{
+    static constexpr double NOTICEABLE = 2.3;
+
+    double maxError = 0.0;          // largest channel difference, 0..1
+    double meanDeltaE = 0.0;
+    double maxDeltaE = 0.0;
+    unsigned noticeable = 0;        // pixels with a delta E above NOTICEABLE
+    unsigned pixels = 0;
+
+    // Images of different sizes differ everywhere
+    ImageDiff(Image const &image, Texture const &reference);
+
+    double noticeableFraction() const;
+};
+
+#endif
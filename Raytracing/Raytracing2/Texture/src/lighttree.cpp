@@ -0,0 +1,152 @@
+#include "lighttree.h"
+
+#include <algorithm>
+#include <cmath>
+#include <numeric>
+
+using namespace std;
+
+LightTree::LightTree(vector<LightPtr> const &lights)
+:
+    d_lights(lights)
+{
+    if (d_lights.empty())
+        return;
+
+    vector<unsigned> order(d_lights.size());
+    iota(order.begin(), order.end(), 0);
+
+    d_nodes.reserve(2 * d_lights.size() - 1);
+    build(order, 0, order.size());
+}
+
+bool LightTree::sample(Point const &P, Vector const &N, double diffuse,
+                       double specular, double threshold, double u,
+                       unsigned &light, double &pdf) const
+{
+    if (d_nodes.empty() or bound(d_nodes[0], P, N, diffuse, specular) <= threshold)
+        return false;
+
+    pdf = 1.0;
+    Node const *node = &d_nodes[0];
+    while (node->right != LEAF)
+    {
+        RenderStats::count(RenderStats::NODE_VISITS, 2);
+
+        Node const &left = d_nodes[node->left];
+        Node const &right = d_nodes[node->right];
+
+        double wLeft = bound(left, P, N, diffuse, specular);
+        double wRight = bound(right, P, N, diffuse, specular);
+        if (wLeft <= threshold)
+            wLeft = 0.0;
+        if (wRight <= threshold)
+            wRight = 0.0;
+
+        // The children can be culled where their parent was not
+        if (wLeft + wRight == 0.0)
+            return false;
+
+        // Choose a child and rescale u to [0, 1) for the next level
+        double pLeft = wLeft / (wLeft + wRight);
+        if (u < pLeft)
+        {
+            u /= pLeft;
+            pdf *= pLeft;
+            node = &left;
+        }
+        else
+        {
+            u = (u - pLeft) / (1.0 - pLeft);
+            pdf *= 1.0 - pLeft;
+            node = &right;
+        }
+        u = min(u, nextafter(1.0, 0.0));
+    }
+
+    light = node->left;
+    return true;
+}
+
+unsigned LightTree::build(vector<unsigned> &order, unsigned begin,
+                          unsigned end)
+{
+    unsigned idx = d_nodes.size();
+    d_nodes.push_back(Node());
+
+    Node node;
+    node.lower = node.upper = d_lights[order[begin]]->position;
+    node.intensity = 0.0;
+    for (unsigned pos = begin; pos != end; ++pos)
+    {
+        Light const &light = *d_lights[order[pos]];
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            node.lower.data[axis] = min(node.lower.data[axis], light.position.data[axis]);
+            node.upper.data[axis] = max(node.upper.data[axis], light.position.data[axis]);
+        }
+        node.intensity += max({light.color.r, light.color.g, light.color.b});
+    }
+
+    if (end - begin == 1)
+    {
+        node.left = order[begin];
+        node.right = LEAF;
+    }
+    else
+    {
+        // Split the lights at the median of the longest axis
+        Vector extent = node.upper - node.lower;
+        unsigned axis = 0;
+        if (extent.y > extent.data[axis])
+            axis = 1;
+        if (extent.z > extent.data[axis])
+            axis = 2;
+
+        unsigned mid = begin + (end - begin) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid,
+                    order.begin() + end,
+                    [this, axis](unsigned lhs, unsigned rhs)
+                    {
+                        return d_lights[lhs]->position.data[axis]
+                               < d_lights[rhs]->position.data[axis];
+                    });
+
+        node.left = build(order, begin, mid);
+        node.right = build(order, mid, end);
+    }
+
+    d_nodes[idx] = node;
+    return idx;
+}
+
+double LightTree::bound(Node const &node, Point const &P, Vector const &N,
+                        double diffuse, double specular) const
+{
+    // Bound the cone of directions from P to the node by its bounding sphere
+    Point center = (node.lower + node.upper) / 2.0;
+    double radius = (node.upper - node.lower).length() / 2.0;
+
+    Vector D = center - P;
+    double distance = D.length();
+    if (distance <= radius)
+        return (diffuse + specular) * node.intensity;
+
+    // The largest cosine is cos(max(alpha - theta, 0)), with alpha the angle
+    // between N and D and theta the half angle of the cone.
+    double cosAlpha = N.dot(D) / distance;
+    double sinTheta = radius / distance;
+    double cosTheta = sqrt(1.0 - sinTheta * sinTheta);
+
+    double cosine = 1.0;
+    if (cosAlpha < cosTheta)
+    {
+        double sinAlpha = sqrt(max(1.0 - cosAlpha * cosAlpha, 0.0));
+        cosine = max(cosAlpha * cosTheta + sinAlpha * sinTheta, 0.0);
+    }
+
+    // The highlight is as bright at any angle above the horizon
+    if (cosine == 0.0)
+        return 0.0;
+    return (diffuse * cosine + specular) * node.intensity;
+}
@@ -0,0 +1,93 @@
+#ifndef LIGHTTREE_H_
+#define LIGHTTREE_H_
+
+#include "light.h"
+#include "stats.h"
+#include "triple.h"
+
+#include <vector>
+
+// Bounding volume hierarchy over point lights. Every node bounds the
+// positions of its lights and sums their intensities, so the contribution
+// of a whole cluster to a shading point can be bounded at once.
+//
+// The bound of a cluster is (diffuse * cos + specular) * intensity, where
+// cos bounds the cosine between the shading normal and the directions to
+// its lights, and diffuse and specular are the largest reflectances of the
+// material. The highlight does not fall off with cos, so only the diffuse
+// part is scaled by it. Clusters bounded at or below the threshold are
+// culled; those behind the shading point are bounded by 0 and so are
+// always culled.
+class LightTree
+{
+    struct Node
+    {
+        Point lower;            // bounds of the light positions
+        Point upper;
+        double intensity;       // summed maximum color component
+        unsigned left;          // first child, or the light of a leaf
+        unsigned right;         // second child, LEAF for a leaf
+    };
+
+    static unsigned const LEAF = ~0u;
+
+    std::vector<LightPtr> d_lights;
+    std::vector<Node> d_nodes;  // root first
+
+    public:
+        explicit LightTree(std::vector<LightPtr> const &lights);
+
+        // visit the index of every light in clusters bounded above the
+        // threshold, indices are those of the vector the tree was built from
+        template <typename Visitor>
+        void forEach(Point const &P, Vector const &N, double diffuse,
+                     double specular, double threshold, Visitor visit) const;
+
+        // Pick a light by descending the tree, choosing children in
+        // proportion to their bounds. u is uniform in [0, 1). Returns
+        // false if every light is culled, else sets light to the index of
+        // the picked light and pdf to the chance of having picked it.
+        bool sample(Point const &P, Vector const &N, double diffuse,
+                    double specular, double threshold, double u,
+                    unsigned &light, double &pdf) const;
+
+    private:
+        unsigned build(std::vector<unsigned> &order, unsigned begin,
+                       unsigned end);
+
+        double bound(Node const &node, Point const &P, Vector const &N,
+                     double diffuse, double specular) const;
+};
+
+template <typename Visitor>
+void LightTree::forEach(Point const &P, Vector const &N, double diffuse,
+                        double specular, double threshold,
+                        Visitor visit) const
+{
+    if (d_nodes.empty())
+        return;
+
+    // Median splits keep the depth logarithmic, so this never overflows
+    unsigned stack[64];
+    unsigned top = 0;
+    stack[top++] = 0;
+
+    while (top != 0)
+    {
+        Node const &node = d_nodes[stack[--top]];
+        RenderStats::count(RenderStats::NODE_VISITS);
+        if (bound(node, P, N, diffuse, specular) <= threshold)
+            continue;
+
+        if (node.right == LEAF)
+        {
+            visit(node.left);
+            continue;
+        }
+
+        stack[top++] = node.right;
+        stack[top++] = node.left;
+    }
+}
+
+#endif
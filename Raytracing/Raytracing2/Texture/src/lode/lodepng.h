@@ -618,6 +618,16 @@ typedef struct LodePNGEncoderSettings
 } LodePNGEncoderSettings;
 
 void lodepng_encoder_settings_init(LodePNGEncoderSettings* settings);
+
+/*
+Filter h scanlines of a non-interlaced image for PNG filter method 0, as the
+encoder does. prevline is the unfiltered scanline above the first one, or NULL
+for the top of the image. out needs room for h * (1 + bytes per scanline).
+This allows encoding an image in bands of scanlines.
+*/
+unsigned lodepng_filter_rows(unsigned char* out, const unsigned char* in, const unsigned char* prevline,
+                             unsigned w, unsigned h,
+                             const LodePNGColorMode* info, const LodePNGEncoderSettings* settings);
 #endif /*LODEPNG_COMPILE_ENCODER*/
 
 
@@ -791,6 +801,19 @@ unsigned lodepng_deflate(unsigned char** out, size_t* outsize,
                          const unsigned char* in, size_t insize,
                          const LodePNGCompressSettings* settings);
 
+/*
+Same as lodepng_deflate, but if final is 0 the output does not end the deflate
+stream: it is padded to a byte boundary, so that independently compressed parts
+can be concatenated. Only the last part is given final 1.
+*/
+unsigned lodepng_deflate_part(unsigned char** out, size_t* outsize,
+                              const unsigned char* in, size_t insize,
+                              const LodePNGCompressSettings* settings, unsigned final);
+
+/*Continue the Adler-32 checksum of a zlib stream with these bytes, the checksum
+of no bytes is 1*/
+unsigned lodepng_update_adler32(unsigned adler, const unsigned char* data, size_t len);
+
 #endif /*LODEPNG_COMPILE_ENCODER*/
 #endif /*LODEPNG_COMPILE_ZLIB*/
 
@@ -1,5 +1,9 @@
+#include "batchrenderer.h"
+#include "filename.h"
 #include "raytracer.h"
+#include "renderserver.h"
 
+#include <exception>
 #include <iostream>
 #include <string>
 
@@ -7,14 +11,59 @@ using namespace std;
 
 int main(int argc, char *argv[])
 {
-    cout << "Computer Graphics - Ray tracer\n\n";
+    // the server's cout carries only its JSON replies
+    if (argc < 2 || string(argv[1]) != "--server")
+        cout << "Computer Graphics - Ray tracer\n\n";
 
-    if (argc < 2 || argc > 3)
+    if (argc < 2 || argc > (string(argv[1]) == "--batch" ? 4 : 3))
     {
-        cerr << "Usage: " << argv[0] << " in-file [out-file.png]\n";
+        cerr << "Usage: " << argv[0] << " in-file [out-file.png|.ppm|.pfm|.exr]\n"
+                "       " << argv[0] << " --server [threads]\n"
+                "       " << argv[0] << " --batch manifest.json [threads]\n";
         return 1;
     }
 
+    if (string(argv[1]) == "--server")
+    {
+        unsigned threads = 0;
+        try
+        {
+            if (argc == 3)
+                threads = stoul(argv[2]);
+        }
+        catch (exception const &)
+        {
+            cerr << "Usage: " << argv[0] << " --server [threads]\n";
+            return 1;
+        }
+
+        // render requests from stdin until "quit"
+        RenderServer server(cout, threads);
+        server.run(cin);
+        return 0;
+    }
+
+    if (string(argv[1]) == "--batch")
+    {
+        // render the scenes of a manifest, sharing threads and assets
+        if (argc < 3)
+        {
+            cerr << "Usage: " << argv[0] << " --batch manifest.json [threads]\n";
+            return 1;
+        }
+
+        try
+        {
+            BatchRenderer batch(cout, argc == 4 ? stoul(argv[3]) : 0);
+            return batch.run(argv[2]) == 0 ? 0 : 1;
+        }
+        catch (exception const &ex)
+        {
+            cerr << "Error: " << ex.what() << '\n';
+            return 1;
+        }
+    }
+
     Raytracer raytracer;
 
     // read the scene
@@ -33,12 +82,9 @@ int main(int argc, char *argv[])
     }
     else
     {
-        ofname = argv[1];   // replace .json with .png
-        ofname.erase(ofname.begin() + ofname.find_last_of('.'), ofname.end());
-        ofname += ".png";
+        ofname = stripExtension(argv[1]) + ".png";  // replace .json with .png
     }
 
-    raytracer.renderToFile(ofname);
-
-    return 0;
+    // a render that differs from its reference image fails
+    return raytracer.renderToFile(ofname) ? 0 : 1;
 }
@@ -4,6 +4,8 @@
 #include "image.h"
 #include "triple.h"
 
+#include <memory>
+
 class Material
 {
     public:
@@ -14,7 +16,7 @@ class Material
         double n;           // exponent for specular highlight size
 
         bool hasTexture = false;
-        Image texture;
+        std::shared_ptr<Texture const> texture;  // shared by materials using it
 
         bool isTransparent = false;
         double nt = 1.0;
@@ -33,7 +35,8 @@ class Material
             texture()
         {}
 
-        Material(Image const &texture, double ka, double kd, double ks, double n)
+        Material(std::shared_ptr<Texture const> const &texture,
+                 double ka, double kd, double ks, double n)
         :
             color(),
             ka(ka),
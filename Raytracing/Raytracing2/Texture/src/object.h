@@ -1,8 +1,6 @@
 #ifndef OBJECT_H_
 #define OBJECT_H_
 
-#include "material.h"
-
 // not really needed here, but deriving classes may need them
 #include "hit.h"
 #include "ray.h"
@@ -15,14 +13,27 @@ typedef std::shared_ptr<Object> ObjectPtr;
 class Object
 {
     public:
-        Material material;
+        unsigned material = 0;  // index in the material table of the scene
 
         virtual ~Object() = default;
 
-        virtual Hit intersect(Ray const &ray) = 0;  // must be implemented
-                                                    // in derived class
+        virtual Hit intersect(Ray const &ray) const = 0;    // must be implemented
+                                                            // in derived class
+
+        // material index at a hit, objects with several materials
+        // override this
+        virtual unsigned materialAt(Hit const &hit) const
+        {
+            return material;
+        }
+
+        // axis aligned box around the object, false if it has none
+        virtual bool bounds(Point &lower, Point &upper) const
+        {
+            return false;
+        }
 
-        virtual Vector toUV(Point const &hit)
+        virtual Vector toUV(Point const &hit) const
         {
             // bogus implementation
             return Vector{};
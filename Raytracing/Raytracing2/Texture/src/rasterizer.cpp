@@ -0,0 +1,147 @@
+#include "rasterizer.h"
+
+#include "shapes/quad.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+Rasterizer::Rasterizer(Point const &eye, unsigned width, unsigned height,
+                       unsigned samplesPerPixel, unsigned tileSize)
+:
+    d_eye(eye),
+    d_width(width),
+    d_height(height),
+    d_samples(samplesPerPixel),
+    d_tileSize(tileSize),
+    d_tilesX((width + tileSize - 1) / tileSize),
+    d_bins(d_tilesX * ((height + tileSize - 1) / tileSize))
+{}
+
+void Rasterizer::add(Sphere const &sphere, unsigned object)
+{
+    // The bounding cube contains the sphere, so its projection does too
+    Point corners[8];
+    for (unsigned corner = 0; corner != 8; ++corner)
+        for (unsigned axis = 0; axis != 3; ++axis)
+            corners[corner].data[axis] = sphere.position.data[axis]
+                + ((corner >> axis) & 1 ? sphere.r : -sphere.r);
+    add(SPHERE, &sphere, object, corners, 8);
+}
+
+void Rasterizer::add(Quad const &quad, unsigned object)
+{
+    Point corners[4] = {quad.v0, quad.v1, quad.v2, quad.v3};
+    add(QUAD, &quad, object, corners, 4);
+}
+
+void Rasterizer::add(Triangle const &triangle, unsigned object)
+{
+    Point corners[3] = {triangle.v0, triangle.v1, triangle.v2};
+    add(TRIANGLE, &triangle, object, corners, 3);
+}
+
+void Rasterizer::add(Kind kind, Object const *shape, unsigned object,
+                     Point const *corners, unsigned count)
+{
+    Primitive primitive{kind, shape, object, 0, 0, d_width, d_height};
+
+    // Corners at or behind the eye do not project, such shapes cover the
+    // whole image
+    bool projects = d_eye.z > 0.0;
+    for (unsigned idx = 0; idx != count; ++idx)
+        projects = projects and corners[idx].z < d_eye.z;
+
+    if (projects)
+    {
+        double uMin = HUGE_VAL, uMax = -HUGE_VAL;
+        double vMin = HUGE_VAL, vMax = -HUGE_VAL;
+        for (unsigned idx = 0; idx != count; ++idx)
+        {
+            Point const &corner = corners[idx];
+            double scale = d_eye.z / (d_eye.z - corner.z);
+            double u = d_eye.x + scale * (corner.x - d_eye.x);
+            double v = d_eye.y + scale * (corner.y - d_eye.y);
+            uMin = min(uMin, u);
+            uMax = max(uMax, u);
+            vMin = min(vMin, v);
+            vMax = max(vMax, v);
+        }
+
+        // Pixel (x, y) has its samples at u in (x, x + 1) and v in
+        // (h - 1 - y, h - y). Bounds get a pixel of margin for rounding.
+        double x0 = floor(uMin) - 1.0;
+        double x1 = floor(uMax) + 2.0;
+        double y0 = floor(d_height - 1.0 - vMax) - 1.0;
+        double y1 = floor(d_height - vMin) + 2.0;
+        if (x1 <= 0.0 or y1 <= 0.0 or x0 >= d_width or y0 >= d_height)
+            return;
+
+        primitive.x0 = max(x0, 0.0);
+        primitive.y0 = max(y0, 0.0);
+        primitive.x1 = min(x1, static_cast<double>(d_width));
+        primitive.y1 = min(y1, static_cast<double>(d_height));
+    }
+
+    unsigned idx = d_primitives.size();
+    d_primitives.push_back(primitive);
+
+    for (unsigned ty = primitive.y0 / d_tileSize;
+         ty * d_tileSize < primitive.y1; ++ty)
+        for (unsigned tx = primitive.x0 / d_tileSize;
+             tx * d_tileSize < primitive.x1; ++tx)
+            d_bins[ty * d_tilesX + tx].push_back(idx);
+}
+
+void Rasterizer::rasterize(unsigned x0, unsigned y0, vector<Ray> const &rays,
+                           vector<Hit> &hits, vector<unsigned> &objects) const
+{
+    for (unsigned idx : d_bins[y0 / d_tileSize * d_tilesX + x0 / d_tileSize])
+    {
+        Primitive const &primitive = d_primitives[idx];
+        switch (primitive.kind)
+        {
+            case SPHERE:
+                cover<Sphere>(primitive, x0, y0, rays, hits, objects);
+                break;
+            case QUAD:
+                cover<Quad>(primitive, x0, y0, rays, hits, objects);
+                break;
+            case TRIANGLE:
+                cover<Triangle>(primitive, x0, y0, rays, hits, objects);
+                break;
+        }
+    }
+}
+
+template <typename Shape>
+void Rasterizer::cover(Primitive const &primitive, unsigned x0, unsigned y0,
+                       vector<Ray> const &rays, vector<Hit> &hits,
+                       vector<unsigned> &objects) const
+{
+    // Shapes are final, so intersect is bound statically
+    Shape const &shape = *static_cast<Shape const *>(primitive.shape);
+
+    unsigned x1 = min(x0 + d_tileSize, d_width);
+    unsigned y1 = min(y0 + d_tileSize, d_height);
+    unsigned tileWidth = x1 - x0;
+
+    for (unsigned y = max(y0, primitive.y0); y < min(y1, primitive.y1); ++y)
+        for (unsigned x = max(x0, primitive.x0); x < min(x1, primitive.x1); ++x)
+        {
+            unsigned first = ((y - y0) * tileWidth + x - x0) * d_samples;
+            for (unsigned sample = first; sample != first + d_samples; ++sample)
+            {
+                Hit hit(shape.intersect(rays[sample]));
+                if (hit.t < hits[sample].t
+                    or (hit.t == hits[sample].t and primitive.object < objects[sample]))
+                {
+                    hits[sample] = hit;
+                    objects[sample] = primitive.object;
+                }
+            }
+        }
+}
@@ -0,0 +1,79 @@
+#ifndef RASTERIZER_H_
+#define RASTERIZER_H_
+
+#include "hit.h"
+#include "ray.h"
+#include "triple.h"
+
+#include <vector>
+
+class Object;
+class Quad;
+class Sphere;
+class Triangle;
+
+// Primary visibility by rasterization. Shapes are projected from the eye
+// onto the image plane z = 0, which primary rays pass through, and binned
+// into the tiles their screen bounds overlap. A tile then visits its shapes
+// and tests only the samples each one covers. Coverage and depth come from
+// the exact intersection of the shape, so the hits equal those of casting
+// the primary rays against every shape.
+class Rasterizer
+{
+    enum Kind
+    {
+        SPHERE,
+        QUAD,
+        TRIANGLE
+    };
+
+    struct Primitive
+    {
+        Kind kind;
+        Object const *shape;
+        unsigned object;        // index in the scene
+        unsigned x0;            // pixel bounds [x0, x1) x [y0, y1)
+        unsigned y0;
+        unsigned x1;
+        unsigned y1;
+    };
+
+    Point d_eye;
+    unsigned d_width;
+    unsigned d_height;
+    unsigned d_samples;         // per pixel
+    unsigned d_tileSize;
+    unsigned d_tilesX;
+    std::vector<Primitive> d_primitives;
+    std::vector<std::vector<unsigned>> d_bins;  // primitives per tile
+
+    public:
+        Rasterizer(Point const &eye, unsigned width, unsigned height,
+                   unsigned samplesPerPixel, unsigned tileSize);
+
+        // The shapes must outlive the rasterizer
+        void add(Sphere const &sphere, unsigned object);
+        void add(Quad const &quad, unsigned object);
+        void add(Triangle const &triangle, unsigned object);
+
+        // Closest hits in the tile starting at pixel (x0, y0), of size
+        // tileSize at most. rays, hits and objects hold the samples of the
+        // tile's pixels in row-major order. A hit replaces one that is
+        // farther away, or as close but of a higher object index.
+        void rasterize(unsigned x0, unsigned y0, std::vector<Ray> const &rays,
+                       std::vector<Hit> &hits,
+                       std::vector<unsigned> &objects) const;
+
+    private:
+        // bin a shape with the given corners of a convex hull
+        void add(Kind kind, Object const *shape, unsigned object,
+                 Point const *corners, unsigned count);
+
+        // test the samples of the tile at (x0, y0) that the shape covers
+        template <typename Shape>
+        void cover(Primitive const &primitive, unsigned x0, unsigned y0,
+                   std::vector<Ray> const &rays, std::vector<Hit> &hits,
+                   std::vector<unsigned> &objects) const;
+};
+
+#endif
@@ -1,16 +1,29 @@
 #include "raytracer.h"
 
+#include "assetcache.h"
+#include "checkpoint.h"
+#include "filename.h"
+#include "gbuffer.h"
+#include "hash.h"
+#include "heatmap.h"
 #include "image.h"
+#include "imagediff.h"
 #include "light.h"
 #include "material.h"
+#include "threadpool.h"
+#include "tilecache.h"
 #include "triple.h"
 
 // =============================================================================
 // -- Include all your shapes here ---------------------------------------------
 // =============================================================================
 
+#include "shapes/mesh.h"
 #include "shapes/quad.h"
 #include "shapes/sphere.h"
+#include "shapes/spherecloud.h"
+#include "shapes/streamedmesh.h"
+#include "shapes/triangle.h"
 
 // =============================================================================
 // -- End of shape includes ----------------------------------------------------
@@ -18,13 +31,52 @@
 
 #include "json/json.h"
 
+#include <chrono>
 #include <exception>
 #include <fstream>
+#include <functional>
 #include <iostream>
 
 using namespace std;        // no std:: required
 using json = nlohmann::json;
 
+namespace
+{
+    double secondsSince(chrono::steady_clock::time_point start)
+    {
+        return chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    }
+
+    // Hash of an object node and of the files it reads: meshes, sphere
+    // files and textures. Derived files, such as cluster files, are left out.
+    uint64_t objectKey(json const &node)
+    {
+        Hash key;
+        key.add(node.dump());
+        function<void(json const &, bool)> addFiles = [&](json const &item, bool top)
+        {
+            for (auto it = item.begin(); it != item.end(); ++it)
+            {
+                if (it->is_structured())
+                    addFiles(*it, false);
+                else if (item.is_object() and it->is_string()
+                         and (it.key() == "filename" or it.key() == "texture"
+                              or (top and it.key() == "file")))
+                    key.addFile(it->get<string>());
+            }
+        };
+        addFiles(node, true);
+        return key.value();
+    }
+}
+
+Raytracer::Raytracer(AssetCache *assets, ostream &out, ostream &err)
+:
+    assets(assets),
+    out(&out),
+    err(&err)
+{}
+
 bool Raytracer::parseObjectNode(json const &node)
 {
     ObjectPtr obj = nullptr;
@@ -57,9 +109,83 @@ bool Raytracer::parseObjectNode(json const &node)
         Point v3(node["v3"]);
         obj = ObjectPtr(new Quad(v0, v1, v2, v3));
     }
+    else if (node["type"] == "triangle")
+    {
+        Point v0(node["v0"]);
+        Point v1(node["v1"]);
+        Point v2(node["v2"]);
+        obj = ObjectPtr(new Triangle(v0, v1, v2));
+    }
+    else if (node["type"] == "mesh")
+    {
+        string filename = node["filename"];
+        Point position(node["position"]);
+        Vector rotation(node["rotation"]);
+        Vector scale(node["scale"]);
+
+        MeshBVH::Layout layout = MeshBVH::FULL;
+        if (node.count("bvh") and !MeshBVH::parseLayout(node["bvh"], layout))
+            throw runtime_error("Mesh bvh must be \"full\", \"quantized8\" or \"quantized16\".");
+
+        // Reading the model and building its hierarchies is timed as the
+        // BUILD phase rather than as parsing
+        if (node.count("streaming"))
+        {
+            // The cluster file is rewritten when the geometry or the model
+            // changes
+            json const &streaming = node["streaming"];
+            json geometry = node;
+            geometry.erase("material");
+            geometry["streaming"].erase("memoryLimit");
+            uint64_t key = objectKey(geometry);
+
+            auto buildStart = chrono::steady_clock::now();
+            obj = ObjectPtr(new StreamedMesh(streaming["file"], key, filename,
+                position, rotation, scale,
+                streaming.value("clusterTriangles", 4096u),
+                streaming["memoryLimit"].get<size_t>(), layout, *out));
+            stats.seconds[RenderStats::BUILD] += secondsSince(buildStart);
+        }
+        else
+        {
+            auto buildStart = chrono::steady_clock::now();
+            if (assets)
+                obj = ObjectPtr(new Mesh(assets->mesh(filename, position,
+                                                      rotation, scale, layout,
+                                                      *out)));
+            else
+                obj = ObjectPtr(new Mesh(filename, position, rotation, scale,
+                                         layout, *out));
+            stats.seconds[RenderStats::BUILD] += secondsSince(buildStart);
+        }
+    }
+    else if (node["type"] == "spheres")
+    {
+        // Spheres index "materials", or all use "material"
+        vector<unsigned> materials;
+        if (node.count("materials"))
+            for (auto const &materialNode : node["materials"])
+                materials.push_back(materialIndex(materialNode));
+        else
+            materials.push_back(materialIndex(node["material"]));
+
+        auto cloud = make_shared<SphereCloud>(materials);
+        for (auto const &sphereNode : node.value("spheres", json::array()))
+            cloud->add(Point(sphereNode["position"]), sphereNode["radius"],
+                       sphereNode.value("material", 0u));
+
+        if (node.count("file"))
+            cloud->read(node["file"], node.value("layout", "xyz"),
+                        node.value("radius", 1.0), *out);
+
+        auto buildStart = chrono::steady_clock::now();
+        cloud->build();
+        stats.seconds[RenderStats::BUILD] += secondsSince(buildStart);
+        obj = cloud;
+    }
     else
     {
-        cerr << "Unknown object type: " << node["type"] << ".\n";
+        *err << "Unknown object type: " << node["type"] << ".\n";
     }
 
 // =============================================================================
@@ -69,9 +195,10 @@ bool Raytracer::parseObjectNode(json const &node)
     if (!obj)
         return false;
 
-    // Parse material and add object to the scene
-    obj->material = parseMaterialNode(node["material"]);
-    scene.addObject(obj);
+    // Parse material and add object to the scene, sphere clouds did so
+    if (node["type"] != "spheres")
+        obj->material = materialIndex(node["material"]);
+    scene.addObject(obj, tileCache.empty() ? 0 : objectKey(node));
     return true;
 }
 
@@ -82,7 +209,19 @@ Light Raytracer::parseLightNode(json const &node) const
     return Light(pos, col);
 }
 
-Material Raytracer::parseMaterialNode(json const &node) const
+unsigned Raytracer::materialIndex(json const &node)
+{
+    string key = node.dump();
+    auto found = materialIndices.find(key);
+    if (found != materialIndices.end())
+        return found->second;
+
+    unsigned idx = scene.addMaterial(parseMaterialNode(node));
+    materialIndices[key] = idx;
+    return idx;
+}
+
+Material Raytracer::parseMaterialNode(json const &node)
 {
     double ka = node["ka"];
     double kd = node["kd"];
@@ -105,8 +244,11 @@ Material Raytracer::parseMaterialNode(json const &node) const
     if (node.count("texture"))
     {
         string imagePath = node["texture"];
-        Image im(imagePath);
-        return Material(im, ka, kd, ks, n);
+        shared_ptr<Texture const> &texture = textures[imagePath];
+        if (!texture)
+            texture = assets ? assets->texture(imagePath)
+                             : make_shared<Texture const>(imagePath);
+        return Material(texture, ka, kd, ks, n);
     }
 
     // No color or texture specified
@@ -116,6 +258,8 @@ Material Raytracer::parseMaterialNode(json const &node) const
 bool Raytracer::readScene(string const &ifname)
 try
 {
+    auto start = chrono::steady_clock::now();
+
     // Read and parse input json file
     ifstream infile(ifname);
     if (!infile) throw runtime_error("Could not open input file for reading.");
@@ -153,15 +297,215 @@ try
         scene.setRenderShadows(shadows);
     }
 
+    if (jsonscene.count("SortSecondaryRays"))
+    {
+        bool sort = jsonscene["SortSecondaryRays"];
+        scene.setSortSecondaryRays(sort);
+    }
+
+    rasterize = jsonscene.value("Rasterize", false);
+
+    if (jsonscene.count("GBufferCache"))
+    {
+        gbufferCache = jsonscene["GBufferCache"].get<string>();
+
+        // Primary visibility depends on the camera and the shapes of the
+        // objects, including the models they read, but not on their
+        // materials or on the lights. The key is stored with the buffer.
+        Hash key;
+        key.add(jsonscene["Eye"].dump());
+        for (json objectNode : jsonscene["Objects"])
+        {
+            objectNode.erase("material");
+            key.add(objectKey(objectNode));
+        }
+        geometryKey = key.value();
+    }
+
     for (auto const &lightNode : jsonscene["Lights"])
         scene.addLight(parseLightNode(lightNode));
 
+    if (jsonscene.count("LightCullingThreshold") or
+        jsonscene.count("ShadowRayBudget"))
+    {
+        double threshold = jsonscene.value("LightCullingThreshold", 0.0);
+        unsigned budget = jsonscene.value("ShadowRayBudget", 0u);
+
+        auto buildStart = chrono::steady_clock::now();
+        scene.setLightSampling(threshold, budget);
+        stats.seconds[RenderStats::BUILD] += secondsSince(buildStart);
+    }
+
+    if (jsonscene.count("WriteStatistics"))
+        writeStatistics = jsonscene["WriteStatistics"];
+
+    if (jsonscene.count("Heatmap"))
+    {
+        heatmapMetric = jsonscene["Heatmap"].get<string>();
+
+        Heatmap::Metric metric;
+        if (!Heatmap::parseMetric(heatmapMetric, metric))
+            throw runtime_error("Heatmap must be \"time\", \"rays\" or \"tests\".");
+        if (metric != Heatmap::TIME and not RenderStats::enabled)
+            *err << "Warning: built without RAYTRACER_STATS, the heatmap will be empty.\n";
+    }
+
+    if (jsonscene.count("Threads"))
+        threads = jsonscene["Threads"];
+
+    pngLevel = jsonscene.value("PngLevel", pngLevel);
+    pngParallel = jsonscene.value("PngParallel", pngParallel);
+    if (pngLevel > 9)
+        throw runtime_error("PngLevel must be 0 to 9.");
+
+    // Either true or the filter settings
+    if (jsonscene.count("Denoise"))
+    {
+        json node = jsonscene["Denoise"];
+        denoise = not node.is_boolean() or node.get<bool>();
+        if (!node.is_object())
+            node = json::object();
+        denoiser = Denoiser(node.value("Iterations", 5u),
+                            node.value("SigmaColor", 0.5f),
+                            node.value("SigmaNormal", 0.1f),
+                            node.value("SigmaDepth", 0.05f),
+                            node.value("SigmaAlbedo", 0.1f));
+    }
+
+    if (jsonscene.count("Reference"))
+    {
+        json const &node = jsonscene["Reference"];
+        reference = node["Image"].get<string>();
+        maxMeanDeltaE = node.value("MeanDeltaE", maxMeanDeltaE);
+        maxNoticeableFraction = node.value("NoticeablePixels", maxNoticeableFraction);
+    }
+
+    if (jsonscene.count("Size"))
+    {
+        width = jsonscene["Size"].at(0);
+        height = jsonscene["Size"].at(1);
+    }
+
+    // Either true or {"Window": bands in memory}
+    if (jsonscene.count("StreamOutput"))
+    {
+        json node = jsonscene["StreamOutput"];
+        streamOutput = not node.is_boolean() or node.get<bool>();
+        if (node.is_object())
+            streamWindow = node.value("Window", streamWindow);
+    }
+
+    // Either true or {"File": name, "Seconds": between writes}
+    if (jsonscene.count("Checkpoint"))
+    {
+        json node = jsonscene["Checkpoint"];
+        checkpoint = not node.is_boolean() or node.get<bool>();
+        if (node.is_object())
+        {
+            checkpointFile = node.value("File", checkpointFile);
+            checkpointSeconds = node.value("Seconds", checkpointSeconds);
+        }
+
+        // Settings that leave the image unchanged are not part of the key,
+        // the objects are keyed with the files they read
+        json keyed = jsonscene;
+        for (char const *name : {"Objects", "Checkpoint", "Threads",
+                                 "WriteStatistics", "PngLevel", "PngParallel"})
+            keyed.erase(name);
+        Hash key;
+        key.add(keyed.dump());
+        for (json const &objectNode : jsonscene["Objects"])
+            key.add(objectKey(objectNode));
+        sceneKey = key.value();
+    }
+
+    if (checkpoint and (streamOutput or rasterize or denoise
+                        or not gbufferCache.empty() or not heatmapMetric.empty()))
+        throw runtime_error("Checkpoint cannot be combined with StreamOutput, "
+                            "Rasterize, Denoise, GBufferCache or Heatmap.");
+
+    if (jsonscene.count("TileCache"))
+    {
+        tileCache = jsonscene["TileCache"].get<string>();
+
+        // The objects and camera are keyed per tile, the rest of the
+        // scene here. Settings that leave the image unchanged are left out.
+        json keyed = jsonscene;
+        for (char const *name : {"Objects", "Eye", "Size", "TileCache",
+                                 "Checkpoint", "Threads", "WriteStatistics",
+                                 "PngLevel", "PngParallel", "Reference"})
+            keyed.erase(name);
+        tileCacheKey = Hash().add(keyed.dump()).value();
+    }
+
+    if (not tileCache.empty() and (streamOutput or rasterize or denoise
+                                   or not gbufferCache.empty()
+                                   or not heatmapMetric.empty()
+                                   or jsonscene.count("Deadline")))
+        throw runtime_error("TileCache cannot be combined with StreamOutput, "
+                            "Rasterize, Denoise, GBufferCache, Heatmap or Deadline.");
+
+    if (jsonscene.count("Deadline"))
+    {
+        deadline = jsonscene["Deadline"];
+        lightThreshold = jsonscene.value("LightCullingThreshold", 0.0);
+
+        // From the scene's own settings down: fewer samples per pixel,
+        // fewer shadow rays, less recursion, then fewer pixels
+        Quality quality = {jsonscene.value("MaxRecursionDepth", 0u),
+                           jsonscene.value("SuperSamplingFactor", 1u),
+                           jsonscene.value("ShadowRayBudget", 0u), 1};
+        qualityLevels.assign(1, quality);
+        while (quality.superSample > 1)
+        {
+            --quality.superSample;
+            qualityLevels.push_back(quality);
+        }
+
+        unsigned lights = scene.getNumLights();
+        if (jsonscene.value("Shadows", false) and lights > 1)
+        {
+            unsigned rays = quality.shadowRays == 0 ? lights
+                                                    : min(quality.shadowRays, lights);
+            while (rays > 1)
+            {
+                quality.shadowRays = rays /= 2;
+                qualityLevels.push_back(quality);
+            }
+        }
+
+        while (quality.depth > 0)
+        {
+            --quality.depth;
+            qualityLevels.push_back(quality);
+        }
+
+        for (unsigned scale : {2, 4, 8})
+        {
+            quality.scale = scale;
+            qualityLevels.push_back(quality);
+        }
+    }
+
+    if (deadline > 0.0 and (streamOutput or checkpoint or rasterize or denoise
+                            or not gbufferCache.empty() or not heatmapMetric.empty()))
+        throw runtime_error("Deadline cannot be combined with StreamOutput, "
+                            "Checkpoint, Rasterize, Denoise, GBufferCache or Heatmap.");
+
+    if (streamOutput and (rasterize or denoise or not gbufferCache.empty()
+                          or not heatmapMetric.empty() or not reference.empty()))
+        throw runtime_error("StreamOutput cannot be combined with Rasterize, "
+                            "Denoise, GBufferCache, Heatmap or Reference.");
+
     unsigned objCount = 0;
     for (auto const &objectNode : jsonscene["Objects"])
         if (parseObjectNode(objectNode))
             ++objCount;
 
-    cout << "Parsed " << objCount << " objects.\n";
+    *out << "Parsed " << objCount << " objects.\n";
+
+    stats.seconds[RenderStats::PARSE] = secondsSince(start)
+                                      - stats.seconds[RenderStats::BUILD];
 
 // =============================================================================
 // -- End of scene data reading ------------------------------------------------
@@ -171,17 +515,299 @@ try
 }
 catch (exception const &ex)
 {
-    cerr << ex.what() << '\n';
+    *err << ex.what() << '\n';
     return false;
 }
 
-void Raytracer::renderToFile(string const &ofname)
+bool Raytracer::renderToFile(string const &ofname)
+{
+    ThreadPool pool(threads);
+    return renderToFile(ofname, pool);
+}
+
+bool Raytracer::renderToFile(string const &ofname, ThreadPool &pool)
+{
+    if (streamOutput)
+        return renderStreamed(ofname, pool);
+
+    Image img(width, height);
+
+    // The metric was validated by readScene
+    Heatmap::Metric metric = Heatmap::TIME;
+    Heatmap::parseMetric(heatmapMetric, metric);
+    Heatmap heatmap(img.width(), img.height(), metric);
+    Heatmap *costs = heatmapMetric.empty() ? nullptr : &heatmap;
+
+    string basename = stripExtension(ofname);
+
+    unique_ptr<Checkpoint> progress;
+    if (checkpoint)
+    {
+        string filename = checkpointFile.empty() ? basename + ".checkpoint"
+                                                 : checkpointFile;
+        progress.reset(new Checkpoint(filename, checkpointSeconds, img.width(),
+                                      img.height(), scene.getTileSize(),
+                                      sceneKey, *err));
+        if (progress->read(img))
+            *out << "Resuming from " << filename << ": " << progress->finished()
+                 << " of " << progress->tiles() << " tiles done.\n";
+    }
+
+    unique_ptr<TileCache> cache;
+    if (not tileCache.empty())
+        cache.reset(new TileCache(tileCache, tileCacheKey, *err));
+
+    auto start = chrono::steady_clock::now();
+    if (deadline > 0.0)
+        renderToDeadline(img, pool);
+    else if (gbufferCache.empty() and not rasterize and not denoise)
+    {
+        *out << "Tracing...\n";
+        stats += scene.render(img, pool, 0, nullptr, costs, progress.get(),
+                              cache.get());
+        if (cache)
+            *out << "Reused " << cache->hits() << " of "
+                 << cache->hits() + cache->misses() << " tiles from "
+                 << tileCache << ".\n";
+    }
+    else
+    {
+        unsigned samples = scene.getSuperSample() * scene.getSuperSample();
+        GBuffer gbuffer(img.width(), img.height(), samples, geometryKey);
+        bool cached = not gbufferCache.empty() and gbuffer.read(gbufferCache);
+        if (cached)
+            *out << "Shading from primary hits in " << gbufferCache << "...\n";
+        else if (rasterize)
+        {
+            *out << "Rasterizing primary hits...\n";
+            stats += scene.rasterize(gbuffer, img.width(), img.height(), pool);
+        }
+        else
+            *out << "Tracing and saving primary hits to " << gbufferCache << "...\n";
+
+        stats += scene.render(img, pool, 0, &gbuffer, costs);
+        if (not cached and not gbufferCache.empty())
+            gbuffer.write(gbufferCache);
+
+        if (denoise)
+        {
+            *out << "Denoising...\n";
+            auto denoiseStart = chrono::steady_clock::now();
+            GuideBuffer guides(img.width(), img.height());
+            scene.gatherGuides(gbuffer, guides);
+            denoiser.apply(img, guides, pool);
+            stats.seconds[RenderStats::DENOISE] = secondsSince(denoiseStart);
+        }
+    }
+
+    stats.seconds[RenderStats::TRACE] = secondsSince(start)
+                                      - stats.seconds[RenderStats::DENOISE];
+
+    *out << "Writing image to " << ofname << "...\n";
+    start = chrono::steady_clock::now();
+    if (!img.write(ofname, pngLevel, pngParallel ? &pool : nullptr))
+    {
+        *err << "Error: cannot write " << ofname << ".\n";
+        return false;
+    }
+    stats.seconds[RenderStats::ENCODE] = secondsSince(start);
+
+    if (progress)
+        progress->remove();
+
+    stats.print(*out);
+
+    if (costs)
+    {
+        string heatmapname = basename + ".heatmap.png";
+        *out << "Writing " << heatmapMetric << " heatmap to " << heatmapname << "...\n";
+        heatmap.write_png(heatmapname);
+    }
+
+    saveStatistics(basename);
+    *out << "Done.\n";
+
+    return reference.empty() or matchesReference(img);
+}
+
+bool Raytracer::renderStreamed(string const &ofname, ThreadPool &pool)
+{
+    *out << "Tracing and streaming bands of tiles to " << ofname << "...\n";
+    auto start = chrono::steady_clock::now();
+
+    ImageStream stream(ofname, width, height, pngLevel);
+    bool written = stream.good();
+    double encodeSeconds = 0.0;
+    stats += scene.renderBands(width, height, pool, [&](Image const &band)
+    {
+        auto encodeStart = chrono::steady_clock::now();
+        written = stream.write(band) and written;
+        encodeSeconds += secondsSince(encodeStart);
+    }, streamWindow);
+
+    stats.seconds[RenderStats::TRACE] = secondsSince(start) - encodeSeconds;
+    stats.seconds[RenderStats::ENCODE] = encodeSeconds;
+    if (!written)
+    {
+        *err << "Error: cannot write " << ofname << ".\n";
+        return false;
+    }
+
+    stats.print(*out);
+
+    string basename = stripExtension(ofname);
+    saveStatistics(basename);
+    *out << "Done.\n";
+
+    return true;
+}
+
+void Raytracer::renderToDeadline(Image &img, ThreadPool &pool)
+{
+    auto start = chrono::steady_clock::now();
+
+    // Leave room for encoding and for the error of the estimates
+    double const budget = 0.9 * deadline;
+
+    // Seconds per primary sample at a recursion depth and shadow ray
+    // budget, measured on a pilot image of 1/64th of the pixels
+    unsigned const pilotScale = 8;
+    map<pair<unsigned, unsigned>, double> sampleCost;
+    auto estimate = [&](Quality const &quality)
+    {
+        pair<unsigned, unsigned> key(quality.depth, quality.shadowRays);
+        if (!sampleCost.count(key))
+        {
+            setQuality({quality.depth, 1, quality.shadowRays, pilotScale});
+            Image pilot((img.width() + pilotScale - 1) / pilotScale,
+                        (img.height() + pilotScale - 1) / pilotScale);
+            auto pilotStart = chrono::steady_clock::now();
+            scene.render(pilot, pool);
+            sampleCost[key] = secondsSince(pilotStart) / pilot.size();
+        }
+
+        unsigned width = (img.width() + quality.scale - 1) / quality.scale;
+        unsigned height = (img.height() + quality.scale - 1) / quality.scale;
+        return sampleCost[key] * width * height
+               * quality.superSample * quality.superSample;
+    };
+
+    unsigned level = 0;
+    while (level + 1 < qualityLevels.size()
+           and secondsSince(start) + estimate(qualityLevels[level]) > budget)
+        ++level;
+
+    Quality const &chosen = qualityLevels[level];
+    *out << "Tracing at quality level " << level << " of "
+         << qualityLevels.size() - 1 << " to meet the deadline...\n";
+    setQuality(chosen);
+
+    // Bands are rendered one at a time. When the last band projects past
+    // the budget, the next level at the same resolution is used for the
+    // remaining rows.
+    unsigned width = (img.width() + chosen.scale - 1) / chosen.scale;
+    unsigned height = (img.height() + chosen.scale - 1) / chosen.scale;
+    Image lowres(width, height);
+    unsigned reached = level;
+    auto bandStart = chrono::steady_clock::now();
+    stats += scene.renderBands(width, height, pool, [&](Image const &band)
+    {
+        for (unsigned y = band.firstRow(); y != band.firstRow() + band.rows(); ++y)
+            for (unsigned x = 0; x != width; ++x)
+                lowres(x, y) = band(x, y);
+
+        unsigned rowsLeft = height - band.firstRow() - band.rows();
+        double projected = secondsSince(bandStart) / band.rows() * rowsLeft;
+        if (secondsSince(start) + projected > budget
+            and reached + 1 < qualityLevels.size()
+            and qualityLevels[reached + 1].scale == chosen.scale)
+            setQuality(qualityLevels[++reached]);
+        bandStart = chrono::steady_clock::now();
+    }, 1);
+
+    // Back to full size by repeating pixels
+    for (unsigned y = 0; y != img.height(); ++y)
+        for (unsigned x = 0; x != img.width(); ++x)
+            img(x, y) = lowres(x / chosen.scale, y / chosen.scale);
+
+    Quality const &quality = qualityLevels[reached];
+    json report = {
+        {"DeadlineSeconds", deadline},
+        {"level", reached},
+        {"startLevel", level},
+        {"levels", qualityLevels.size()},
+        {"MaxRecursionDepth", quality.depth},
+        {"SuperSamplingFactor", quality.superSample},
+        {"ShadowRayBudget", quality.shadowRays},
+        {"ResolutionScale", quality.scale},
+        {"pilots", sampleCost.size()},
+        {"seconds", secondsSince(start)}
+    };
+    qualityReport = report.dump();
+    img.addText("Quality", qualityReport);
+    *out << "Quality: " << qualityReport << '\n';
+}
+
+void Raytracer::setQuality(Quality const &quality)
+{
+    scene.setRecursionDepth(quality.depth);
+    scene.setSuperSample(quality.superSample);
+    scene.setPixelScale(quality.scale);
+
+    // Light sampling needs the light tree, which a zero budget without
+    // culling does not use
+    if (quality.shadowRays != 0 or lightThreshold != 0.0)
+        scene.setLightSampling(lightThreshold, quality.shadowRays);
+}
+
+void Raytracer::saveStatistics(string const &basename) const
+{
+    if (writeStatistics)
+    {
+        string statsname = basename + ".stats.json";
+        *out << "Writing statistics to " << statsname << "...\n";
+
+        json result = stats.toJson();
+        if (!qualityReport.empty())
+            result["quality"] = json::parse(qualityReport);
+        ofstream(statsname) << result.dump(4) << '\n';
+    }
+}
+
+bool Raytracer::matchesReference(Image const &img) const
+{
+    if (!ifstream(reference))
+    {
+        *err << "Error: could not open reference image " << reference << ".\n";
+        return false;
+    }
+    Texture golden(reference);
+
+    ImageDiff diff(img, golden);
+    bool pass = diff.meanDeltaE <= maxMeanDeltaE
+                and diff.noticeableFraction() <= maxNoticeableFraction;
+
+    *out << "Reference " << reference << ": " << (pass ? "PASS" : "FAIL")
+         << "\n  max channel error " << diff.maxError * 255.0 << "/255"
+         << ", delta E mean " << diff.meanDeltaE << " max " << diff.maxDeltaE
+         << "\n  " << diff.noticeable << " noticeably different pixels ("
+         << 100.0 * diff.noticeableFraction() << "%), trace time "
+         << stats.seconds[RenderStats::TRACE] << " s\n";
+
+    return pass;
+}
+
+Scene const &Raytracer::getScene() const
+{
+    return scene;
+}
+
+unsigned Raytracer::getWidth() const
+{
+    return width;
+}
+
+unsigned Raytracer::getHeight() const
 {
-    // TODO: the size may be a settings in your file
-    Image img(400, 400);
-    cout << "Tracing...\n";
-    scene.render(img);
-    cout << "Writing image to " << ofname << "...\n";
-    img.write_png(ofname);
-    cout << "Done.\n";
+    return height;
 }
@@ -1,13 +1,23 @@
 #ifndef RAYTRACER_H_
 #define RAYTRACER_H_
 
+#include "denoiser.h"
 #include "scene.h"
 
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <memory>
 #include <string>
+#include <vector>
 
 // Forward declarations
+class AssetCache;
+class Image;
 class Light;
 class Material;
+class Texture;
+class ThreadPool;
 
 #include "json/json_fwd.h"
 
@@ -15,17 +25,133 @@ class Raytracer
 {
     Scene scene;
 
+    // Textures and meshes come from this cache if set, so that scenes
+    // rendered by one process load them once
+    AssetCache *assets;
+
+    // Progress and error messages
+    std::ostream *out;
+    std::ostream *err;
+
+    // Identical material nodes share one entry of the material table,
+    // and materials with the same texture file share its image
+    std::map<std::string, unsigned> materialIndices;
+    std::map<std::string, std::shared_ptr<Texture const>> textures;
+
+    // Primary hits are cached in this file (if set), they stay valid
+    // as long as the geometry key is unchanged
+    std::string gbufferCache;
+    std::uint64_t geometryKey = 0;
+
+    // Image size in pixels
+    unsigned width = 400;
+    unsigned height = 400;
+
+    // Write bands of tiles to the output file as they finish, with at most
+    // streamWindow bands in memory, if streamOutput is set
+    bool streamOutput = false;
+    unsigned streamWindow = 2;
+
+    // Write the finished tiles to a checkpoint file every checkpointSeconds
+    // and resume from it, if checkpoint is set. The file defaults to one
+    // next to the image and is tied to the scene by sceneKey.
+    bool checkpoint = false;
+    std::string checkpointFile;
+    double checkpointSeconds = 60.0;
+    std::uint64_t sceneKey = 0;
+
+    // Reuse tiles from files in this directory (if set) when their key is
+    // unchanged. tileCacheKey covers the settings and lights, objectKey the
+    // objects, see Scene::tileKey.
+    std::string tileCache;
+    std::uint64_t tileCacheKey = 0;
+
+    // Deadline mode, if deadline is set: the render lowers its settings
+    // from the scene's own (level 0) down the quality levels until a pilot
+    // estimate fits in deadline seconds, and lowers them further for the
+    // remaining rows if it falls behind
+    struct Quality
+    {
+        unsigned depth;             // MaxRecursionDepth
+        unsigned superSample;       // SuperSamplingFactor
+        unsigned shadowRays;        // ShadowRayBudget, 0 for every light
+        unsigned scale;             // image pixels per rendered pixel, across
+    };
+    double deadline = 0.0;
+    std::vector<Quality> qualityLevels;
+    double lightThreshold = 0.0;
+    std::string qualityReport;      // JSON of the level reached
+
+    // Find primary hits by rasterization instead of ray casting
+    bool rasterize = false;
+
+    // Filter the image guided by its primary hits, if denoise is set
+    bool denoise = false;
+    Denoiser denoiser;
+
+    // Phase timings and counters, also written as JSON next to the image
+    // if writeStatistics is set
+    RenderStats stats;
+    bool writeStatistics = false;
+
+    // Write a per-pixel cost image with this metric next to the image
+    std::string heatmapMetric;
+
+    // Render on this many threads, 0 for one per hardware thread. Images
+    // do not depend on it.
+    unsigned threads = 0;
+
+    // The image format follows the extension of the output file. PNG
+    // compression level (0 to 9), deflated in parallel if pngParallel is set
+    unsigned pngLevel = 6;
+    bool pngParallel = false;
+
+    // Golden image check: the render must stay within these tolerances
+    // of the reference image, if one is set
+    std::string reference;
+    double maxMeanDeltaE = 0.5;
+    double maxNoticeableFraction = 0.001;
+
     public:
+        explicit Raytracer(AssetCache *assets = nullptr,
+                           std::ostream &out = std::cout,
+                           std::ostream &err = std::cerr);
 
         bool readScene(std::string const &ifname);
-        void renderToFile(std::string const &ofname);
+        // returns false if the image is out of tolerance of the reference
+        bool renderToFile(std::string const &ofname);
+
+        // renderToFile with the tiles queued on the given pool, which may
+        // be shared with other renders; the Threads setting is not used
+        bool renderToFile(std::string const &ofname, ThreadPool &pool);
+
+        Scene const &getScene() const;
+
+        // image size in pixels, from "Size"
+        unsigned getWidth() const;
+        unsigned getHeight() const;
 
     private:
 
         bool parseObjectNode(nlohmann::json const &node);
 
+        bool matchesReference(Image const &img) const;
+
+        // renderToFile with streamOutput set
+        bool renderStreamed(std::string const &ofname, ThreadPool &pool);
+
+        // render img in deadline mode and record the quality reached
+        void renderToDeadline(Image &img, ThreadPool &pool);
+        void setQuality(Quality const &quality);
+
+        // as JSON next to the image, if writeStatistics is set
+        void saveStatistics(std::string const &basename) const;
+
         Light parseLightNode(nlohmann::json const &node) const;
-        Material parseMaterialNode(nlohmann::json const &node) const;
+        Material parseMaterialNode(nlohmann::json const &node);
+
+        // index in the material table of the scene, parsing new materials
+        unsigned materialIndex(nlohmann::json const &node);
 };
 
 #endif
@@ -0,0 +1,189 @@
+#include "renderserver.h"
+
+#include "image.h"
+#include "raytracer.h"
+#include "triple.h"
+
+#include "json/json.h"
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace
+{
+    double millisecondsSince(chrono::steady_clock::time_point start)
+    {
+        chrono::duration<double, milli> elapsed = chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+}
+
+RenderServer::RenderServer(ostream &out, unsigned numThreads)
+:
+    d_pool(numThreads),
+    d_out(out)
+{}
+
+RenderServer::~RenderServer()
+{
+    for (future<void> &render : d_renders)
+        render.wait();
+}
+
+void RenderServer::run(istream &in)
+{
+    reply({{"status", "ready"}, {"threads", d_pool.size()}});
+
+    string line;
+    while (getline(in, line))
+    {
+        if (line.find_first_not_of(" \t\r") == string::npos)
+            continue;
+
+        try
+        {
+            if (!handle(json::parse(line)))
+                break;
+        }
+        catch (exception const &ex)
+        {
+            reply({{"status", "error"}, {"message", ex.what()}});
+        }
+    }
+}
+
+bool RenderServer::handle(json const &request)
+{
+    string command = request.at("command");
+
+    if (command == "load")
+        load(request);
+    else if (command == "render")
+        render(request);
+    else if (command == "unload")
+        unload(request);
+    else if (command == "quit")
+        return false;
+    else
+        throw runtime_error("Unknown command: " + command);
+
+    return true;
+}
+
+void RenderServer::load(json const &request)
+{
+    string id = request.at("id");
+    string file = request.at("file");
+
+    auto start = chrono::steady_clock::now();
+
+    // The parser's messages would break the replies, they are only
+    // passed on when it fails
+    ostringstream log;
+    Raytracer raytracer(nullptr, log, log);
+    if (!raytracer.readScene(file))
+        throw runtime_error("Reading scene from " + file + " failed: " + log.str());
+
+    d_scenes.erase(id);
+    d_scenes.emplace(id, Resident{raytracer.getScene(), raytracer.getWidth(),
+                                  raytracer.getHeight()});
+
+    reply({{"status", "loaded"}, {"id", id},
+           {"milliseconds", millisecondsSince(start)}});
+}
+
+void RenderServer::render(json const &request)
+{
+    string id = request.at("id");
+    string output = request.at("output");
+
+    auto loaded = d_scenes.find(id);
+    if (loaded == d_scenes.end())
+        throw runtime_error("No scene loaded with id " + id);
+
+    // The copy shares the objects, materials and lights of the resident
+    // scene, only its settings are changed
+    Scene scene(loaded->second.scene);
+
+    if (request.count("Eye"))
+        scene.setEye(Point(request["Eye"]));
+
+    if (request.count("MaxRecursionDepth"))
+        scene.setRecursionDepth(request["MaxRecursionDepth"].get<unsigned>());
+
+    if (request.count("SuperSamplingFactor"))
+        scene.setSuperSample(request["SuperSamplingFactor"].get<unsigned>());
+
+    if (request.count("Shadows"))
+        scene.setRenderShadows(request["Shadows"].get<bool>());
+
+    unsigned width = loaded->second.width;
+    unsigned height = loaded->second.height;
+    if (request.count("Size"))
+    {
+        width = request["Size"].at(0);
+        height = request["Size"].at(1);
+    }
+
+    int priority = request.value("priority", 0);
+
+    // A render waits for its tiles, so it runs on a thread of its own
+    // rather than on the pool. Finished ones are joined here, so a long
+    // running server holds no more threads than renders in flight.
+    reap();
+    d_renders.push_back(async(launch::async,
+        [this, scene = move(scene), id, output, width, height, priority]
+    {
+        try
+        {
+            auto start = chrono::steady_clock::now();
+            Image img(width, height);
+            RenderStats stats = scene.render(img, d_pool, priority);
+            double traceTime = millisecondsSince(start);
+
+            if (!img.write(output))
+                throw runtime_error("Cannot write " + output);
+
+            reply({{"status", "done"}, {"id", id}, {"output", output},
+                   {"traceMilliseconds", traceTime},
+                   {"statistics", stats.toJson()},
+                   {"milliseconds", millisecondsSince(start)}});
+        }
+        catch (exception const &ex)
+        {
+            reply({{"status", "error"}, {"id", id}, {"output", output},
+                   {"message", ex.what()}});
+        }
+    }));
+}
+
+void RenderServer::unload(json const &request)
+{
+    string id = request.at("id");
+
+    if (d_scenes.erase(id) == 0)
+        throw runtime_error("No scene loaded with id " + id);
+
+    reply({{"status", "unloaded"}, {"id", id}});
+}
+
+void RenderServer::reap()
+{
+    d_renders.erase(remove_if(d_renders.begin(), d_renders.end(),
+        [](future<void> const &render)
+        {
+            return render.wait_for(chrono::seconds(0)) == future_status::ready;
+        }), d_renders.end());
+}
+
+void RenderServer::reply(json const &response)
+{
+    lock_guard<mutex> lock(d_outMutex);
+    d_out << response.dump() << endl;
+}
@@ -0,0 +1,66 @@
+#ifndef RENDERSERVER_H_
+#define RENDERSERVER_H_
+
+#include "scene.h"
+#include "threadpool.h"
+
+#include <future>
+#include <iosfwd>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "json/json_fwd.h"
+
+// Keeps parsed scenes resident and renders them on request. Requests are
+// read one JSON object per line, replies are written the same way:
+//
+//   {"command": "load", "id": "room", "file": "room.json"}
+//   {"command": "render", "id": "room", "output": "room.png",
+//    "Eye": [200, 200, 1000], "Size": [400, 400], "MaxRecursionDepth": 2,
+//    "SuperSamplingFactor": 2, "Shadows": true, "priority": 1}
+//   {"command": "unload", "id": "room"}
+//   {"command": "quit"}
+//
+// All render settings are optional and default to those of the scene file.
+// Renders run concurrently, their tiles share one pool where higher
+// priorities are traced first.
+class RenderServer
+{
+    // A loaded scene with the image size of its file
+    struct Resident
+    {
+        Scene scene;
+        unsigned width;
+        unsigned height;
+    };
+
+    ThreadPool d_pool;
+    std::map<std::string, Resident> d_scenes;
+    std::vector<std::future<void>> d_renders;   // requests in flight
+    std::ostream &d_out;
+    std::mutex d_outMutex;
+
+    public:
+        explicit RenderServer(std::ostream &out, unsigned numThreads = 0);
+        ~RenderServer();    // waits for all renders in flight
+
+        // handle requests until "quit" or the end of the input
+        void run(std::istream &in);
+
+    private:
+        // return false to stop the server
+        bool handle(nlohmann::json const &request);
+
+        void load(nlohmann::json const &request);
+        void render(nlohmann::json const &request);
+        void unload(nlohmann::json const &request);
+
+        // drop the renders that are done, joining their threads
+        void reap();
+
+        void reply(nlohmann::json const &response);
+};
+
+#endif
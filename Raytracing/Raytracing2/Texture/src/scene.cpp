@@ -1,45 +1,407 @@
 #include "scene.h"
 
+#include "checkpoint.h"
+#include "denoiser.h"
+#include "hash.h"
+#include "heatmap.h"
 #include "hit.h"
 #include "image.h"
+#include "lighttree.h"
 #include "material.h"
+#include "rasterizer.h"
 #include "ray.h"
+#include "threadpool.h"
+#include "tilecache.h"
+#include "shapes/mesh.h"
+#include "shapes/spherecloud.h"
 
 #include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <future>
 #include <limits>
+#include <numeric>
+#include <stdexcept>
+#include <string>
 
 using namespace std;
 
-pair<ObjectPtr, Hit> Scene::castRay(Ray const &ray) const
+namespace
+{
+    // The object that last blocked a shadow ray towards each light, per
+    // thread. Objects and lights are stored by index and the cached object
+    // is only a first guess, so entries left by another scene cost one
+    // wasted intersection test but never change the image.
+    struct OccluderCache
+    {
+        vector<unsigned> occluders;
+
+        unsigned &occluder(unsigned light)
+        {
+            if (light >= occluders.size())
+                occluders.resize(light + 1, ~0u);
+            return occluders[light];
+        }
+    };
+
+    thread_local OccluderCache occluderCache;
+
+    // Uniform number in [0, 1) determined by a point and a sample index,
+    // so sampled images do not depend on the order pixels are traced in.
+    double uniformAt(Point const &P, unsigned sample)
+    {
+        uint64_t state = sample;
+        for (double coordinate : P.data)
+        {
+            uint64_t bits;
+            memcpy(&bits, &coordinate, sizeof(bits));
+
+            // splitmix64 step
+            state ^= bits;
+            state += 0x9E3779B97F4A7C15ull;
+            state = (state ^ (state >> 30)) * 0xBF58476D1CE4E5B9ull;
+            state = (state ^ (state >> 27)) * 0x94D049BB133111EBull;
+            state ^= state >> 31;
+        }
+        return (state >> 11) * (1.0 / 9007199254740992.0);    // 2^-53
+    }
+
+    // Shrink the box [lower, upper] to the part inside the planes through
+    // apex with the given inward normals, returns false if none is. The
+    // corners of that part are those of the faces of the box clipped to
+    // the planes, and the apex if it is in the box.
+    bool clipBox(Point &lower, Point &upper, Point const &apex,
+                 Vector const (&normals)[4])
+    {
+        double const inf = numeric_limits<double>::infinity();
+        Point clippedLower(inf, inf, inf);
+        Point clippedUpper(-inf, -inf, -inf);
+        auto include = [&](Point const &P)
+        {
+            for (unsigned axis = 0; axis != 3; ++axis)
+            {
+                clippedLower.data[axis] = min(clippedLower.data[axis], P.data[axis]);
+                clippedUpper.data[axis] = max(clippedUpper.data[axis], P.data[axis]);
+            }
+        };
+
+        bool apexInside = true;
+        for (unsigned axis = 0; axis != 3; ++axis)
+            apexInside = apexInside and lower.data[axis] <= apex.data[axis]
+                                    and apex.data[axis] <= upper.data[axis];
+        if (apexInside)
+            include(apex);
+
+        vector<Point> face;
+        vector<Point> clipped;
+        for (unsigned axis = 0; axis != 3; ++axis)
+            for (double side : {lower.data[axis], upper.data[axis]})
+            {
+                // The face's corners in order around it
+                unsigned u = (axis + 1) % 3;
+                unsigned v = (axis + 2) % 3;
+                face.assign(4, Point());
+                for (unsigned corner = 0; corner != 4; ++corner)
+                {
+                    face[corner].data[axis] = side;
+                    face[corner].data[u] = corner == 1 or corner == 2 ? upper.data[u]
+                                                                      : lower.data[u];
+                    face[corner].data[v] = corner >= 2 ? upper.data[v] : lower.data[v];
+                }
+
+                // Sutherland-Hodgman, one plane at a time
+                for (Vector const &N : normals)
+                {
+                    clipped.clear();
+                    for (unsigned idx = 0; idx != face.size(); ++idx)
+                    {
+                        Point const &P = face[idx];
+                        Point const &Q = face[(idx + 1) % face.size()];
+                        double dP = N.dot(P - apex);
+                        double dQ = N.dot(Q - apex);
+                        if (dP >= 0.0)
+                            clipped.push_back(P);
+                        if ((dP >= 0.0) != (dQ >= 0.0))
+                            clipped.push_back(P + (Q - P) * (dP / (dP - dQ)));
+                    }
+                    face.swap(clipped);
+                }
+
+                for (Point const &P : face)
+                    include(P);
+            }
+
+        if (clippedLower.x > clippedUpper.x)
+            return false;
+
+        lower = clippedLower;
+        upper = clippedUpper;
+        return true;
+    }
+
+    // A secondary ray of a batch, with the sample its color is added to
+    struct PathRay
+    {
+        Ray ray;
+        double weight;      // product of the reflectances along the path
+        unsigned sample;
+        uint64_t key;
+    };
+
+    // Bounce for Scene::shadeWith that queues the secondary rays
+    struct Enqueue
+    {
+        vector<PathRay> &rays;
+        double weight;
+        unsigned sample;
+
+        Color operator()(Ray const &ray, double factor) const
+        {
+            rays.push_back(PathRay{ray, weight * factor, sample, 0});
+            return Color(0.0, 0.0, 0.0);
+        }
+    };
+
+    // Spread the lowest 10 bits of value to every third bit
+    uint64_t spreadBits(uint64_t value)
+    {
+        value &= 0x3FF;
+        value = (value | (value << 16)) & 0x030000FF;
+        value = (value | (value << 8)) & 0x0300F00F;
+        value = (value | (value << 4)) & 0x030C30C3;
+        value = (value | (value << 2)) & 0x09249249;
+        return value;
+    }
+
+    // Order rays by the octant of their direction, then along a Morton
+    // curve through their origins, so consecutive rays traverse the same
+    // nodes and objects
+    void sortRays(vector<PathRay> &rays)
+    {
+        Point lower = rays.front().ray.O;
+        Point upper = lower;
+        for (PathRay const &path : rays)
+            for (unsigned axis = 0; axis != 3; ++axis)
+            {
+                lower.data[axis] = min(lower.data[axis], path.ray.O.data[axis]);
+                upper.data[axis] = max(upper.data[axis], path.ray.O.data[axis]);
+            }
+
+        for (PathRay &path : rays)
+        {
+            path.key = 0;
+            for (unsigned axis = 0; axis != 3; ++axis)
+            {
+                double extent = upper.data[axis] - lower.data[axis];
+                double cell = extent > 0.0
+                    ? (path.ray.O.data[axis] - lower.data[axis]) / extent * 1023.0
+                    : 0.0;
+                path.key |= spreadBits(static_cast<uint64_t>(cell)) << axis;
+                if (path.ray.D.data[axis] < 0.0)
+                    path.key |= uint64_t(1) << (30 + axis);
+            }
+        }
+
+        // Stable, so equal keys keep the order their samples were added in
+        stable_sort(rays.begin(), rays.end(),
+            [](PathRay const &lhs, PathRay const &rhs)
+            {
+                return lhs.key < rhs.key;
+            });
+    }
+}
+
+pair<Object const *, Hit> Scene::castRay(Ray const &ray) const
+{
+    pair<unsigned, Hit> mainhit = closestHit(ray);
+    if (mainhit.first == contents->objects.size())
+        return pair<Object const *, Hit>(nullptr, mainhit.second);
+
+    return pair<Object const *, Hit>(&object(mainhit.first), mainhit.second);
+}
+
+Object const &Scene::object(unsigned idx) const
+{
+    Slot const &slot = contents->objects.at(idx);
+    if (slot.kind == SPHERE)
+        return contents->spheres.shapes[slot.pos];
+    if (slot.kind == QUAD)
+        return contents->quads.shapes[slot.pos];
+    if (slot.kind == TRIANGLE)
+        return contents->triangles.shapes[slot.pos];
+    return *contents->others.shapes[slot.pos];
+}
+
+pair<unsigned, Hit> Scene::closestHit(Ray const &ray) const
 {
     // Find hit object and distance
     Hit min_hit(numeric_limits<double>::infinity(), Vector());
-    ObjectPtr obj = nullptr;
-    for (unsigned idx = 0; idx != objects.size(); ++idx)
+    unsigned obj = contents->objects.size();
+
+    closestIn(contents->spheres, ray, min_hit, obj);
+    closestIn(contents->quads, ray, min_hit, obj);
+    closestIn(contents->triangles, ray, min_hit, obj);
+
+    for (size_t idx = 0; idx != contents->others.shapes.size(); ++idx)
+    {
+        Hit hit(contents->others.shapes[idx]->intersect(ray));
+        if (hit.t < min_hit.t or (hit.t == min_hit.t and contents->others.ids[idx] < obj))
+        {
+            min_hit = hit;
+            obj = contents->others.ids[idx];
+        }
+    }
+
+    return pair<unsigned, Hit>(obj, min_hit);
+}
+
+template <typename Shape>
+void Scene::closestIn(Group<Shape> const &group, Ray const &ray,
+                      Hit &min_hit, unsigned &obj)
+{
+    for (size_t idx = 0; idx != group.shapes.size(); ++idx)
     {
-        Hit hit(objects[idx]->intersect(ray));
-        if (hit.t < min_hit.t)
+        // Shapes are final, so this call is bound statically. Equal
+        // distances go to the first object, as in a single loop.
+        Hit hit(group.shapes[idx].intersect(ray));
+        if (hit.t < min_hit.t or (hit.t == min_hit.t and group.ids[idx] < obj))
         {
             min_hit = hit;
-            obj = objects[idx];
+            obj = group.ids[idx];
         }
     }
+}
 
-    return pair<ObjectPtr, Hit>(obj, min_hit);
+Color Scene::trace(Ray const &ray, unsigned depth) const
+{
+    TraceKernel kernel = traceKernel(features(),
+                                     make_index_sequence<ALL_FEATURES + 1>());
+    return (this->*kernel)(ray, depth);
 }
 
-Color Scene::trace(Ray const &ray, unsigned depth)
+unsigned Scene::features() const
 {
-    pair<ObjectPtr, Hit> mainhit = castRay(ray);
-    ObjectPtr obj = mainhit.first;
+    unsigned result = 0;
+    if (renderShadows)
+        result |= SHADOWS;
+    if (supersamplingFactor != 1)
+        result |= SUPERSAMPLING;
+
+    for (Material const &material : contents->materials)
+    {
+        if (material.hasTexture)
+            result |= TEXTURES;
+        if (recursionDepth > 0 and material.isTransparent)
+            result |= TRANSPARENCY;
+        if (recursionDepth > 0 and material.ks > 0.0)
+            result |= REFLECTIONS;
+    }
+
+    return result;
+}
+
+template <unsigned Features>
+Color Scene::traceWith(Ray const &ray, unsigned depth) const
+{
+    pair<Object const *, Hit> mainhit = castRay(ray);
+    Object const *obj = mainhit.first;
     Hit min_hit = mainhit.second;
 
     // No hit? Return background color.
     if (!obj)
         return Color(0.0, 0.0, 0.0);
 
-    Material const &material = obj->material;
+    // Texture coordinates are only needed for textured materials
+    Vector uv;
+    if ((Features & TEXTURES) and contents->materials[obj->materialAt(min_hit)].hasTexture)
+        uv = obj->toUV(ray.at(min_hit.t));
+
+    return shade<Features>(ray, *obj, min_hit, uv, depth);
+}
+
+template <unsigned Features>
+Color Scene::tracePrimary(Ray const &ray, GBuffer::Sample &sample,
+                          bool record) const
+{
+    Hit hit(Hit::NO_HIT());
+    Vector uv;
+    unsigned obj = primaryHit(ray, sample, record, hit, uv);
+
+    // No hit? Return background color.
+    if (obj == contents->objects.size())
+        return Color(0.0, 0.0, 0.0);
+
+    return shade<Features>(ray, object(obj), hit, uv, recursionDepth);
+}
+
+unsigned Scene::primaryHit(Ray const &ray, GBuffer::Sample &sample,
+                           bool record, Hit &hit, Vector &uv) const
+{
+    if (record)
+    {
+        pair<unsigned, Hit> mainhit = closestHit(ray);
+        recordHit(sample, ray, mainhit.first, mainhit.second);
+    }
+
+    if (sample.object == GBuffer::NO_OBJECT)
+        return contents->objects.size();
+
+    hit = Hit(sample.t, Vector(sample.N[0], sample.N[1], sample.N[2]),
+              sample.part);
+    uv = Vector(sample.uv[0], sample.uv[1], 0.0);
+    return sample.object;
+}
+
+void Scene::recordHit(GBuffer::Sample &sample, Ray const &ray, unsigned obj,
+                      Hit const &hit) const
+{
+    if (obj == contents->objects.size())
+    {
+        sample.object = GBuffer::NO_OBJECT;
+        return;
+    }
+
+    // Texture coordinates are always stored, as the buffer stays valid
+    // when materials change
+    Vector uv = object(obj).toUV(ray.at(hit.t));
+
+    sample.object = obj;
+    sample.part = hit.part;
+    sample.t = hit.t;
+    copy(hit.N.data, hit.N.data + 3, sample.N);
+    copy(uv.data, uv.data + 2, sample.uv);
+}
+
+Ray Scene::primaryRay(unsigned x, unsigned y, unsigned n, unsigned factor,
+                      unsigned h) const
+{
+    float i = ((n % factor) + 1) / ((float) factor + 1.0f);
+    float j = ((n / factor) + 1) / ((float) factor + 1.0f);
+    Point pixel((x + i) * pixelScale, (h - 1 - y + j) * pixelScale, 0);
+    return Ray(eye, (pixel - eye).normalized());
+}
+
+template <unsigned Features>
+Color Scene::shade(Ray const &ray, Object const &obj, Hit const &min_hit,
+                   Vector const &uv, unsigned depth) const
+{
+    return shadeWith<Features>(ray, obj, min_hit, uv, depth,
+        [this, depth](Ray const &next, double weight)
+        {
+            return traceWith<Features>(next, depth - 1) * weight;
+        });
+}
+
+template <unsigned Features, typename Bounce>
+Color Scene::shadeWith(Ray const &ray, Object const &obj, Hit const &min_hit,
+                       Vector const &uv, unsigned depth, Bounce bounce) const
+{
+    RenderStats::countDepth(recursionDepth - depth);
+
+    Material const &material = contents->materials[obj.materialAt(min_hit)];
     Point hit = ray.at(min_hit.t);
     Vector V = -ray.D;
 
@@ -55,9 +417,8 @@ Color Scene::trace(Ray const &ray, unsigned depth)
         shadingN = -N;
 
     Color matColor;
-    if (material.hasTexture) {
-        Point uv = obj->toUV(hit);
-        matColor = material.texture.colorAt(uv.x, 1.0 - uv.y);
+    if ((Features & TEXTURES) and material.hasTexture) {
+        matColor = material.texture->colorAt(uv.x, 1.0 - uv.y);
     } else {
         matColor = material.color;
     }
@@ -66,38 +427,9 @@ Color Scene::trace(Ray const &ray, unsigned depth)
     Color color = material.ka * matColor;
 
     // Add diffuse and specular components.
-    for (auto const &light : lights) {
-        Vector L = (light->position - hit).normalized();
+    color += directLight<Features>(hit, shadingN, V, material, matColor);
 
-        if (renderShadows) {
-            // Shadow rendering.
-            Ray shadowRay = Ray(hit + shadingN * epsilon, L);
-            pair<ObjectPtr, Hit> shadowHit = castRay(shadowRay);
-
-            // No object in hit by shadow ray.
-            int inShadow = shadowHit.first != nullptr;
-            // No object in between light scr and object.
-            inShadow *= (shadowRay.at(shadowHit.second.t) - hit).length_2() < (light->position - hit).length_2();
-            if (inShadow) continue;
-        }
-
-        // Add diffuse.
-        double dotNormal = shadingN.dot(L);
-        double diffuse = std::max(dotNormal, 0.0);
-        color += diffuse * material.kd * light->color * matColor;
-
-        // Add specular.
-        if(dotNormal > 0)
-        {
-            Vector reflectDir = reflect(-L, shadingN); // Note: reflect(..) is not given in the framework.
-            double specAngle = std::max(reflectDir.dot(V), 0.0);
-            double specular = std::pow(specAngle, material.n);
-
-            color += specular * material.ks * light->color;
-        }
-    }
-
-    if (depth > 0 and material.isTransparent)
+    if ((Features & TRANSPARENCY) and depth > 0 and material.isTransparent)
     {
         // When the ray is going into the material ni = air and nt = material, otherwise we swap.
         double ni, nt;
@@ -121,39 +453,532 @@ Color Scene::trace(Ray const &ray, unsigned depth)
         double kr = kr0 + (1 - kr0) * pow(1 - V.dot(shadingN), 5);
         double kt = 1 - kr;
 
-        color += trace(refractionRay, depth - 1) * kt;
-        color += trace(reflectionRay, depth - 1) * kr;
+        RenderStats::count(RenderStats::REFRACTION_RAYS);
+        RenderStats::count(RenderStats::REFLECTION_RAYS);
+        color += bounce(refractionRay, kt);
+        color += bounce(reflectionRay, kr);
     }
-    else if (depth > 0 and material.ks > 0.0)
+    else if ((Features & REFLECTIONS) and depth > 0 and material.ks > 0.0)
     {
         // The object is not transparent, but opaque.
         Vector R = 2 * (shadingN.dot(V)) * shadingN - V;
         Ray reflectionRay = Ray(hit + shadingN * epsilon, R);
-        color += trace(reflectionRay, depth - 1) * material.ks;
+        RenderStats::count(RenderStats::REFLECTION_RAYS);
+        color += bounce(reflectionRay, material.ks);
     }
 
     return color;
 }
 
-void Scene::render(Image &img)
+template <unsigned Features>
+Color Scene::directLight(Point const &hit, Vector const &shadingN,
+                         Vector const &V, Material const &material,
+                         Color const &matColor) const
+{
+    Color color;
+
+    if (!contents->lightTree)
+    {
+        for (unsigned light = 0; light != contents->lights.size(); ++light)
+            color += illuminate<Features>(light, hit, shadingN, V, material, matColor);
+        return color;
+    }
+
+    // Largest reflectances, so cluster bounds hold for every color channel
+    double diffuse = material.kd * max({matColor.r, matColor.g, matColor.b});
+
+    if (shadowRayBudget == 0 or contents->lights.size() <= shadowRayBudget)
+    {
+        contents->lightTree->forEach(hit, shadingN, diffuse, material.ks, lightThreshold,
+            [&](unsigned light)
+            {
+                color += illuminate<Features>(light, hit, shadingN, V, material, matColor);
+            });
+        return color;
+    }
+
+    // Estimate the sum over all lights from a fixed number of shadow rays
+    for (unsigned sample = 0; sample != shadowRayBudget; ++sample)
+    {
+        unsigned light;
+        double pdf;
+        if (contents->lightTree->sample(hit, shadingN, diffuse, material.ks,
+                              lightThreshold, uniformAt(hit, sample), light,
+                              pdf))
+            color += illuminate<Features>(light, hit, shadingN, V, material, matColor)
+                   / (pdf * shadowRayBudget);
+    }
+
+    return color;
+}
+
+template <unsigned Features>
+Color Scene::illuminate(unsigned lightIdx, Point const &hit,
+                        Vector const &shadingN, Vector const &V,
+                        Material const &material, Color const &matColor) const
+{
+    Light const &light = *contents->lights[lightIdx];
+    Color color;
+    Vector L = (light.position - hit).normalized();
+
+    if (Features & SHADOWS) {
+        // Shadow rendering.
+        Ray shadowRay = Ray(hit + shadingN * epsilon, L);
+        if (inShadow(lightIdx, shadowRay, hit)) return color;
+    }
+
+    // Add diffuse.
+    double dotNormal = shadingN.dot(L);
+    double diffuse = std::max(dotNormal, 0.0);
+    color += diffuse * material.kd * light.color * matColor;
+
+    // Add specular.
+    if(dotNormal > 0)
+    {
+        Vector reflectDir = reflect(-L, shadingN); // Note: reflect(..) is not given in the framework.
+        double specAngle = std::max(reflectDir.dot(V), 0.0);
+        double specular = std::pow(specAngle, material.n);
+
+        color += specular * material.ks * light.color;
+    }
+
+    return color;
+}
+
+bool Scene::inShadow(unsigned lightIdx, Ray const &shadowRay,
+                     Point const &hit) const
+{
+    RenderStats::count(RenderStats::SHADOW_RAYS);
+
+    double lightDistance_2 = (contents->lights[lightIdx]->position - hit).length_2();
+
+    // Any object hit closer than the light casts the shadow. An object that
+    // blocked this light before likely blocks it again, so test it first.
+    unsigned &occluder = occluderCache.occluder(lightIdx);
+    if (occluder < contents->objects.size())
+    {
+        RenderStats::count(RenderStats::SHADOW_CACHE_LOOKUPS);
+        Hit shadowHit(object(occluder).intersect(shadowRay));
+        if ((shadowRay.at(shadowHit.t) - hit).length_2() < lightDistance_2)
+        {
+            RenderStats::count(RenderStats::SHADOW_CACHE_HITS);
+            return true;
+        }
+    }
+
+    pair<unsigned, Hit> shadowHit = closestHit(shadowRay);
+
+    // No object in hit by shadow ray.
+    if (shadowHit.first == contents->objects.size())
+        return false;
+
+    // No object in between light scr and object.
+    if ((shadowRay.at(shadowHit.second.t) - hit).length_2() >= lightDistance_2)
+        return false;
+
+    occluder = shadowHit.first;
+    return true;
+}
+
+RenderStats Scene::render(Image &img, ThreadPool &pool, int priority,
+                          GBuffer *gbuffer, Heatmap *heatmap,
+                          Checkpoint *checkpoint, TileCache *cache) const
 {
     unsigned w = img.width();
     unsigned h = img.height();
 
-    unsigned samples = supersamplingFactor * supersamplingFactor;
+    TileKernel kernel = tileKernel(features(),
+                                   make_index_sequence<ALL_FEATURES + 1>());
 
-    for (unsigned y = 0; y < h; ++y)
-        for (unsigned x = 0; x < w; ++x)
+    // Every tile writes its own pixels and statistics, so tiles need no
+    // locking
+    vector<future<void>> tiles;
+    vector<RenderStats> tileStats((w + tileSize - 1) / tileSize
+                                       * ((h + tileSize - 1) / tileSize));
+    for (unsigned y0 = 0; y0 < h; y0 += tileSize)
+        for (unsigned x0 = 0; x0 < w; x0 += tileSize)
         {
+            // Tiles restored from a checkpoint keep an invalid future
+            if (checkpoint and checkpoint->done(tiles.size()))
+            {
+                tiles.emplace_back();
+                continue;
+            }
+
+            unsigned x1 = min(x0 + tileSize, w);
+            unsigned y1 = min(y0 + tileSize, h);
+            RenderStats &stats = tileStats[tiles.size()];
+            tiles.push_back(pool.submit([=, &img, &stats]
+            {
+                uint64_t key = cache ? tileKey(x0, y0, x1, y1, h) : 0;
+                if (cache and cache->read(key, img, x0, y0, x1, y1))
+                    return;
+
+                stats = (this->*kernel)(img, x0, y0, x1, y1, gbuffer, heatmap);
+                if (cache)
+                    cache->write(key, img, x0, y0, x1, y1);
+            }, priority));
+        }
+
+    RenderStats total;
+    for (unsigned idx = 0; idx != tiles.size(); ++idx)
+    {
+        if (not tiles[idx].valid())
+            continue;
+
+        tiles[idx].get();
+        total += tileStats[idx];
+        if (checkpoint)
+            checkpoint->finish(idx, img);
+    }
+
+    if (gbuffer)
+        gbuffer->markComplete();
+
+    return total;
+}
+
+RenderStats Scene::renderBands(unsigned width, unsigned height,
+                               ThreadPool &pool,
+                               function<void(Image const &band)> const &sink,
+                               unsigned window) const
+{
+    TileKernel kernel = tileKernel(features(),
+                                   make_index_sequence<ALL_FEATURES + 1>());
+
+    // Bands in flight, a deque keeps their addresses while tiles run
+    struct Band
+    {
+        Image img;
+        vector<future<void>> tiles;
+        vector<RenderStats> tileStats;
+    };
+    deque<Band> bands;
+
+    RenderStats total;
+    auto finishFront = [&]
+    {
+        Band &band = bands.front();
+        for (unsigned idx = 0; idx != band.tiles.size(); ++idx)
+        {
+            band.tiles[idx].get();
+            total += band.tileStats[idx];
+        }
+        sink(band.img);
+        bands.pop_front();
+    };
+
+    for (unsigned y0 = 0; y0 < height; y0 += tileSize)
+    {
+        if (bands.size() == max(window, 1u))
+            finishFront();
+
+        unsigned y1 = min(y0 + tileSize, height);
+        bands.push_back(Band{Image(width, height, y0, y1 - y0), {},
+                             vector<RenderStats>((width + tileSize - 1) / tileSize)});
+
+        Band &band = bands.back();
+        for (unsigned x0 = 0; x0 < width; x0 += tileSize)
+        {
+            unsigned x1 = min(x0 + tileSize, width);
+            RenderStats &stats = band.tileStats[band.tiles.size()];
+            Image &img = band.img;
+            band.tiles.push_back(pool.submit([=, &img, &stats]
+            {
+                stats = (this->*kernel)(img, x0, y0, x1, y1, nullptr, nullptr);
+            }));
+        }
+    }
+
+    while (not bands.empty())
+        finishFront();
+
+    return total;
+}
+
+RenderStats Scene::rasterize(GBuffer &gbuffer, unsigned width,
+                             unsigned height, ThreadPool &pool) const
+{
+    unsigned const samples = supersamplingFactor * supersamplingFactor;
+
+    Rasterizer rasterizer(eye, width, height, samples, tileSize);
+    for (size_t idx = 0; idx != contents->spheres.shapes.size(); ++idx)
+        rasterizer.add(contents->spheres.shapes[idx], contents->spheres.ids[idx]);
+    for (size_t idx = 0; idx != contents->quads.shapes.size(); ++idx)
+        rasterizer.add(contents->quads.shapes[idx], contents->quads.ids[idx]);
+    for (size_t idx = 0; idx != contents->triangles.shapes.size(); ++idx)
+        rasterizer.add(contents->triangles.shapes[idx], contents->triangles.ids[idx]);
+
+    // Meshes are rasterized by triangle, other objects are ray cast
+    vector<unsigned> cast;
+    for (size_t idx = 0; idx != contents->others.shapes.size(); ++idx)
+    {
+        unsigned id = contents->others.ids[idx];
+        if (Mesh const *mesh = dynamic_cast<Mesh const *>(contents->others.shapes[idx].get()))
+            for (Triangle const &triangle : mesh->triangles())
+                rasterizer.add(triangle, id);
+        else
+            cast.push_back(id);
+    }
+
+    vector<future<void>> tiles;
+    vector<RenderStats> tileStats((width + tileSize - 1) / tileSize
+                                       * ((height + tileSize - 1) / tileSize));
+    for (unsigned y0 = 0; y0 < height; y0 += tileSize)
+        for (unsigned x0 = 0; x0 < width; x0 += tileSize)
+        {
+            RenderStats &stats = tileStats[tiles.size()];
+            tiles.push_back(pool.submit([=, &gbuffer, &rasterizer, &cast, &stats]
+            {
+                RenderStats::local() = RenderStats();
+
+                unsigned x1 = min(x0 + tileSize, width);
+                unsigned y1 = min(y0 + tileSize, height);
+
+                vector<Ray> rays;
+                for (unsigned y = y0; y < y1; ++y)
+                    for (unsigned x = x0; x < x1; ++x)
+                        for (unsigned n = 0; n < samples; ++n)
+                            rays.push_back(primaryRay(x, y, n, supersamplingFactor, height));
+
+                vector<Hit> hits(rays.size(),
+                                 Hit(numeric_limits<double>::infinity(), Vector()));
+                vector<unsigned> ids(rays.size(), contents->objects.size());
+                rasterizer.rasterize(x0, y0, rays, hits, ids);
+
+                for (unsigned obj : cast)
+                    for (size_t sample = 0; sample != rays.size(); ++sample)
+                    {
+                        Hit hit(object(obj).intersect(rays[sample]));
+                        if (hit.t < hits[sample].t
+                            or (hit.t == hits[sample].t and obj < ids[sample]))
+                        {
+                            hits[sample] = hit;
+                            ids[sample] = obj;
+                        }
+                    }
+
+                size_t sample = 0;
+                for (unsigned y = y0; y < y1; ++y)
+                    for (unsigned x = x0; x < x1; ++x)
+                        for (unsigned n = 0; n < samples; ++n, ++sample)
+                            recordHit(gbuffer(x, y, n), rays[sample], ids[sample],
+                                      hits[sample]);
+
+                stats = RenderStats::local();
+            }));
+        }
+
+    RenderStats total;
+    for (unsigned idx = 0; idx != tiles.size(); ++idx)
+    {
+        tiles[idx].get();
+        total += tileStats[idx];
+    }
+
+    gbuffer.markComplete();
+    return total;
+}
+
+void Scene::gatherGuides(GBuffer const &gbuffer, GuideBuffer &guides) const
+{
+    unsigned const samples = supersamplingFactor * supersamplingFactor;
+
+    for (unsigned y = 0; y != guides.height; ++y)
+        for (unsigned x = 0; x != guides.width; ++x)
+        {
+            Vector normal;
+            Color albedo;
+            double depth = 0.0;
+            unsigned hits = 0;
+
+            for (unsigned n = 0; n != samples; ++n)
+            {
+                GBuffer::Sample const &sample = gbuffer(x, y, n);
+                if (sample.object == GBuffer::NO_OBJECT)
+                    continue;
+
+                // Face the normal to the eye, as shading does
+                Ray ray(primaryRay(x, y, n, supersamplingFactor, guides.height));
+                Vector N(sample.N[0], sample.N[1], sample.N[2]);
+                normal += N.dot(ray.D) > 0.0 ? -N : N;
+
+                Hit hit(sample.t, N, sample.part);
+                Material const &material =
+                    contents->materials[object(sample.object).materialAt(hit)];
+                albedo += material.hasTexture
+                    ? material.texture->colorAt(sample.uv[0], 1.0 - sample.uv[1])
+                    : material.color;
+
+                depth += sample.t;
+                ++hits;
+            }
+
+            if (hits == 0)
+                continue;
+
+            unsigned pixel = y * guides.width + x;
+            for (unsigned channel = 0; channel != 3; ++channel)
+            {
+                guides.normal[channel][pixel] = normal.data[channel] / hits;
+                guides.albedo[channel][pixel] = albedo.data[channel] / hits;
+            }
+            guides.depth[pixel] = depth / hits;
+        }
+}
+
+RenderStats Scene::renderTile(Image &img, unsigned x0, unsigned y0,
+                              unsigned x1, unsigned y1,
+                              GBuffer *gbuffer, Heatmap *heatmap) const
+{
+    TileKernel kernel = tileKernel(features(),
+                                   make_index_sequence<ALL_FEATURES + 1>());
+    return (this->*kernel)(img, x0, y0, x1, y1, gbuffer, heatmap);
+}
+
+template <size_t ...Features>
+Scene::TileKernel Scene::tileKernel(unsigned features,
+                                    index_sequence<Features...>)
+{
+    static TileKernel const kernels[] = {&Scene::renderTileWith<Features>...};
+    return kernels[features];
+}
+
+template <size_t ...Features>
+Scene::TraceKernel Scene::traceKernel(unsigned features,
+                                      index_sequence<Features...>)
+{
+    static TraceKernel const kernels[] = {&Scene::traceWith<Features>...};
+    return kernels[features];
+}
+
+template <unsigned Features>
+RenderStats Scene::renderTileWith(Image &img, unsigned x0, unsigned y0,
+                                  unsigned x1, unsigned y1,
+                                  GBuffer *gbuffer, Heatmap *heatmap) const
+{
+    unsigned h = img.height();
+
+    // The whole tile runs on this thread, so the thread's counters are
+    // restarted here and returned as those of the tile
+    RenderStats::local() = RenderStats();
+
+    // Fill an incomplete buffer, otherwise shade from its primary hits
+    bool record = gbuffer and not gbuffer->complete();
+
+    // Heatmaps need the cost of each pixel, so they keep to pixel order
+    if ((Features & (TRANSPARENCY | REFLECTIONS)) and sortSecondaryRays
+        and not heatmap)
+    {
+        renderBatchWith<Features>(img, x0, y0, x1, y1, gbuffer);
+        return RenderStats::local();
+    }
+
+    unsigned const factor = (Features & SUPERSAMPLING) ? supersamplingFactor : 1;
+    unsigned const samples = factor * factor;
+
+    for (unsigned y = y0; y < y1; ++y)
+        for (unsigned x = x0; x < x1; ++x)
+        {
+            double before = heatmap ? heatmap->measure() : 0.0;
+
             Color col = Color(0.0, 0.0, 0.0);
             for (unsigned n = 0; n < samples; n++) {
-                float i = ((n % supersamplingFactor) + 1) / ((float) supersamplingFactor + 1.0f);
-                float j = ((n / supersamplingFactor) + 1) / ((float) supersamplingFactor + 1.0f);
-                Point pixel(x + i, h - 1 - y + j, 0);
-                Ray ray(eye, (pixel - eye).normalized());
-                col += trace(ray, recursionDepth) / samples;
+                Ray ray(primaryRay(x, y, n, factor, h));
+                RenderStats::count(RenderStats::PRIMARY_RAYS);
+                if (gbuffer)
+                    col += tracePrimary<Features>(ray, (*gbuffer)(x, y, n), record) / samples;
+                else
+                    col += traceWith<Features>(ray, recursionDepth) / samples;
+            }
+
+            col.clamp();
+            img(x, y) = col;
+
+            if (heatmap)
+                (*heatmap)(x, y) = heatmap->measure() - before;
+        }
+
+    return RenderStats::local();
+}
+
+template <unsigned Features>
+void Scene::renderBatchWith(Image &img, unsigned x0, unsigned y0,
+                            unsigned x1, unsigned y1, GBuffer *gbuffer) const
+{
+    unsigned h = img.height();
+    bool record = gbuffer and not gbuffer->complete();
+
+    unsigned const factor = (Features & SUPERSAMPLING) ? supersamplingFactor : 1;
+    unsigned const samples = factor * factor;
+
+    // Color of every sample, pixels in row-major order
+    vector<Color> colors((x1 - x0) * (y1 - y0) * samples, Color(0.0, 0.0, 0.0));
+    vector<PathRay> rays;
+    vector<PathRay> next;
+
+    // Primary rays are coherent already, they are traced in pixel order
+    unsigned idx = 0;
+    for (unsigned y = y0; y < y1; ++y)
+        for (unsigned x = x0; x < x1; ++x)
+            for (unsigned n = 0; n < samples; ++n, ++idx)
+            {
+                Ray ray(primaryRay(x, y, n, factor, h));
+                RenderStats::count(RenderStats::PRIMARY_RAYS);
+
+                Hit hit(Hit::NO_HIT());
+                Vector uv;
+                unsigned obj;
+                if (gbuffer)
+                    obj = primaryHit(ray, (*gbuffer)(x, y, n), record, hit, uv);
+                else
+                {
+                    pair<unsigned, Hit> mainhit = closestHit(ray);
+                    obj = mainhit.first;
+                    hit = mainhit.second;
+                    if ((Features & TEXTURES) and obj != contents->objects.size()
+                        and contents->materials[object(obj).materialAt(hit)].hasTexture)
+                        uv = object(obj).toUV(ray.at(hit.t));
+                }
+
+                if (obj != contents->objects.size())
+                    colors[idx] = shadeWith<Features>(ray, object(obj), hit,
+                        uv, recursionDepth, Enqueue{next, 1.0, idx});
             }
 
+    // Every generation of secondary rays is sorted, then traced
+    for (unsigned depth = recursionDepth; not next.empty(); )
+    {
+        --depth;
+        rays.swap(next);
+        next.clear();
+        sortRays(rays);
+
+        for (PathRay const &path : rays)
+        {
+            pair<unsigned, Hit> mainhit = closestHit(path.ray);
+            if (mainhit.first == contents->objects.size())
+                continue;
+
+            Object const &obj = object(mainhit.first);
+            Hit const &hit = mainhit.second;
+            Vector uv;
+            if ((Features & TEXTURES) and contents->materials[obj.materialAt(hit)].hasTexture)
+                uv = obj.toUV(path.ray.at(hit.t));
+
+            colors[path.sample] += shadeWith<Features>(path.ray, obj, hit, uv,
+                depth, Enqueue{next, path.weight, path.sample}) * path.weight;
+        }
+    }
+
+    idx = 0;
+    for (unsigned y = y0; y < y1; ++y)
+        for (unsigned x = x0; x < x1; ++x)
+        {
+            Color col = Color(0.0, 0.0, 0.0);
+            for (unsigned n = 0; n < samples; ++n)
+                col += colors[idx++] / samples;
+
             col.clamp();
             img(x, y) = col;
         }
@@ -161,25 +986,96 @@ void Scene::render(Image &img)
 
 // --- Misc functions ----------------------------------------------------------
 
+
 // Defaults
 Scene::Scene()
 :
-    objects(),
-    lights(),
+    contents(make_shared<Contents>()),
     eye(),
     renderShadows(false),
     recursionDepth(0),
-    supersamplingFactor(1)
+    supersamplingFactor(1),
+    pixelScale(1.0),
+    sortSecondaryRays(false),
+    lightThreshold(0.0),
+    shadowRayBudget(0)
 {}
 
-void Scene::addObject(ObjectPtr obj)
+void Scene::addObject(ObjectPtr obj, uint64_t key)
+{
+    // Shading indexes the table unchecked, so every index is checked here
+    vector<unsigned> indices(1, obj->material);
+    if (SphereCloud const *cloud = dynamic_cast<SphereCloud const *>(obj.get()))
+        indices = cloud->materials();
+    for (unsigned idx : indices)
+        if (idx >= contents->materials.size())
+            throw runtime_error("Material index " + to_string(idx) + " is not in "
+                                "the table of " + to_string(contents->materials.size())
+                                + " materials.");
+
+    Contents &edited = edit();
+    unsigned id = edited.objects.size();
+    edited.objectKeys.push_back(key);
+
+    // The basic shapes are moved into their array, obj is then dropped
+    if (Sphere const *sphere = dynamic_cast<Sphere const *>(obj.get()))
+    {
+        edited.objects.push_back(
+            Slot{SPHERE, static_cast<unsigned>(edited.spheres.shapes.size())});
+        edited.spheres.shapes.push_back(*sphere);
+        edited.spheres.ids.push_back(id);
+    }
+    else if (Quad const *quad = dynamic_cast<Quad const *>(obj.get()))
+    {
+        edited.objects.push_back(
+            Slot{QUAD, static_cast<unsigned>(edited.quads.shapes.size())});
+        edited.quads.shapes.push_back(*quad);
+        edited.quads.ids.push_back(id);
+    }
+    else if (Triangle const *triangle = dynamic_cast<Triangle const *>(obj.get()))
+    {
+        edited.objects.push_back(
+            Slot{TRIANGLE, static_cast<unsigned>(edited.triangles.shapes.size())});
+        edited.triangles.shapes.push_back(*triangle);
+        edited.triangles.ids.push_back(id);
+    }
+    else
+    {
+        edited.objects.push_back(
+            Slot{OTHER, static_cast<unsigned>(edited.others.shapes.size())});
+        edited.others.shapes.push_back(obj);
+        edited.others.ids.push_back(id);
+    }
+}
+
+unsigned Scene::addMaterial(Material const &material)
 {
-    objects.push_back(obj);
+    Contents &edited = edit();
+    edited.materials.push_back(material);
+    return edited.materials.size() - 1;
+}
+
+void Scene::setMaterial(unsigned idx, Material const &material)
+{
+    edit().materials.at(idx) = material;
 }
 
 void Scene::addLight(Light const &light)
 {
-    lights.push_back(LightPtr(new Light(light)));
+    Contents &edited = edit();
+    edited.lights.push_back(LightPtr(new Light(light)));
+
+    if (edited.lightTree)
+        edited.lightTree = make_shared<LightTree const>(edited.lights);
+}
+
+Scene::Contents &Scene::edit()
+{
+    // Renders only read the contents, so a scene that holds the only
+    // reference can change them in place
+    if (contents.use_count() != 1)
+        contents = make_shared<Contents>(*contents);
+    return const_cast<Contents &>(*contents);
 }
 
 void Scene::setEye(Triple const &position)
@@ -189,12 +1085,12 @@ void Scene::setEye(Triple const &position)
 
 unsigned Scene::getNumObject()
 {
-    return objects.size();
+    return contents->objects.size();
 }
 
 unsigned Scene::getNumLights()
 {
-    return lights.size();
+    return contents->lights.size();
 }
 
 void Scene::setRenderShadows(bool shadows)
@@ -211,3 +1107,154 @@ void Scene::setSuperSample(unsigned factor)
 {
     supersamplingFactor = factor;
 }
+
+void Scene::setPixelScale(double scale)
+{
+    pixelScale = scale;
+}
+
+void Scene::setLightSampling(double threshold, unsigned budget)
+{
+    Contents &edited = edit();
+    edited.lightTree = make_shared<LightTree const>(edited.lights);
+    lightThreshold = threshold;
+    shadowRayBudget = budget;
+}
+
+void Scene::setSortSecondaryRays(bool sort)
+{
+    sortSecondaryRays = sort;
+}
+
+unsigned Scene::getSuperSample() const
+{
+    return supersamplingFactor;
+}
+
+unsigned Scene::getTileSize() const
+{
+    return tileSize;
+}
+
+uint64_t Scene::tileKey(unsigned x0, unsigned y0, unsigned x1, unsigned y1,
+                        unsigned h) const
+{
+    // The rays follow from the eye, the pixel size, the place of the tile
+    // on the view plane, its size in pixels and the samples per pixel
+    double const rays[] = {
+        eye.x, eye.y, eye.z, pixelScale,
+        static_cast<double>(x0), static_cast<double>(h - y0),
+        static_cast<double>(x1 - x0), static_cast<double>(y1 - y0),
+        static_cast<double>(supersamplingFactor)
+    };
+
+    Hash key;
+    key.add(rays, sizeof(rays));
+    for (unsigned idx : tileReach(x0, y0, x1, y1, h))
+        key.add(uint64_t(idx)).add(contents->objectKeys[idx]);
+    return key.value();
+}
+
+vector<unsigned> Scene::tileReach(unsigned x0, unsigned y0, unsigned x1,
+                                  unsigned y1, unsigned h) const
+{
+    vector<unsigned> all(contents->objects.size());
+    iota(all.begin(), all.end(), 0);
+
+    // Corners of the tile on the view plane, around the samples of
+    // primaryRay with some slack for rounding. The rays of the tile run
+    // from the eye through this rectangle.
+    double left = x0 * pixelScale - epsilon;
+    double right = x1 * pixelScale + epsilon;
+    double bottom = (h - y1) * pixelScale - epsilon;
+    double top = (h - y0) * pixelScale + epsilon;
+    Point const corners[] = {Point(left, bottom, 0), Point(right, bottom, 0),
+                             Point(right, top, 0), Point(left, top, 0)};
+    Point center((left + right) / 2, (bottom + top) / 2, 0);
+
+    // The planes through the eye and each edge, normals pointing inwards
+    Vector normals[4];
+    for (unsigned idx = 0; idx != 4; ++idx)
+    {
+        normals[idx] = (corners[idx] - eye).cross(corners[(idx + 1) % 4] - eye);
+        if (normals[idx].dot(center - eye) < 0.0)
+            normals[idx] = -normals[idx];
+    }
+
+    auto bounces = [&](Object const &obj)
+    {
+        vector<unsigned> indices(1, obj.material);
+        if (SphereCloud const *cloud = dynamic_cast<SphereCloud const *>(&obj))
+            indices = cloud->materials();
+        for (unsigned idx : indices)
+            if (contents->materials[idx].isTransparent or contents->materials[idx].ks > 0.0)
+                return true;
+        return false;
+    };
+
+    // Objects primary rays can hit, and the box around the parts of them
+    // in the frustum, where the hits are
+    vector<unsigned> reach;
+    bool bounded = true;
+    double const inf = numeric_limits<double>::infinity();
+    Point lower(inf, inf, inf);
+    Point upper(-inf, -inf, -inf);
+    for (unsigned idx = 0; idx != contents->objects.size(); ++idx)
+    {
+        Point objLower, objUpper;
+        bool hasBounds = object(idx).bounds(objLower, objUpper);
+        if (hasBounds and not clipBox(objLower, objUpper, eye, normals))
+            continue;
+
+        if (recursionDepth > 0 and bounces(object(idx)))
+            return all;
+
+        reach.push_back(idx);
+        bounded = bounded and hasBounds;
+        for (unsigned axis = 0; axis != 3 and hasBounds; ++axis)
+        {
+            lower.data[axis] = min(lower.data[axis], objLower.data[axis]);
+            upper.data[axis] = max(upper.data[axis], objUpper.data[axis]);
+        }
+    }
+
+    if (not renderShadows or reach.empty() or contents->lights.empty())
+        return reach;
+    if (not bounded)
+        return all;
+
+    // Shadow rays run from those hits to each light, within the box around
+    // both
+    vector<Point> lightLower;
+    vector<Point> lightUpper;
+    for (LightPtr const &light : contents->lights)
+    {
+        Point shadowLower = lower;
+        Point shadowUpper = upper;
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            shadowLower.data[axis] = min(lower.data[axis], light->position.data[axis]);
+            shadowUpper.data[axis] = max(upper.data[axis], light->position.data[axis]);
+        }
+        lightLower.push_back(shadowLower - Vector(epsilon, epsilon, epsilon));
+        lightUpper.push_back(shadowUpper + Vector(epsilon, epsilon, epsilon));
+    }
+
+    reach.clear();
+    for (unsigned idx = 0; idx != contents->objects.size(); ++idx)
+    {
+        Point objLower, objUpper;
+        bool overlaps = not object(idx).bounds(objLower, objUpper);
+        for (unsigned light = 0; light != contents->lights.size() and not overlaps; ++light)
+        {
+            overlaps = true;
+            for (unsigned axis = 0; axis != 3; ++axis)
+                overlaps = overlaps
+                           and objLower.data[axis] <= lightUpper[light].data[axis]
+                           and lightLower[light].data[axis] <= objUpper.data[axis];
+        }
+        if (overlaps)
+            reach.push_back(idx);
+    }
+    return reach;
+}
@@ -1,54 +1,314 @@
 #ifndef SCENE_H_
 #define SCENE_H_
 
+#include "gbuffer.h"
 #include "light.h"
+#include "material.h"
 #include "object.h"
+#include "stats.h"
 #include "triple.h"
+#include "shapes/quad.h"
+#include "shapes/sphere.h"
+#include "shapes/triangle.h"
 
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <vector>
 #include <utility>
 
 // Forward declarations
+class Checkpoint;
 class Ray;
+struct GuideBuffer;
+class Heatmap;
 class Image;
+class LightTree;
+class ThreadPool;
+class TileCache;
 
 class Scene
 {
-    std::vector<ObjectPtr> objects;
-    std::vector<LightPtr> lights;
+    // The shapes of one type, with their index in objects
+    template <typename Shape>
+    struct Group
+    {
+        std::vector<Shape> shapes;
+        std::vector<unsigned> ids;
+    };
+
+    enum Kind
+    {
+        SPHERE,
+        QUAD,
+        TRIANGLE,
+        OTHER
+    };
+
+    // Where an object is stored: the group of its kind and its place there
+    struct Slot
+    {
+        Kind kind;
+        unsigned pos;
+    };
+
+    // What copies of a scene share: its objects, materials and lights.
+    // Copies differ only in the render settings after it, a change to the
+    // contents is made to a copy of them if they are shared (see edit).
+    struct Contents
+    {
+        std::vector<Slot> objects;
+
+        // Content keys of the objects, for the tile cache
+        std::vector<std::uint64_t> objectKeys;
+
+        // Materials of all objects, which refer to them by index
+        std::vector<Material> materials;
+
+        // Every object is stored once. Spheres, quads and triangles are
+        // held by value in contiguous arrays per type, and intersected
+        // without virtual dispatch. Other objects, such as meshes and
+        // sphere clouds, are held by pointer and tested through
+        // Object::intersect.
+        Group<Sphere> spheres;
+        Group<Quad> quads;
+        Group<Triangle> triangles;
+        Group<ObjectPtr> others;
+        std::vector<LightPtr> lights;
+
+        // Light clusters for the many-light mode, if it is on
+        std::shared_ptr<LightTree const> lightTree;
+    };
+
+    std::shared_ptr<Contents const> contents;
+
     Point eye;
     bool renderShadows;
     unsigned recursionDepth;
     unsigned supersamplingFactor;
 
+    // Size of an image pixel on the view plane. Above 1 a smaller image
+    // shows the same view at a lower resolution.
+    double pixelScale;
+
+    // Batched mode: tiles trace each generation of secondary rays together,
+    // sorted by origin and direction so neighbouring rays visit the same
+    // parts of the scene, instead of recursing per pixel.
+    bool sortSecondaryRays;
+
+    // Many-light mode, only used when the contents have a light tree. Light
+    // clusters whose bounded contribution is at most lightThreshold are
+    // skipped. With a nonzero shadowRayBudget, that many lights are
+    // importance sampled per shading point instead of shading every light
+    // left.
+    double lightThreshold;
+    unsigned shadowRayBudget;
+
     // Offset multiplier. Before casting a new ray from a hit point,
     // move the hit point in the direction of the normal with this offset
     // to prevent finding an intersection with the same object due to
     // floating point inaccuracies. This prevents shadow acne, among other problems.
     double const epsilon = 1E-3;
 
+    // Width and height in pixels of the tiles handed to the thread pool
+    unsigned const tileSize = 32;
+
+    public:
+        // Shading features. The render loop is instantiated for every
+        // combination, and renders run the one with the features their
+        // scene uses, so the code of unused features is left out.
+        enum Feature
+        {
+            SHADOWS         = 1 << 0,
+            TEXTURES        = 1 << 1,
+            TRANSPARENCY    = 1 << 2,
+            REFLECTIONS     = 1 << 3,
+            SUPERSAMPLING   = 1 << 4,
+            ALL_FEATURES    = (1 << 5) - 1
+        };
+
+    private:
+        typedef RenderStats (Scene::*TileKernel)(Image &img, unsigned x0,
+            unsigned y0, unsigned x1, unsigned y1, GBuffer *gbuffer,
+            Heatmap *heatmap) const;
+        typedef Color (Scene::*TraceKernel)(Ray const &ray,
+            unsigned depth) const;
+
     public:
         Scene();
 
-        // determine closest hit (if any)
-        std::pair<ObjectPtr, Hit> castRay(Ray const &ray) const;
+        // determine closest hit (if any), the object is null on a miss
+        std::pair<Object const *, Hit> castRay(Ray const &ray) const;
+
+        // trace a ray into the scene and return the color, with the
+        // features the scene uses, as render does
+        Color trace(Ray const &ray, unsigned depth) const;
+
+        // the features the objects, lights and settings call for
+        unsigned features() const;
+
+        // render the scene to the given image, tiles are queued on the pool
+        // with the given priority and this call blocks until all are done.
+        // With a gbuffer, an incomplete one records the primary hits and a
+        // complete one replaces primary ray intersection.
+        // With a heatmap, the cost of every pixel is stored in it.
+        // With a checkpoint, its finished tiles are skipped and every tile
+        // finished now is reported to it.
+        // With a tile cache, tiles found in it by tileKey are copied instead
+        // of traced, and traced tiles are added to it.
+        // Returns the merged counters of the tiles rendered.
+        RenderStats render(Image &img, ThreadPool &pool, int priority = 0,
+                           GBuffer *gbuffer = nullptr,
+                           Heatmap *heatmap = nullptr,
+                           Checkpoint *checkpoint = nullptr,
+                           TileCache *cache = nullptr) const;
+
+        // render a width x height image in bands of one row of tiles, with
+        // at most window bands queued on the pool at a time. Every finished
+        // band is handed to sink on the calling thread, top to bottom, so
+        // memory does not grow with the image height.
+        RenderStats renderBands(unsigned width, unsigned height,
+                                ThreadPool &pool,
+                                std::function<void(Image const &band)> const &sink,
+                                unsigned window = 2) const;
+
+        // Fill the gbuffer of a width x height image by rasterizing the
+        // spheres, quads, triangles and meshes, intersecting only the
+        // primary rays of the other objects. Tiles are queued on the pool.
+        // Marks the buffer complete and returns the merged counters.
+        RenderStats rasterize(GBuffer &gbuffer, unsigned width,
+                              unsigned height, ThreadPool &pool) const;
+
+        // Fill the denoiser guides from the primary hits of a complete
+        // gbuffer of the same size
+        void gatherGuides(GBuffer const &gbuffer, GuideBuffer &guides) const;
 
-        // trace a ray into the scene and return the color
-        Color trace(Ray const &ray, unsigned depth);
+        // render the pixels [x0, x1) x [y0, y1) of the given image and
+        // return the counters of this tile
+        RenderStats renderTile(Image &img, unsigned x0, unsigned y0,
+                               unsigned x1, unsigned y1,
+                               GBuffer *gbuffer = nullptr,
+                               Heatmap *heatmap = nullptr) const;
 
-        // render the scene to the given image
-        void render(Image &img);
 
+        // key is a hash of everything that makes up the object, its shape
+        // and materials, used to key the tiles that can see it. Throws if
+        // the object refers to a material not added yet.
+        void addObject(ObjectPtr obj, std::uint64_t key = 0);
 
-        void addObject(ObjectPtr obj);
+        // add a material to the table and return its index
+        unsigned addMaterial(Material const &material);
+
+        // replace a material, for every object that uses it
+        void setMaterial(unsigned idx, Material const &material);
         void addLight(Light const &light);
         void setEye(Triple const &position);
         void setRenderShadows(bool renderShadows);
         void setRecursionDepth(unsigned depth);
         void setSuperSample(unsigned factor);
+        void setPixelScale(double scale);
+        void setLightSampling(double threshold, unsigned budget);
+        void setSortSecondaryRays(bool sort);
 
         unsigned getNumObject();
         unsigned getNumLights();
+        unsigned getSuperSample() const;
+        unsigned getTileSize() const;
+
+        // Key of the tile [x0, x1) x [y0, y1) of an image of height h: a
+        // hash of its camera rays and the keys of the objects they can
+        // reach. Lights and render settings are not part of it.
+        std::uint64_t tileKey(unsigned x0, unsigned y0, unsigned x1,
+                              unsigned y1, unsigned h) const;
+
+        // Indices of the objects the rays of a tile can reach, ascending.
+        // Primary rays stay in the tile's frustum and shadow rays in the box
+        // around the objects in it and the lights. Reflected and refracted
+        // rays can reach anything, as can rays near unbounded objects.
+        std::vector<unsigned> tileReach(unsigned x0, unsigned y0, unsigned x1,
+                                        unsigned y1, unsigned h) const;
+
+    private:
+        // the contents, copied first if other scenes share them
+        Contents &edit();
+
+        // the object of an index
+        Object const &object(unsigned idx) const;
+
+        // index of the closest object hit, objects.size() if none
+        std::pair<unsigned, Hit> closestHit(Ray const &ray) const;
+
+        // update min_hit and obj if a shape of the group is hit closer
+        template <typename Shape>
+        static void closestIn(Group<Shape> const &group, Ray const &ray,
+                              Hit &min_hit, unsigned &obj);
+
+        // renderTile with the given features
+        template <unsigned Features>
+        RenderStats renderTileWith(Image &img, unsigned x0, unsigned y0,
+                                   unsigned x1, unsigned y1, GBuffer *gbuffer,
+                                   Heatmap *heatmap) const;
+
+        // renderTileWith in batched mode, tracing a generation at a time
+        template <unsigned Features>
+        void renderBatchWith(Image &img, unsigned x0, unsigned y0,
+                             unsigned x1, unsigned y1, GBuffer *gbuffer) const;
+
+        template <size_t ...Features>
+        static TileKernel tileKernel(unsigned features,
+                                     std::index_sequence<Features...>);
+
+        template <size_t ...Features>
+        static TraceKernel traceKernel(unsigned features,
+                                       std::index_sequence<Features...>);
+
+        template <unsigned Features>
+        Color traceWith(Ray const &ray, unsigned depth) const;
+
+        // shade a primary sample, first recording its hit if asked to
+        template <unsigned Features>
+        Color tracePrimary(Ray const &ray, GBuffer::Sample &sample,
+                           bool record) const;
+
+        // ray through sample n of pixel (x, y) of an image of height h
+        Ray primaryRay(unsigned x, unsigned y, unsigned n, unsigned factor,
+                       unsigned h) const;
+
+        // store a primary hit of object obj, objects.size() for a miss
+        void recordHit(GBuffer::Sample &sample, Ray const &ray, unsigned obj,
+                       Hit const &hit) const;
+
+        // the object index of a primary sample, objects.size() if none,
+        // with its hit and texture coordinates. Records it if asked to.
+        unsigned primaryHit(Ray const &ray, GBuffer::Sample &sample,
+                            bool record, Hit &hit, Vector &uv) const;
+
+        // color of the given hit, uv is only read for textured materials
+        template <unsigned Features>
+        Color shade(Ray const &ray, Object const &obj, Hit const &min_hit,
+                    Vector const &uv, unsigned depth) const;
+
+        // shade, handing every secondary ray to bounce(ray, weight), which
+        // returns the color it adds
+        template <unsigned Features, typename Bounce>
+        Color shadeWith(Ray const &ray, Object const &obj, Hit const &min_hit,
+                        Vector const &uv, unsigned depth, Bounce bounce) const;
+
+        // diffuse and specular light at a hit, from all lights
+        template <unsigned Features>
+        Color directLight(Point const &hit, Vector const &shadingN,
+                          Vector const &V, Material const &material,
+                          Color const &matColor) const;
+
+        // diffuse and specular light at a hit, from lights[lightIdx]
+        template <unsigned Features>
+        Color illuminate(unsigned lightIdx, Point const &hit,
+                         Vector const &shadingN, Vector const &V,
+                         Material const &material, Color const &matColor) const;
+
+        // whether an object blocks the shadow ray before lights[lightIdx]
+        bool inShadow(unsigned lightIdx, Ray const &shadowRay,
+                      Point const &hit) const;
 };
 
 #endif
@@ -0,0 +1,108 @@
+#include "mesh.h"
+
+#include "../objloader.h"
+#include "../stats.h"
+#include "../vertex.h"
+
+#include <cmath>
+#include <iostream>
+#include <limits>
+
+using namespace std;
+
+Hit Mesh::intersect(Ray const &ray) const
+{
+    RenderStats::count(RenderStats::MESH_TESTS);
+    return d_geometry->bvh.intersect(ray, d_geometry->tris);
+}
+
+bool Mesh::bounds(Point &lower, Point &upper) const
+{
+    if (d_geometry->tris.empty())
+        return false;
+
+    lower = d_geometry->bvh.lower();
+    upper = d_geometry->bvh.upper();
+    return true;
+}
+
+unsigned Mesh::numTriangles() const
+{
+    return d_geometry->tris.size();
+}
+
+vector<Triangle> const &Mesh::triangles() const
+{
+    return d_geometry->tris;
+}
+
+size_t Mesh::bvhBytes() const
+{
+    return d_geometry->bvh.bytes();
+}
+
+Mesh::Mesh(string const &filename, Point const &position,
+           Vector const &rotation, Vector const &scale,
+           MeshBVH::Layout layout, ostream &log)
+:
+    d_geometry(build(filename, position, rotation, scale, layout, log))
+{}
+
+Mesh::Mesh(shared_ptr<Geometry const> const &geometry)
+:
+    d_geometry(geometry)
+{}
+
+shared_ptr<Mesh::Geometry const> Mesh::build(string const &filename,
+                                             Point const &position,
+                                             Vector const &rotation,
+                                             Vector const &scale,
+                                             MeshBVH::Layout layout,
+                                             ostream &log)
+{
+    auto geometry = make_shared<Geometry>();
+    geometry->tris = load(filename, position, rotation, scale);
+    geometry->bvh = MeshBVH(geometry->tris, layout);
+
+    log << "Loaded model: " << filename << " with " <<
+        geometry->tris.size() << " triangles.\n";
+    return geometry;
+}
+
+vector<Triangle> Mesh::load(string const &filename, Point const &position,
+                            Vector const &rotation, Vector const &scale)
+{
+    OBJLoader model(filename);
+    vector<Triangle> tris;
+    tris.reserve(model.numTriangles());
+
+    auto transform = [&](Vertex const &vertex)
+    {
+        return place(Point(vertex.x, vertex.y, vertex.z), position, rotation,
+                     scale);
+    };
+
+    vector<Vertex> vertices = model.vertex_data();
+    for (size_t tri = 0; tri != model.numTriangles(); ++tri)
+        tris.emplace_back(transform(vertices[tri * 3]),
+                          transform(vertices[tri * 3 + 1]),
+                          transform(vertices[tri * 3 + 2]));
+
+    return tris;
+}
+
+Point Mesh::place(Point const &vertex, Point const &position,
+                  Vector const &rotation, Vector const &scale)
+{
+    Point v(vertex.x * scale.x, vertex.y * scale.y, vertex.z * scale.z);
+    v = Point(v.x,
+              v.y * cos(rotation.x) - v.z * sin(rotation.x),
+              v.y * sin(rotation.x) + v.z * cos(rotation.x));
+    v = Point(v.x * cos(rotation.y) + v.z * sin(rotation.y),
+              v.y,
+              -v.x * sin(rotation.y) + v.z * cos(rotation.y));
+    v = Point(v.x * cos(rotation.z) - v.y * sin(rotation.z),
+              v.x * sin(rotation.z) + v.y * cos(rotation.z),
+              v.z);
+    return v + position;
+}
@@ -0,0 +1,66 @@
+#ifndef MESH_H_
+#define MESH_H_
+
+#include "../object.h"
+#include "meshbvh.h"
+#include "triangle.h"
+
+#include <iosfwd>
+#include <memory>
+#include <string>
+#include <vector>
+
+class Mesh: public Object
+{
+    public:
+        // Triangles and their tree, which meshes of the same model, pose
+        // and layout can share
+        struct Geometry
+        {
+            std::vector<Triangle> tris; // in the leaf order of bvh
+            MeshBVH bvh;
+        };
+
+    private:
+        std::shared_ptr<Geometry const> d_geometry;
+
+    public:
+        Mesh(std::string const &filename,
+             Point const &position,
+             Vector const &rotation,
+             Vector const &scale,
+             MeshBVH::Layout layout,
+             std::ostream &log);
+
+        explicit Mesh(std::shared_ptr<Geometry const> const &geometry);
+
+        // Load the model and build the tree of a mesh, reporting on log
+        static std::shared_ptr<Geometry const> build(std::string const &filename,
+                                                     Point const &position,
+                                                     Vector const &rotation,
+                                                     Vector const &scale,
+                                                     MeshBVH::Layout layout,
+                                                     std::ostream &log);
+
+        // Triangles of an OBJ model after non-uniform scaling, then
+        // rotation around x, y and z (in radians), then translation
+        static std::vector<Triangle> load(std::string const &filename,
+                                          Point const &position,
+                                          Vector const &rotation,
+                                          Vector const &scale);
+
+        // a vertex of the model placed as by load
+        static Point place(Point const &vertex, Point const &position,
+                           Vector const &rotation, Vector const &scale);
+
+        Hit intersect(Ray const &ray) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+
+        unsigned numTriangles() const;
+        std::vector<Triangle> const &triangles() const;
+
+        // memory taken by the BVH nodes
+        std::size_t bvhBytes() const;
+};
+
+#endif
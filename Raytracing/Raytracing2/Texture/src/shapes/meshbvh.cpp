@@ -0,0 +1,456 @@
+#include "meshbvh.h"
+
+#include "../stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    // Packed child references: a leaf sets the top bit and holds its
+    // triangle count in the next three bits and its first triangle below
+    uint32_t const LEAF_BIT = 1u << 31;
+    unsigned const MAX_FIRST = 1u << 28;
+
+    uint32_t leafRef(unsigned first, unsigned count)
+    {
+        return LEAF_BIT | count << 28 | first;
+    }
+
+    template <typename Q>
+    double stepOf(double lower, double upper)
+    {
+        return (upper - lower) / numeric_limits<Q>::max();
+    }
+
+    // Coordinate of step q of the box [lower, upper] on one axis. The end
+    // steps are exact, so boxes decode to within their parent.
+    template <typename Q>
+    double decode(double lower, double upper, double step, Q q)
+    {
+        return q == numeric_limits<Q>::max() ? upper : lower + q * step;
+    }
+
+    // Steps of the parent box enclosing [lower, upper], rounded outwards
+    // so the decoded box always holds the original one
+    template <typename Q>
+    void encode(Point const &lower, Point const &upper,
+                Point const &parentLower, Point const &parentUpper,
+                Q qLower[3], Q qUpper[3])
+    {
+        double const steps = numeric_limits<Q>::max();
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            double from = parentLower.data[axis];
+            double to = parentUpper.data[axis];
+            double extent = to - from;
+            double step = stepOf<Q>(from, to);
+
+            double lo = 0.0;
+            double hi = steps;
+            if (extent > 0.0)
+            {
+                lo = min(max(floor((lower.data[axis] - from) / extent * steps), 0.0), steps);
+                hi = min(max(ceil((upper.data[axis] - from) / extent * steps), 0.0), steps);
+            }
+            qLower[axis] = static_cast<Q>(lo);
+            qUpper[axis] = static_cast<Q>(hi);
+
+            while (qLower[axis] > 0
+                   and decode(from, to, step, qLower[axis]) > lower.data[axis])
+                --qLower[axis];
+            while (qUpper[axis] < steps
+                   and decode(from, to, step, qUpper[axis]) < upper.data[axis])
+                ++qUpper[axis];
+        }
+    }
+
+    template <typename Q>
+    void decodeBox(Q const qLower[3], Q const qUpper[3],
+                   Point const &parentLower, Point const &parentUpper,
+                   Point &lower, Point &upper)
+    {
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            double from = parentLower.data[axis];
+            double to = parentUpper.data[axis];
+            double step = stepOf<Q>(from, to);
+            lower.data[axis] = decode(from, to, step, qLower[axis]);
+            upper.data[axis] = decode(from, to, step, qUpper[axis]);
+        }
+    }
+
+    // closest hit of the triangles [first, first + count) so far
+    void intersectLeaf(Ray const &ray, vector<Triangle> const &tris,
+                       unsigned first, unsigned count, Hit &min_hit)
+    {
+        for (unsigned idx = first; idx != first + count; ++idx)
+        {
+            Hit hit(tris[idx].intersect(ray));
+            if (hit.t < min_hit.t)
+                min_hit = hit;
+        }
+    }
+}
+
+MeshBVH::MeshBVH()
+:
+    d_layout(FULL),
+    d_root(0)
+{}
+
+MeshBVH::MeshBVH(vector<Triangle> &tris, Layout layout)
+:
+    d_layout(layout),
+    d_root(0)
+{
+    if (tris.empty())
+        return;
+
+    if (layout != FULL and tris.size() >= MAX_FIRST)
+        throw runtime_error("Too many triangles for a quantized BVH.");
+
+    vector<unsigned> order(tris.size());
+    iota(order.begin(), order.end(), 0);
+
+    d_nodes.reserve(2 * ((tris.size() + LEAF_SIZE - 1) / LEAF_SIZE));
+    build(tris, order, 0, order.size());
+
+    // Store the triangles in leaf order
+    vector<Triangle> sorted;
+    sorted.reserve(tris.size());
+    for (unsigned idx : order)
+        sorted.push_back(tris[idx]);
+    tris.swap(sorted);
+
+    d_lower = d_nodes[0].lower;
+    d_upper = d_nodes[0].upper;
+
+    if (layout == FULL)
+        return;
+
+    if (layout == QUANTIZED8)
+        d_root = quantize(d_nodes8, 0, d_lower, d_upper);
+    else
+        d_root = quantize(d_nodes16, 0, d_lower, d_upper);
+    vector<Node>().swap(d_nodes);
+}
+
+bool MeshBVH::parseLayout(string const &name, Layout &layout)
+{
+    if (name == "full")
+        layout = FULL;
+    else if (name == "quantized8")
+        layout = QUANTIZED8;
+    else if (name == "quantized16")
+        layout = QUANTIZED16;
+    else
+        return false;
+    return true;
+}
+
+Hit MeshBVH::intersect(Ray const &ray, vector<Triangle> const &tris) const
+{
+    if (tris.empty())
+        return Hit::NO_HIT();
+
+    switch (d_layout)
+    {
+        case QUANTIZED8:
+            return intersectQuantized(ray, d_nodes8, tris);
+        case QUANTIZED16:
+            return intersectQuantized(ray, d_nodes16, tris);
+        default:
+            return intersectFull(ray, tris);
+    }
+}
+
+double MeshBVH::enter(Point const &lower, Point const &upper, Ray const &ray,
+                      Vector const &invD)
+{
+    double tNear = 0.0;
+    double tFar = numeric_limits<double>::infinity();
+    for (unsigned axis = 0; axis != 3; ++axis)
+    {
+        double t0 = (lower.data[axis] - ray.O.data[axis]) * invD.data[axis];
+        double t1 = (upper.data[axis] - ray.O.data[axis]) * invD.data[axis];
+        if (t0 > t1)
+            swap(t0, t1);
+        tNear = max(tNear, t0);
+        tFar = min(tFar, t1);
+    }
+
+    return tNear <= tFar ? tNear : numeric_limits<double>::infinity();
+}
+
+Point const &MeshBVH::lower() const
+{
+    return d_lower;
+}
+
+Point const &MeshBVH::upper() const
+{
+    return d_upper;
+}
+
+size_t MeshBVH::bytes() const
+{
+    return d_nodes.size() * sizeof(Node)
+         + d_nodes8.size() * sizeof(QuantizedNode<uint8_t>)
+         + d_nodes16.size() * sizeof(QuantizedNode<uint16_t>);
+}
+
+void MeshBVH::write(ostream &out) const
+{
+    uint32_t header[5] = {
+        static_cast<uint32_t>(d_layout), d_root,
+        static_cast<uint32_t>(d_nodes.size()),
+        static_cast<uint32_t>(d_nodes8.size()),
+        static_cast<uint32_t>(d_nodes16.size())
+    };
+    out.write(reinterpret_cast<char const *>(header), sizeof(header));
+    out.write(reinterpret_cast<char const *>(d_lower.data), sizeof(d_lower.data));
+    out.write(reinterpret_cast<char const *>(d_upper.data), sizeof(d_upper.data));
+    out.write(reinterpret_cast<char const *>(d_nodes.data()),
+              d_nodes.size() * sizeof(Node));
+    out.write(reinterpret_cast<char const *>(d_nodes8.data()),
+              d_nodes8.size() * sizeof(QuantizedNode<uint8_t>));
+    out.write(reinterpret_cast<char const *>(d_nodes16.data()),
+              d_nodes16.size() * sizeof(QuantizedNode<uint16_t>));
+}
+
+void MeshBVH::read(istream &in)
+{
+    uint32_t header[5];
+    in.read(reinterpret_cast<char *>(header), sizeof(header));
+    d_layout = static_cast<Layout>(header[0]);
+    d_root = header[1];
+    d_nodes.resize(header[2]);
+    d_nodes8.resize(header[3]);
+    d_nodes16.resize(header[4]);
+
+    in.read(reinterpret_cast<char *>(d_lower.data), sizeof(d_lower.data));
+    in.read(reinterpret_cast<char *>(d_upper.data), sizeof(d_upper.data));
+    in.read(reinterpret_cast<char *>(d_nodes.data()),
+            d_nodes.size() * sizeof(Node));
+    in.read(reinterpret_cast<char *>(d_nodes8.data()),
+            d_nodes8.size() * sizeof(QuantizedNode<uint8_t>));
+    in.read(reinterpret_cast<char *>(d_nodes16.data()),
+            d_nodes16.size() * sizeof(QuantizedNode<uint16_t>));
+    if (!in)
+        throw runtime_error("Could not read a mesh BVH.");
+}
+
+unsigned MeshBVH::build(vector<Triangle> const &tris, vector<unsigned> &order,
+                        unsigned begin, unsigned end)
+{
+    unsigned idx = d_nodes.size();
+    d_nodes.push_back(Node());
+
+    // Bounds of the triangles and of their centroids
+    Node node;
+    node.lower = node.upper = tris[order[begin]].v0;
+    Point centerLower = (tris[order[begin]].v0 + tris[order[begin]].v1
+                         + tris[order[begin]].v2) / 3.0;
+    Point centerUpper = centerLower;
+    for (unsigned pos = begin; pos != end; ++pos)
+    {
+        Triangle const &tri = tris[order[pos]];
+        Point center = (tri.v0 + tri.v1 + tri.v2) / 3.0;
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            node.lower.data[axis] = min({node.lower.data[axis], tri.v0.data[axis],
+                                         tri.v1.data[axis], tri.v2.data[axis]});
+            node.upper.data[axis] = max({node.upper.data[axis], tri.v0.data[axis],
+                                         tri.v1.data[axis], tri.v2.data[axis]});
+            centerLower.data[axis] = min(centerLower.data[axis], center.data[axis]);
+            centerUpper.data[axis] = max(centerUpper.data[axis], center.data[axis]);
+        }
+    }
+
+    if (end - begin <= LEAF_SIZE)
+    {
+        node.offset = begin;
+        node.count = end - begin;
+    }
+    else
+    {
+        // Split the triangles at the median centroid of the longest axis
+        Vector extent = centerUpper - centerLower;
+        unsigned axis = 0;
+        if (extent.y > extent.data[axis])
+            axis = 1;
+        if (extent.z > extent.data[axis])
+            axis = 2;
+
+        unsigned mid = begin + (end - begin) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid,
+                    order.begin() + end,
+                    [&tris, axis](unsigned lhs, unsigned rhs)
+                    {
+                        return tris[lhs].v0.data[axis] + tris[lhs].v1.data[axis]
+                               + tris[lhs].v2.data[axis]
+                             < tris[rhs].v0.data[axis] + tris[rhs].v1.data[axis]
+                               + tris[rhs].v2.data[axis];
+                    });
+
+        build(tris, order, begin, mid);     // left child follows its parent
+        node.offset = build(tris, order, mid, end);
+        node.count = 0;
+    }
+
+    d_nodes[idx] = node;
+    return idx;
+}
+
+template <typename Q>
+uint32_t MeshBVH::quantize(vector<QuantizedNode<Q>> &nodes, unsigned full,
+                           Point const &lower, Point const &upper) const
+{
+    Node const &node = d_nodes[full];
+    if (node.count != 0)
+        return leafRef(node.offset, node.count);
+
+    unsigned idx = nodes.size();
+    nodes.push_back(QuantizedNode<Q>());
+
+    QuantizedNode<Q> quantized;
+    unsigned children[2] = {full + 1, node.offset};
+    Point childLower[2];
+    Point childUpper[2];
+    for (unsigned child = 0; child != 2; ++child)
+    {
+        Node const &childNode = d_nodes[children[child]];
+        encode(childNode.lower, childNode.upper, lower, upper,
+               quantized.lower[child], quantized.upper[child]);
+        decodeBox(quantized.lower[child], quantized.upper[child], lower, upper,
+                  childLower[child], childUpper[child]);
+    }
+
+    // Children are quantized relative to the decoded box, as traversal
+    // sees it
+    for (unsigned child = 0; child != 2; ++child)
+        quantized.child[child] = quantize(nodes, children[child],
+                                          childLower[child], childUpper[child]);
+
+    nodes[idx] = quantized;
+    return idx;
+}
+
+Hit MeshBVH::intersectFull(Ray const &ray, vector<Triangle> const &tris) const
+{
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+    Hit min_hit(numeric_limits<double>::infinity(), Vector());
+
+    struct Entry
+    {
+        unsigned node;
+        double tNear;
+    };
+
+    // Median splits keep the depth logarithmic, so this never overflows
+    Entry stack[64];
+    unsigned top = 0;
+    double tRoot = enter(d_lower, d_upper, ray, invD);
+    if (tRoot != numeric_limits<double>::infinity())
+        stack[top++] = Entry{0, tRoot};
+
+    while (top != 0)
+    {
+        Entry entry = stack[--top];
+        if (entry.tNear >= min_hit.t)
+            continue;
+
+        Node const &node = d_nodes[entry.node];
+        RenderStats::count(RenderStats::NODE_VISITS);
+        if (node.count != 0)
+        {
+            intersectLeaf(ray, tris, node.offset, node.count, min_hit);
+            continue;
+        }
+
+        // Push the children that are hit, the nearest one last
+        Entry children[2] = {
+            {entry.node + 1, enter(d_nodes[entry.node + 1].lower,
+                                   d_nodes[entry.node + 1].upper, ray, invD)},
+            {node.offset, enter(d_nodes[node.offset].lower,
+                                d_nodes[node.offset].upper, ray, invD)}
+        };
+        if (children[0].tNear < children[1].tNear)
+            swap(children[0], children[1]);
+        for (Entry const &child : children)
+            if (child.tNear < min_hit.t)
+                stack[top++] = child;
+    }
+
+    if (min_hit.t == numeric_limits<double>::infinity())
+        return Hit::NO_HIT();
+    return min_hit;
+}
+
+template <typename Q>
+Hit MeshBVH::intersectQuantized(Ray const &ray,
+                                vector<QuantizedNode<Q>> const &nodes,
+                                vector<Triangle> const &tris) const
+{
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+    Hit min_hit(numeric_limits<double>::infinity(), Vector());
+
+    // Boxes are decoded on the way down, so entries carry them
+    struct Entry
+    {
+        uint32_t ref;
+        double tNear;
+        Point lower;
+        Point upper;
+    };
+
+    Entry stack[64];
+    unsigned top = 0;
+    double tRoot = enter(d_lower, d_upper, ray, invD);
+    if (tRoot != numeric_limits<double>::infinity())
+        stack[top++] = Entry{d_root, tRoot, d_lower, d_upper};
+
+    while (top != 0)
+    {
+        Entry entry = stack[--top];
+        if (entry.tNear >= min_hit.t)
+            continue;
+
+        RenderStats::count(RenderStats::NODE_VISITS);
+        if (entry.ref & LEAF_BIT)
+        {
+            intersectLeaf(ray, tris, entry.ref & (MAX_FIRST - 1),
+                          (entry.ref >> 28) & 7, min_hit);
+            continue;
+        }
+
+        QuantizedNode<Q> const &node = nodes[entry.ref];
+        Entry children[2];
+        for (unsigned child = 0; child != 2; ++child)
+        {
+            children[child].ref = node.child[child];
+            decodeBox(node.lower[child], node.upper[child], entry.lower,
+                      entry.upper, children[child].lower, children[child].upper);
+            children[child].tNear = enter(children[child].lower,
+                                          children[child].upper, ray, invD);
+        }
+
+        if (children[0].tNear < children[1].tNear)
+            swap(children[0], children[1]);
+        for (Entry const &child : children)
+            if (child.tNear < min_hit.t)
+                stack[top++] = child;
+    }
+
+    if (min_hit.t == numeric_limits<double>::infinity())
+        return Hit::NO_HIT();
+    return min_hit;
+}
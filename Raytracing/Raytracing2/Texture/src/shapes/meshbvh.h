@@ -0,0 +1,101 @@
+#ifndef MESHBVH_H_
+#define MESHBVH_H_
+
+#include "triangle.h"
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Bounding volume hierarchy over the triangles of a mesh, split at the
+// median of the longest axis into leaves of at most LEAF_SIZE triangles.
+//
+// Nodes are stored in one of three layouts. FULL nodes hold their own
+// bounds in double precision. QUANTIZED8 and QUANTIZED16 nodes hold the
+// bounds of both children as 8 or 16 bit steps of their own box, rounded
+// outwards, and child references packed in 32 bits. Traversal decodes
+// the boxes on the way down, so only the root box is stored in full.
+class MeshBVH
+{
+    public:
+        enum Layout
+        {
+            FULL,
+            QUANTIZED8,
+            QUANTIZED16
+        };
+
+    private:
+        struct Node
+        {
+            Point lower;
+            Point upper;
+            std::uint32_t offset;   // second child, or first triangle of a leaf
+            std::uint32_t count;    // triangles of a leaf, 0 for inner nodes
+        };
+
+        template <typename Q>
+        struct QuantizedNode
+        {
+            Q lower[2][3];          // child boxes, in steps of this box
+            Q upper[2][3];
+            std::uint32_t child[2]; // node index or packed leaf, see leafRef
+        };
+
+        static unsigned const LEAF_SIZE = 4;
+
+        Layout d_layout;
+        Point d_lower;              // bounds of the whole mesh
+        Point d_upper;
+        std::uint32_t d_root;       // node index or packed leaf
+        std::vector<Node> d_nodes;  // FULL only, root first
+        std::vector<QuantizedNode<std::uint8_t>> d_nodes8;
+        std::vector<QuantizedNode<std::uint16_t>> d_nodes16;
+
+    public:
+        MeshBVH();
+
+        // Build over the triangles, which are reordered to match the leaves
+        MeshBVH(std::vector<Triangle> &tris, Layout layout);
+
+        // "full", "quantized8" or "quantized16", returns false otherwise
+        static bool parseLayout(std::string const &name, Layout &layout);
+
+        // closest hit of the ray with the triangles the tree was built over
+        Hit intersect(Ray const &ray, std::vector<Triangle> const &tris) const;
+
+        // box around all triangles
+        Point const &lower() const;
+        Point const &upper() const;
+
+        // memory taken by the nodes
+        std::size_t bytes() const;
+
+        // binary form, for trees stored next to their triangles
+        void write(std::ostream &out) const;
+        void read(std::istream &in);
+
+        // distance at which the ray enters the box, infinity if it misses
+        static double enter(Point const &lower, Point const &upper,
+                            Ray const &ray, Vector const &invD);
+
+    private:
+        unsigned build(std::vector<Triangle> const &tris,
+                       std::vector<unsigned> &order, unsigned begin,
+                       unsigned end);
+
+        template <typename Q>
+        std::uint32_t quantize(std::vector<QuantizedNode<Q>> &nodes,
+                               unsigned full, Point const &lower,
+                               Point const &upper) const;
+
+        Hit intersectFull(Ray const &ray, std::vector<Triangle> const &tris) const;
+
+        template <typename Q>
+        Hit intersectQuantized(Ray const &ray,
+                               std::vector<QuantizedNode<Q>> const &nodes,
+                               std::vector<Triangle> const &tris) const;
+};
+
+#endif
@@ -2,8 +2,12 @@
 #define QUAD_H_
 
 #include "../object.h"
+#include "../stats.h"
 
-class Quad: public Object
+#include <cmath>
+#include <limits>
+
+class Quad final: public Object
 {
     public:
         Quad(Point const &v0,
@@ -11,8 +15,9 @@ class Quad: public Object
              Point const &v2,
              Point const &v3);
 
-        Hit intersect(Ray const &ray) override;
-        Vector toUV(Point const &hit) override;
+        Hit intersect(Ray const &ray) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+        Vector toUV(Point const &hit) const override;
 
         Point const v0;
         Point const v1;
@@ -22,5 +27,36 @@ class Quad: public Object
         Vector const N;
 };
 
+/*  Method:
+ *  First find the intersection with the plane the quad is in,
+ *  then determine whether the point of intersection is within the quad.
+ */
+inline Hit Quad::intersect(Ray const &ray) const
+{
+    RenderStats::count(RenderStats::QUAD_TESTS);
+
+    // Catch the case where the ray is parallel to the plane, i.e. no intersection.
+    double DdotN = (-ray.D).dot(N);
+    if (std::abs(DdotN) < std::numeric_limits<double>::epsilon())
+        return Hit::NO_HIT();
+
+    // Find the point of intersection with the plane.
+    double t = -N.dot(ray.O - v0) / N.dot(ray.D);
+
+    if (t < 0.0)
+        return Hit::NO_HIT();
+
+    Point hit = ray.at(t);
+
+    // Determine if the hit is inside of the quad.
+    double u = (hit - v0).dot(v1 - v0);
+    double v = (hit - v0).dot(v3 - v0);
+    if (0.0 <= u and u <= (v1 - v0).length_2() and
+        0.0 <= v and v <= (v3 - v0).length_2())
+        return Hit(t, N);
+
+    return Hit::NO_HIT();
+}
+
 #endif
 
@@ -2,17 +2,20 @@
 #define SPHERE_H_
 
 #include "../object.h"
+#include "../stats.h"
+#include "solvers.h"
 
-class Sphere: public Object
+class Sphere final: public Object
 {
-    double const PI = 3.14159265358979323846;
+    static constexpr double PI = 3.14159265358979323846;
 
     public:
         Sphere(Point const &pos, double radius,
                Vector const& axis = Vector(0.0, 1.0, 0.0), double angle = 0.0);
 
-        Hit intersect(Ray const &ray) override;
-        Vector toUV(Point const &hit) override;
+        Hit intersect(Ray const &ray) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+        Vector toUV(Point const &hit) const override;
 
         Point const position;
         double const r;
@@ -20,4 +23,39 @@ class Sphere: public Object
         double const angle;
 };
 
+inline Hit Sphere::intersect(Ray const &ray) const
+{
+    RenderStats::count(RenderStats::SPHERE_TESTS);
+
+    // Sphere formula: ||x - position||^2 = r^2
+    // Line formula:   x = ray.O + t * ray.D
+
+    Vector L = ray.O - position;
+    double a = ray.D.dot(ray.D);
+    double b = 2.0 * ray.D.dot(L);
+    double c = L.dot(L) - r * r;
+
+    double t0;
+    double t1;
+    if (not Solvers::quadratic(a, b, c, t0, t1))
+        return Hit::NO_HIT();
+
+    // t0 is closest hit
+    if (t0 < 0.0)  // check if it is not behind the camera
+    {
+        t0 = t1;    // try t1
+        if (t0 < 0.0) // both behind the camera
+            return Hit::NO_HIT();
+    }
+
+    // calculate normal
+    Point hit = ray.at(t0);
+    Vector N = (hit - position).normalized();
+
+    // Note that the direction of the normal is not changed here,
+    // but in scene.cpp - if necessary.
+
+    return Hit(t0, N);
+}
+
 #endif
@@ -0,0 +1,295 @@
+#include "spherecloud.h"
+
+#include "../stats.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <stdexcept>
+
+using namespace std;
+
+SphereCloud::SphereCloud(vector<unsigned> const &materials)
+:
+    d_materials(materials),
+    d_count(0)
+{
+    if (d_materials.empty())
+        throw runtime_error("A sphere cloud needs at least one material.");
+    material = d_materials.front();
+}
+
+void SphereCloud::add(Point const &center, double radius, unsigned material)
+{
+    if (material >= d_materials.size())
+        throw runtime_error("Sphere material index " + to_string(material)
+                            + " is out of range.");
+
+    d_centers.push_back(center);
+    d_radii.push_back(radius);
+    d_indices.push_back(d_materials[material]);
+    ++d_count;
+}
+
+void SphereCloud::read(string const &filename, string const &layout,
+                       double radius, ostream &log)
+{
+    if (layout.find_first_not_of("xyzrm") != string::npos
+        or layout.find('x') == string::npos
+        or layout.find('y') == string::npos
+        or layout.find('z') == string::npos)
+        throw runtime_error("Invalid sphere layout \"" + layout + "\".");
+
+    ifstream infile(filename, ios::binary);
+    if (!infile)
+        throw runtime_error("Could not open " + filename + " for reading.");
+
+    vector<char> record(4 * layout.size());
+    unsigned count = 0;
+    while (infile.read(record.data(), record.size()))
+    {
+        double field[4] = {0.0, 0.0, 0.0, radius};   // x, y, z, r
+        unsigned material = 0;
+        for (unsigned idx = 0; idx != layout.size(); ++idx)
+        {
+            char const *bytes = &record[4 * idx];
+            if (layout[idx] == 'm')
+            {
+                uint32_t value;
+                memcpy(&value, bytes, sizeof(value));
+                material = value;
+            }
+            else
+            {
+                float value;
+                memcpy(&value, bytes, sizeof(value));
+                field[string("xyzr").find(layout[idx])] = value;
+            }
+        }
+        add(Point(field[0], field[1], field[2]), field[3], material);
+        ++count;
+    }
+
+    if (infile.gcount() != 0)
+        throw runtime_error(filename + " does not hold whole records of layout \""
+                            + layout + "\".");
+
+    log << "Loaded " << count << " spheres from " << filename << ".\n";
+}
+
+void SphereCloud::build()
+{
+    if (d_centers.empty())
+        return;
+
+    vector<unsigned> order(d_centers.size());
+    iota(order.begin(), order.end(), 0);
+
+    size_t leaves = (d_centers.size() + LEAF_SIZE - 1) / LEAF_SIZE;
+    d_nodes.reserve(4 * leaves);
+    d_x.reserve(2 * leaves * LEAF_SIZE);
+    d_y.reserve(2 * leaves * LEAF_SIZE);
+    d_z.reserve(2 * leaves * LEAF_SIZE);
+    d_r.reserve(2 * leaves * LEAF_SIZE);
+    d_material.reserve(2 * leaves * LEAF_SIZE);
+    build(order, 0, order.size());
+
+    // Only the sorted copies are used from now on
+    vector<Point>().swap(d_centers);
+    vector<double>().swap(d_radii);
+    vector<unsigned>().swap(d_indices);
+}
+
+Hit SphereCloud::intersect(Ray const &ray) const
+{
+    if (d_nodes.empty())
+        return Hit::NO_HIT();
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+    double a = ray.D.dot(ray.D);
+
+    double best = numeric_limits<double>::infinity();
+    unsigned hitSphere = 0;
+
+    // Median splits keep the depth logarithmic, so this never overflows
+    unsigned stack[64];
+    unsigned top = 0;
+    stack[top++] = 0;
+
+    while (top != 0)
+    {
+        Node const &node = d_nodes[stack[--top]];
+        RenderStats::count(RenderStats::NODE_VISITS);
+        if (enter(node, ray, invD) >= best)
+            continue;
+
+        if (node.right != LEAF)
+        {
+            // Push the far child first, so the near one is tested first
+            if (ray.D.data[node.axis] < 0.0)
+            {
+                stack[top++] = node.left;
+                stack[top++] = node.right;
+            }
+            else
+            {
+                stack[top++] = node.right;
+                stack[top++] = node.left;
+            }
+            continue;
+        }
+
+        // Test the whole block, as in Solvers::quadratic and
+        // Sphere::intersect: the nearest root in front of the origin
+        RenderStats::count(RenderStats::SPHERE_TESTS, LEAF_SIZE);
+
+        double const *x = &d_x[node.left];
+        double const *y = &d_y[node.left];
+        double const *z = &d_z[node.left];
+        double const *r = &d_r[node.left];
+        double t[LEAF_SIZE];
+        for (unsigned lane = 0; lane != LEAF_SIZE; ++lane)
+        {
+            double Lx = ray.O.x - x[lane];
+            double Ly = ray.O.y - y[lane];
+            double Lz = ray.O.z - z[lane];
+            double b = 2.0 * (ray.D.x * Lx + ray.D.y * Ly + ray.D.z * Lz);
+            double c = Lx * Lx + Ly * Ly + Lz * Lz - r[lane] * r[lane];
+            double discr = b * b - 4.0 * a * c;
+
+            double q = -0.5 * (b + copysign(sqrt(max(discr, 0.0)), b));
+            double x0 = min(q / a, c / q);
+            double x1 = max(q / a, c / q);
+            double root = x0 >= 0.0 ? x0 : x1;
+
+            // false for the NaN radius padding as well
+            t[lane] = discr >= 0.0 and root >= 0.0
+                      ? root : numeric_limits<double>::infinity();
+        }
+
+        for (unsigned lane = 0; lane != LEAF_SIZE; ++lane)
+            if (t[lane] < best)
+            {
+                best = t[lane];
+                hitSphere = node.left + lane;
+            }
+    }
+
+    if (best == numeric_limits<double>::infinity())
+        return Hit::NO_HIT();
+
+    Point center(d_x[hitSphere], d_y[hitSphere], d_z[hitSphere]);
+    Vector N = (ray.at(best) - center).normalized();
+    return Hit(best, N, hitSphere);
+}
+
+unsigned SphereCloud::materialAt(Hit const &hit) const
+{
+    return d_material[hit.part];
+}
+
+bool SphereCloud::bounds(Point &lower, Point &upper) const
+{
+    if (d_nodes.empty())
+        return false;
+
+    lower = d_nodes[0].lower;
+    upper = d_nodes[0].upper;
+    return true;
+}
+
+vector<unsigned> const &SphereCloud::materials() const
+{
+    return d_materials;
+}
+
+unsigned SphereCloud::numSpheres() const
+{
+    return d_count;
+}
+
+unsigned SphereCloud::build(vector<unsigned> &order, unsigned begin,
+                            unsigned end)
+{
+    unsigned idx = d_nodes.size();
+    d_nodes.push_back(Node());
+
+    Node node;
+    node.lower = node.upper = d_centers[order[begin]];
+    for (unsigned pos = begin; pos != end; ++pos)
+    {
+        Point const &center = d_centers[order[pos]];
+        double radius = d_radii[order[pos]];
+        for (unsigned axis = 0; axis != 3; ++axis)
+        {
+            node.lower.data[axis] = min(node.lower.data[axis], center.data[axis] - radius);
+            node.upper.data[axis] = max(node.upper.data[axis], center.data[axis] + radius);
+        }
+    }
+
+    // Split at the median of the longest axis
+    Vector extent = node.upper - node.lower;
+    node.axis = 0;
+    if (extent.y > extent.data[node.axis])
+        node.axis = 1;
+    if (extent.z > extent.data[node.axis])
+        node.axis = 2;
+
+    if (end - begin <= LEAF_SIZE)
+    {
+        node.left = d_x.size();
+        node.right = LEAF;
+        for (unsigned lane = 0; lane != LEAF_SIZE; ++lane)
+        {
+            bool used = begin + lane < end;
+            unsigned sphere = used ? order[begin + lane] : order[begin];
+            d_x.push_back(d_centers[sphere].x);
+            d_y.push_back(d_centers[sphere].y);
+            d_z.push_back(d_centers[sphere].z);
+            d_r.push_back(used ? d_radii[sphere]
+                               : numeric_limits<double>::quiet_NaN());
+            d_material.push_back(d_indices[sphere]);
+        }
+    }
+    else
+    {
+        unsigned axis = node.axis;
+        unsigned mid = begin + (end - begin) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid,
+                    order.begin() + end,
+                    [this, axis](unsigned lhs, unsigned rhs)
+                    {
+                        return d_centers[lhs].data[axis]
+                               < d_centers[rhs].data[axis];
+                    });
+
+        node.left = build(order, begin, mid);
+        node.right = build(order, mid, end);
+    }
+
+    d_nodes[idx] = node;
+    return idx;
+}
+
+double SphereCloud::enter(Node const &node, Ray const &ray,
+                          Vector const &invD) const
+{
+    double tNear = 0.0;
+    double tFar = numeric_limits<double>::infinity();
+    for (unsigned axis = 0; axis != 3; ++axis)
+    {
+        double t0 = (node.lower.data[axis] - ray.O.data[axis]) * invD.data[axis];
+        double t1 = (node.upper.data[axis] - ray.O.data[axis]) * invD.data[axis];
+        if (t0 > t1)
+            swap(t0, t1);
+        tNear = max(tNear, t0);
+        tFar = min(tFar, t1);
+    }
+
+    return tNear <= tFar ? tNear : numeric_limits<double>::infinity();
+}
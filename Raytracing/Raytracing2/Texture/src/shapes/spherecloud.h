@@ -0,0 +1,82 @@
+#ifndef SPHERECLOUD_H_
+#define SPHERECLOUD_H_
+
+#include "../object.h"
+
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+// Many spheres as one object, for particle data. Centers and radii are
+// kept as structure of arrays, sorted into the leaves of a bounding volume
+// hierarchy. Every leaf is a block of LEAF_SIZE spheres that is tested in
+// one loop without branches, so the compiler can vectorize it. Spheres
+// pick one of the materials of the cloud; textures are not mapped.
+class SphereCloud: public Object
+{
+    struct Node
+    {
+        Point lower;            // bounds of the spheres
+        Point upper;
+        unsigned left;          // first child, or first sphere of a leaf
+        unsigned right;         // second child, LEAF for a leaf
+        unsigned axis;          // split axis, children are ordered along it
+    };
+
+    static unsigned const LEAF = ~0u;
+    static unsigned const LEAF_SIZE = 8;
+
+    std::vector<unsigned> d_materials;  // indices in the material table
+    unsigned d_count;
+
+    // Spheres as added, until build() moves them into d_x ... d_material
+    std::vector<Point> d_centers;
+    std::vector<double> d_radii;
+    std::vector<unsigned> d_indices;    // material table indices
+
+    // Leaf blocks, padded with NaN radius spheres that are never hit
+    std::vector<double> d_x;
+    std::vector<double> d_y;
+    std::vector<double> d_z;
+    std::vector<double> d_r;
+    std::vector<unsigned> d_material;
+
+    std::vector<Node> d_nodes;  // root first
+
+    public:
+        explicit SphereCloud(std::vector<unsigned> const &materials);
+
+        // material is an index in the materials of the cloud
+        void add(Point const &center, double radius, unsigned material = 0);
+
+        // Add the spheres of a binary file of records of 32 bit fields in
+        // native byte order. layout names the fields of a record in order:
+        // x, y and z are float coordinates and must all be present, r is a
+        // float radius and m an unsigned material index. Without r every
+        // sphere gets the given radius, without m material 0. The number
+        // read is reported on log.
+        void read(std::string const &filename, std::string const &layout,
+                  double radius, std::ostream &log);
+
+        // Build the hierarchy, call this once after adding all spheres
+        void build();
+
+        Hit intersect(Ray const &ray) const override;
+        unsigned materialAt(Hit const &hit) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+
+        // indices in the material table of the materials of the cloud
+        std::vector<unsigned> const &materials() const;
+
+        unsigned numSpheres() const;
+
+    private:
+        unsigned build(std::vector<unsigned> &order, unsigned begin,
+                       unsigned end);
+
+        // distance at which the ray enters the node, infinity if it misses
+        double enter(Node const &node, Ray const &ray,
+                     Vector const &invD) const;
+};
+
+#endif
@@ -0,0 +1,559 @@
+#include "streamedmesh.h"
+
+#include "mesh.h"
+#include "../stats.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[4] = {'M', 'C', 'L', 'U'};
+
+    // Clusters come first, the nodes and cluster extents follow them at
+    // the directory offset
+    struct Header
+    {
+        char magic[4];
+        uint32_t numNodes;
+        uint32_t numClusters;
+        uint32_t unused;
+        uint64_t key;
+        uint64_t directory;
+    };
+
+    // Centroids of an oversized part are binned to find its median
+    size_t const BINS = 4096;
+
+    // A binned cut can leave few triangles on one side, so it is only
+    // used this deep into the tree
+    unsigned const BINNED_LEVELS = 16;
+
+    // Calls visit with the 9 coordinates of every triangle of a part file
+    template <typename Visit>
+    void forEachTriangle(string const &filename, Visit visit)
+    {
+        ifstream infile(filename, ios::binary);
+        if (!infile)
+            throw runtime_error("Could not open " + filename + " for reading.");
+
+        vector<double> block(9 * 4096);
+        while (infile.read(reinterpret_cast<char *>(block.data()),
+                           block.size() * sizeof(double))
+               or infile.gcount() != 0)
+        {
+            size_t count = infile.gcount() / (9 * sizeof(double));
+            for (size_t tri = 0; tri != count; ++tri)
+                visit(&block[9 * tri]);
+        }
+    }
+}
+
+StreamedMesh::StreamedMesh(string const &clusterFile, uint64_t key,
+                           string const &objFile, Point const &position,
+                           Vector const &rotation, Vector const &scale,
+                           unsigned clusterTriangles, size_t memoryLimit,
+                           MeshBVH::Layout layout, ostream &log)
+:
+    d_filename(clusterFile),
+    d_memoryLimit(memoryLimit),
+    d_cachedBytes(0)
+{
+    if (open(key))
+    {
+        log << "Opened " << clusterFile << " with " << d_clusters.size()
+            << " clusters.\n";
+        return;
+    }
+
+    size_t count = write(key, objFile, position, rotation, scale,
+                         clusterTriangles, layout);
+    log << "Split " << objFile << " with " << count << " triangles into "
+        << d_clusters.size() << " clusters in " << clusterFile << ".\n";
+}
+
+Hit StreamedMesh::intersect(Ray const &ray) const
+{
+    RenderStats::count(RenderStats::MESH_TESTS);
+
+    Hit min_hit(numeric_limits<double>::infinity(), Vector());
+    if (d_nodes.empty())
+        return Hit::NO_HIT();
+
+    Vector invD(1.0 / ray.D.x, 1.0 / ray.D.y, 1.0 / ray.D.z);
+
+    struct Entry
+    {
+        unsigned node;
+        double tNear;
+    };
+
+    // At most BINNED_LEVELS levels are cut by bins and every level below
+    // them halves the triangles, so a mesh of fewer than 2^48 triangles is
+    // at most 64 levels deep. The stack never holds more entries than that.
+    Entry stack[64];
+    unsigned top = 0;
+    double tRoot = MeshBVH::enter(d_nodes[0].lower, d_nodes[0].upper, ray, invD);
+    if (tRoot != numeric_limits<double>::infinity())
+        stack[top++] = Entry{0, tRoot};
+
+    while (top != 0)
+    {
+        Entry entry = stack[--top];
+        if (entry.tNear >= min_hit.t)
+            continue;
+
+        Node const &node = d_nodes[entry.node];
+        RenderStats::count(RenderStats::NODE_VISITS);
+        if (node.leaf)
+        {
+            // Keeps the cluster alive, even if it is evicted meanwhile
+            ClusterPtr cluster = fetch(node.offset);
+            Hit hit(cluster->bvh.intersect(ray, cluster->tris));
+            if (hit.t < min_hit.t)
+                min_hit = hit;
+            continue;
+        }
+
+        // Push the children that are hit, the nearest one last
+        Node const &left = d_nodes[entry.node + 1];
+        Node const &right = d_nodes[node.offset];
+        Entry children[2] = {
+            {entry.node + 1, MeshBVH::enter(left.lower, left.upper, ray, invD)},
+            {node.offset, MeshBVH::enter(right.lower, right.upper, ray, invD)}
+        };
+        if (children[0].tNear < children[1].tNear)
+            swap(children[0], children[1]);
+        for (Entry const &child : children)
+            if (child.tNear < min_hit.t)
+                stack[top++] = child;
+    }
+
+    if (min_hit.t == numeric_limits<double>::infinity())
+        return Hit::NO_HIT();
+    return min_hit;
+}
+
+bool StreamedMesh::bounds(Point &lower, Point &upper) const
+{
+    if (d_nodes.empty())
+        return false;
+
+    lower = d_nodes[0].lower;
+    upper = d_nodes[0].upper;
+    return true;
+}
+
+unsigned StreamedMesh::numClusters() const
+{
+    return d_clusters.size();
+}
+
+bool StreamedMesh::open(uint64_t key)
+{
+    ifstream infile(d_filename, ios::binary);
+    if (!infile)
+        return false;
+
+    Header header;
+    if (!infile.read(reinterpret_cast<char *>(&header), sizeof(header))
+        or memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0
+        or header.key != key)
+        return false;
+
+    vector<Node> nodes(header.numNodes);
+    vector<Extent> clusters(header.numClusters);
+    infile.seekg(header.directory);
+    infile.read(reinterpret_cast<char *>(nodes.data()), nodes.size() * sizeof(Node));
+    infile.read(reinterpret_cast<char *>(clusters.data()),
+                clusters.size() * sizeof(Extent));
+    if (!infile)
+        return false;
+
+    d_nodes.swap(nodes);
+    d_clusters.swap(clusters);
+    return true;
+}
+
+StreamedMesh::ClusterPtr StreamedMesh::fetch(unsigned cluster) const
+{
+    {
+        lock_guard<mutex> lock(d_mutex);
+        auto found = d_cache.find(cluster);
+        if (found != d_cache.end())
+        {
+            RenderStats::count(RenderStats::CLUSTER_HITS);
+            d_recent.splice(d_recent.begin(), d_recent, found->second.recent);
+            return found->second.cluster;
+        }
+    }
+
+    // Read without holding the lock, so other threads can go on tracing
+    RenderStats::count(RenderStats::CLUSTER_MISSES);
+    ClusterPtr loaded = read(cluster);
+
+    lock_guard<mutex> lock(d_mutex);
+    auto found = d_cache.find(cluster);
+    if (found != d_cache.end())         // read by another thread meanwhile
+        return found->second.cluster;
+
+    d_recent.push_front(cluster);
+    d_cache[cluster] = CacheEntry{loaded, d_recent.begin()};
+    d_cachedBytes += d_clusters[cluster].bytes;
+
+    // Evict the least recently used clusters, but never the new one
+    while (d_cachedBytes > d_memoryLimit and d_recent.size() > 1)
+    {
+        unsigned victim = d_recent.back();
+        d_recent.pop_back();
+        d_cache.erase(victim);
+        d_cachedBytes -= d_clusters[victim].bytes;
+    }
+
+    return loaded;
+}
+
+StreamedMesh::ClusterPtr StreamedMesh::read(unsigned cluster) const
+{
+    unique_ptr<ifstream> file;
+    {
+        lock_guard<mutex> lock(d_mutex);
+        if (!d_files.empty())
+        {
+            file = move(d_files.back());
+            d_files.pop_back();
+        }
+    }
+    if (!file)
+        file.reset(new ifstream(d_filename, ios::binary));
+
+    ifstream &infile = *file;
+    infile.seekg(d_clusters[cluster].offset);
+
+    uint32_t count = 0;
+    infile.read(reinterpret_cast<char *>(&count), sizeof(count));
+    vector<double> corners(9 * static_cast<size_t>(count));
+    infile.read(reinterpret_cast<char *>(corners.data()),
+                corners.size() * sizeof(double));
+
+    auto result = make_shared<Cluster>();
+    result->tris.reserve(count);
+    for (size_t tri = 0; tri != count; ++tri)
+    {
+        double const *v = &corners[9 * tri];
+        result->tris.emplace_back(Point(v[0], v[1], v[2]),
+                                  Point(v[3], v[4], v[5]),
+                                  Point(v[6], v[7], v[8]));
+    }
+    result->bvh.read(infile);
+
+    if (!infile)
+        throw runtime_error("Could not read cluster " + to_string(cluster)
+                            + " of " + d_filename + ".");
+
+    lock_guard<mutex> lock(d_mutex);
+    d_files.push_back(move(file));
+    return result;
+}
+
+size_t StreamedMesh::write(uint64_t key, string const &objFile,
+                           Point const &position, Vector const &rotation,
+                           Vector const &scale, unsigned clusterTriangles,
+                           MeshBVH::Layout layout)
+{
+    ofstream outfile(d_filename, ios::binary);
+    if (!outfile)
+        throw runtime_error("Could not open " + d_filename + " for writing.");
+
+    // The header is written again once the directory offset is known
+    Header header{};
+    outfile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+
+    d_nodes.clear();
+    d_clusters.clear();
+    Part model = readModel(objFile, position, rotation, scale);
+    if (model.count != 0)
+        splitPart(model, max(clusterTriangles, 1u), layout, outfile);
+    else
+        remove(model.filename.c_str());
+
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.numNodes = d_nodes.size();
+    header.numClusters = d_clusters.size();
+    header.key = key;
+    header.directory = outfile.tellp();
+
+    outfile.write(reinterpret_cast<char const *>(d_nodes.data()),
+                  d_nodes.size() * sizeof(Node));
+    outfile.write(reinterpret_cast<char const *>(d_clusters.data()),
+                  d_clusters.size() * sizeof(Extent));
+    outfile.seekp(0);
+    outfile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+
+    if (!outfile)
+        throw runtime_error("Could not write " + d_filename + ".");
+    return model.count;
+}
+
+StreamedMesh::Part StreamedMesh::readModel(string const &objFile,
+                                           Point const &position,
+                                           Vector const &rotation,
+                                           Vector const &scale) const
+{
+    ifstream infile(objFile);
+    if (!infile)
+        throw runtime_error("Could not open " + objFile + " for reading.");
+
+    Part part;
+    part.filename = d_filename + ".part";
+    ofstream outfile(part.filename, ios::binary);
+
+    // Faces may use any vertex read before them, so the vertices are kept,
+    // placed as Mesh::load does. Normals and texture coordinates are not.
+    vector<Point> vertices;
+    string line;
+    while (getline(infile, line))
+    {
+        istringstream tokens(line);
+        string type;
+        tokens >> type;
+        if (type == "v")
+        {
+            float x, y, z;
+            tokens >> x >> y >> z;
+            vertices.push_back(Mesh::place(Point(x, y, z), position, rotation,
+                                           scale));
+        }
+        else if (type == "f")
+        {
+            // Corners are v, v/vt, v//vn or v/vt/vn, counting from 1 or,
+            // if negative, back from the last vertex. Polygons are fans.
+            vector<Point const *> corners;
+            string corner;
+            while (tokens >> corner)
+            {
+                long idx = stol(corner);
+                corners.push_back(&vertices.at(idx < 0 ? vertices.size() + idx
+                                                       : idx - 1));
+            }
+
+            for (size_t last = 2; last < corners.size(); ++last)
+            {
+                Point const *fan[3] = {corners[0], corners[last - 1],
+                                       corners[last]};
+                double tri[9];
+                for (unsigned idx = 0; idx != 3; ++idx)
+                    copy(fan[idx]->data, fan[idx]->data + 3, tri + 3 * idx);
+                outfile.write(reinterpret_cast<char const *>(tri), sizeof(tri));
+                part.add(tri);
+            }
+        }
+    }
+
+    if (!outfile)
+        throw runtime_error("Could not write " + part.filename + ".");
+    return part;
+}
+
+unsigned StreamedMesh::splitPart(Part const &part, unsigned clusterTriangles,
+                                 MeshBVH::Layout layout, ostream &out,
+                                 unsigned depth)
+{
+    // A part that fits is split in memory, as a whole model used to be
+    if (part.count <= max<size_t>(d_memoryLimit / sizeof(Triangle),
+                                  clusterTriangles))
+    {
+        vector<Triangle> tris;
+        tris.reserve(part.count);
+        forEachTriangle(part.filename, [&tris](double const *v)
+        {
+            tris.emplace_back(Point(v[0], v[1], v[2]), Point(v[3], v[4], v[5]),
+                              Point(v[6], v[7], v[8]));
+        });
+        remove(part.filename.c_str());
+
+        vector<unsigned> order(tris.size());
+        iota(order.begin(), order.end(), 0);
+        return split(tris, order, 0, order.size(), clusterTriangles, layout, out);
+    }
+
+    unsigned idx = d_nodes.size();
+    d_nodes.push_back(Node());
+
+    // Cut the longest axis, as split does, at the bin of the centroids
+    // holding the median. If they all fall in one bin, or the part is too
+    // deep for another uneven cut, halve the file.
+    Vector extent = part.upper - part.lower;
+    unsigned axis = 0;
+    if (extent.y > extent.data[axis])
+        axis = 1;
+    if (extent.z > extent.data[axis])
+        axis = 2;
+
+    double low = part.sumLower.data[axis];
+    double range = part.sumUpper.data[axis] - low;
+    auto binOf = [=](double const *v)
+    {
+        double sum = v[axis] + v[3 + axis] + v[6 + axis];
+        return min(BINS - 1, static_cast<size_t>((sum - low) / range * BINS));
+    };
+
+    size_t cut = BINS;                  // bins below go left
+    if (range > 0.0 and depth < BINNED_LEVELS)
+    {
+        vector<size_t> histogram(BINS);
+        forEachTriangle(part.filename, [&](double const *v)
+        {
+            ++histogram[binOf(v)];
+        });
+
+        size_t below = 0;
+        for (size_t bin = 0; bin != BINS; ++bin)
+        {
+            below += histogram[bin];
+            if (below >= part.count / 2)
+            {
+                if (below < part.count)
+                    cut = bin + 1;
+                break;
+            }
+        }
+    }
+
+    Part left;
+    Part right;
+    left.filename = part.filename + 'l';
+    right.filename = part.filename + 'r';
+    {
+        ofstream leftFile(left.filename, ios::binary);
+        ofstream rightFile(right.filename, ios::binary);
+        size_t seen = 0;
+        forEachTriangle(part.filename, [&](double const *v)
+        {
+            bool toLeft = cut == BINS ? seen++ < part.count / 2 : binOf(v) < cut;
+            (toLeft ? leftFile : rightFile).write(
+                reinterpret_cast<char const *>(v), 9 * sizeof(double));
+            (toLeft ? left : right).add(v);
+        });
+        if (!leftFile or !rightFile)
+            throw runtime_error("Could not write the parts of " + d_filename + ".");
+    }
+    remove(part.filename.c_str());
+
+    Node node;
+    node.lower = part.lower;
+    node.upper = part.upper;
+    splitPart(left, clusterTriangles, layout, out, depth + 1);
+    node.offset = splitPart(right, clusterTriangles, layout, out, depth + 1);
+    node.leaf = 0;
+
+    d_nodes[idx] = node;
+    return idx;
+}
+
+void StreamedMesh::Part::add(double const *corners)
+{
+    Point corner(corners[0], corners[1], corners[2]);
+    Point sum(corners[0] + corners[3] + corners[6],
+              corners[1] + corners[4] + corners[7],
+              corners[2] + corners[5] + corners[8]);
+    if (count++ == 0)
+    {
+        lower = upper = corner;
+        sumLower = sumUpper = sum;
+    }
+
+    for (unsigned axis = 0; axis != 3; ++axis)
+    {
+        for (unsigned idx = 0; idx != 3; ++idx)
+        {
+            lower.data[axis] = min(lower.data[axis], corners[3 * idx + axis]);
+            upper.data[axis] = max(upper.data[axis], corners[3 * idx + axis]);
+        }
+        sumLower.data[axis] = min(sumLower.data[axis], sum.data[axis]);
+        sumUpper.data[axis] = max(sumUpper.data[axis], sum.data[axis]);
+    }
+}
+
+unsigned StreamedMesh::split(vector<Triangle> const &tris,
+                             vector<unsigned> &order, unsigned begin,
+                             unsigned end, unsigned clusterTriangles,
+                             MeshBVH::Layout layout, ostream &out)
+{
+    unsigned idx = d_nodes.size();
+    d_nodes.push_back(Node());
+
+    Node node;
+    node.lower = node.upper = tris[order[begin]].v0;
+    for (unsigned pos = begin; pos != end; ++pos)
+        for (Point const &corner : {tris[order[pos]].v0, tris[order[pos]].v1,
+                                    tris[order[pos]].v2})
+            for (unsigned axis = 0; axis != 3; ++axis)
+            {
+                node.lower.data[axis] = min(node.lower.data[axis], corner.data[axis]);
+                node.upper.data[axis] = max(node.upper.data[axis], corner.data[axis]);
+            }
+
+    if (end - begin <= clusterTriangles)
+    {
+        vector<Triangle> clusterTris;
+        clusterTris.reserve(end - begin);
+        for (unsigned pos = begin; pos != end; ++pos)
+            clusterTris.push_back(tris[order[pos]]);
+        MeshBVH bvh(clusterTris, layout);
+
+        uint32_t count = clusterTris.size();
+        vector<double> corners;
+        corners.reserve(9 * clusterTris.size());
+        for (Triangle const &tri : clusterTris)
+            for (Point const &corner : {tri.v0, tri.v1, tri.v2})
+                corners.insert(corners.end(), corner.data, corner.data + 3);
+
+        node.offset = d_clusters.size();
+        node.leaf = 1;
+        d_clusters.push_back(Extent{static_cast<uint64_t>(out.tellp()),
+                                    count * sizeof(Triangle) + bvh.bytes()});
+
+        out.write(reinterpret_cast<char const *>(&count), sizeof(count));
+        out.write(reinterpret_cast<char const *>(corners.data()),
+                  corners.size() * sizeof(double));
+        bvh.write(out);
+    }
+    else
+    {
+        // Split at the median centroid of the longest axis
+        Vector extent = node.upper - node.lower;
+        unsigned axis = 0;
+        if (extent.y > extent.data[axis])
+            axis = 1;
+        if (extent.z > extent.data[axis])
+            axis = 2;
+
+        unsigned mid = begin + (end - begin) / 2;
+        nth_element(order.begin() + begin, order.begin() + mid,
+                    order.begin() + end,
+                    [&tris, axis](unsigned lhs, unsigned rhs)
+                    {
+                        return tris[lhs].v0.data[axis] + tris[lhs].v1.data[axis]
+                               + tris[lhs].v2.data[axis]
+                             < tris[rhs].v0.data[axis] + tris[rhs].v1.data[axis]
+                               + tris[rhs].v2.data[axis];
+                    });
+
+        split(tris, order, begin, mid, clusterTriangles, layout, out);
+        node.offset = split(tris, order, mid, end, clusterTriangles, layout, out);
+        node.leaf = 0;
+    }
+
+    d_nodes[idx] = node;
+    return idx;
+}
@@ -0,0 +1,134 @@
+#ifndef STREAMEDMESH_H_
+#define STREAMEDMESH_H_
+
+#include "../object.h"
+#include "meshbvh.h"
+#include "triangle.h"
+
+#include <cstdint>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// A mesh that stays on disk. Its triangles are split into spatial clusters,
+// which are stored in a cluster file together with a BVH for each. Only a
+// tree over the cluster bounds is kept in memory. Clusters are read when a
+// ray reaches them, into a least recently used cache of at most memoryLimit
+// bytes. Clusters in use by a ray are only freed after it is done with them.
+//
+// Writing the cluster file streams the OBJ model once, keeping only its
+// vertex positions. The triangles go to part files next to the cluster
+// file, which are halved on disk until a part fits in memoryLimit; such a
+// part is split further in memory.
+class StreamedMesh: public Object
+{
+    struct Cluster
+    {
+        std::vector<Triangle> tris;
+        MeshBVH bvh;
+    };
+
+    typedef std::shared_ptr<Cluster const> ClusterPtr;
+
+    struct Node
+    {
+        Point lower;            // bounds of the triangles
+        Point upper;
+        std::uint32_t offset;   // second child, or cluster of a leaf
+        std::uint32_t leaf;     // 1 for a leaf, 0 for inner nodes
+    };
+
+    struct Extent
+    {
+        std::uint64_t offset;   // of the cluster in the file
+        std::uint64_t bytes;    // taken once read into memory
+    };
+
+    struct CacheEntry
+    {
+        ClusterPtr cluster;
+        std::list<unsigned>::iterator recent;
+    };
+
+    // Triangles written to a part file while splitting, 9 doubles each
+    struct Part
+    {
+        std::string filename;
+        std::size_t count = 0;
+        Point lower;            // bounds of the corners
+        Point upper;
+        Point sumLower;         // bounds of the corner sums, 3 x centroid
+        Point sumUpper;
+
+        void add(double const *corners);
+    };
+
+    std::string d_filename;
+    std::vector<Node> d_nodes;          // root first
+    std::vector<Extent> d_clusters;
+    std::size_t d_memoryLimit;
+
+    mutable std::mutex d_mutex;         // guards the cache and d_files
+    mutable std::list<unsigned> d_recent;   // most recently used first
+    mutable std::unordered_map<unsigned, CacheEntry> d_cache;
+    mutable std::size_t d_cachedBytes;
+
+    // Idle handles on the cluster file. A reading thread takes one, or
+    // opens one if there is none, and puts it back, so there are never
+    // more than threads reading at once.
+    mutable std::vector<std::unique_ptr<std::ifstream>> d_files;
+
+    public:
+        // Open the cluster file. If it is missing or was written for
+        // another key, it is first written from the OBJ model. Which of the
+        // two is reported on log.
+        StreamedMesh(std::string const &clusterFile, std::uint64_t key,
+                     std::string const &objFile, Point const &position,
+                     Vector const &rotation, Vector const &scale,
+                     unsigned clusterTriangles, std::size_t memoryLimit,
+                     MeshBVH::Layout layout, std::ostream &log);
+
+        Hit intersect(Ray const &ray) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+
+        unsigned numClusters() const;
+
+    private:
+        bool open(std::uint64_t key);
+
+        // cluster from the cache, reading it on a miss
+        ClusterPtr fetch(unsigned cluster) const;
+        ClusterPtr read(unsigned cluster) const;
+
+        // Write the cluster file and set up the nodes and clusters.
+        // Returns the number of triangles.
+        std::size_t write(std::uint64_t key, std::string const &objFile,
+                          Point const &position, Vector const &rotation,
+                          Vector const &scale, unsigned clusterTriangles,
+                          MeshBVH::Layout layout);
+
+        // The triangles of the OBJ model, placed, as the part file
+        Part readModel(std::string const &objFile, Point const &position,
+                       Vector const &rotation, Vector const &scale) const;
+
+        // Split the part at about its median centroid into parts on disk
+        // until it fits in memory, then as split does. Below depth
+        // BINNED_LEVELS parts are halved by count instead. Removes the part
+        // file and returns the node.
+        unsigned splitPart(Part const &part, unsigned clusterTriangles,
+                           MeshBVH::Layout layout, std::ostream &out,
+                           unsigned depth = 0);
+
+        // Split the triangles [begin, end) at the median, writing every
+        // part of at most clusterTriangles as a cluster. Returns the node.
+        unsigned split(std::vector<Triangle> const &tris,
+                       std::vector<unsigned> &order, unsigned begin,
+                       unsigned end, unsigned clusterTriangles,
+                       MeshBVH::Layout layout, std::ostream &out);
+};
+
+#endif
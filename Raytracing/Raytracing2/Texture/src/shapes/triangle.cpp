@@ -0,0 +1,23 @@
+#include "triangle.h"
+
+#include <algorithm>
+
+bool Triangle::bounds(Point &lower, Point &upper) const
+{
+    for (unsigned axis = 0; axis != 3; ++axis)
+    {
+        lower.data[axis] = std::min({v0.data[axis], v1.data[axis], v2.data[axis]});
+        upper.data[axis] = std::max({v0.data[axis], v1.data[axis], v2.data[axis]});
+    }
+    return true;
+}
+
+Triangle::Triangle(Point const &v0,
+                   Point const &v1,
+                   Point const &v2)
+:
+    v0(v0),
+    v1(v1),
+    v2(v2),
+    N((v1 - v0).cross(v2 - v0).normalized())
+{}
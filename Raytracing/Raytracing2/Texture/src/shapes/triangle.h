@@ -0,0 +1,58 @@
+#ifndef TRIANGLE_H_
+#define TRIANGLE_H_
+
+#include "../object.h"
+#include "../stats.h"
+
+#include <cmath>
+#include <limits>
+
+class Triangle final: public Object
+{
+    public:
+        Triangle(Point const &v0,
+                 Point const &v1,
+                 Point const &v2);
+
+        Hit intersect(Ray const &ray) const override;
+        bool bounds(Point &lower, Point &upper) const override;
+
+        Point const v0;
+        Point const v1;
+        Point const v2;
+
+        Vector const N;
+};
+
+/*  Method:
+ *  First find the intersection with the plane the triangle is in,
+ *  then determine whether the point of intersection is on the inner
+ *  side of all three edges.
+ */
+inline Hit Triangle::intersect(Ray const &ray) const
+{
+    RenderStats::count(RenderStats::TRIANGLE_TESTS);
+
+    // Catch the case where the ray is parallel to the plane, i.e. no intersection.
+    double DdotN = ray.D.dot(N);
+    if (std::abs(DdotN) < std::numeric_limits<double>::epsilon())
+        return Hit::NO_HIT();
+
+    // Find the point of intersection with the plane.
+    double t = N.dot(v0 - ray.O) / DdotN;
+
+    if (t < 0.0)
+        return Hit::NO_HIT();
+
+    Point hit = ray.at(t);
+
+    // Determine if the hit is inside of the triangle.
+    if (N.dot((v1 - v0).cross(hit - v0)) < 0.0 or
+        N.dot((v2 - v1).cross(hit - v1)) < 0.0 or
+        N.dot((v0 - v2).cross(hit - v2)) < 0.0)
+        return Hit::NO_HIT();
+
+    return Hit(t, N);
+}
+
+#endif
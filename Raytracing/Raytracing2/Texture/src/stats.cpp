@@ -0,0 +1,97 @@
+#include "stats.h"
+
+#include "json/json.h"
+
+#include <iomanip>
+#include <iostream>
+
+using namespace std;
+using json = nlohmann::json;
+
+namespace
+{
+    char const *const COUNTER_NAMES[RenderStats::NUM_COUNTERS] = {
+        "primaryRays",
+        "shadowRays",
+        "reflectionRays",
+        "refractionRays",
+        "sphereTests",
+        "quadTests",
+        "triangleTests",
+        "meshTests",
+        "nodeVisits",
+        "shadowCacheLookups",
+        "shadowCacheHits",
+        "clusterHits",
+        "clusterMisses"
+    };
+
+    char const *const PHASE_NAMES[RenderStats::NUM_PHASES] = {
+        "parse",
+        "build",
+        "trace",
+        "denoise",
+        "encode"
+    };
+}
+
+RenderStats &RenderStats::operator+=(RenderStats const &other)
+{
+    for (unsigned idx = 0; idx != NUM_COUNTERS; ++idx)
+        counters[idx] += other.counters[idx];
+    for (unsigned idx = 0; idx != MAX_DEPTH; ++idx)
+        depth[idx] += other.depth[idx];
+    for (unsigned idx = 0; idx != NUM_PHASES; ++idx)
+        seconds[idx] += other.seconds[idx];
+    return *this;
+}
+
+json RenderStats::toJson() const
+{
+    json result;
+
+    for (unsigned idx = 0; idx != NUM_PHASES; ++idx)
+        result["seconds"][PHASE_NAMES[idx]] = seconds[idx];
+
+    if (!enabled)
+        return result;
+
+    for (unsigned idx = 0; idx != NUM_COUNTERS; ++idx)
+        result["counters"][COUNTER_NAMES[idx]] = counters[idx];
+
+    // Leave out the empty tail of the histogram
+    unsigned levels = MAX_DEPTH;
+    while (levels > 1 and depth[levels - 1] == 0)
+        --levels;
+    result["depthHistogram"] = vector<unsigned long>(depth, depth + levels);
+
+    return result;
+}
+
+void RenderStats::print(ostream &out) const
+{
+    ios::fmtflags flags = out.flags();
+    streamsize precision = out.precision();
+
+    out << "Time (s):";
+    for (unsigned idx = 0; idx != NUM_PHASES; ++idx)
+        out << ' ' << PHASE_NAMES[idx] << ' ' << fixed << setprecision(3)
+            << seconds[idx];
+    out << '\n';
+    out.flags(flags);
+    out.precision(precision);
+
+    if (!enabled)
+        return;
+
+    for (unsigned idx = 0; idx != NUM_COUNTERS; ++idx)
+        if (counters[idx] != 0)
+            out << "  " << left << setw(20) << COUNTER_NAMES[idx] << right
+                << setw(14) << counters[idx] << '\n';
+
+    out << "  Shaded hits per recursion level:";
+    for (unsigned idx = 0; idx != MAX_DEPTH; ++idx)
+        if (depth[idx] != 0)
+            out << ' ' << idx << ": " << depth[idx];
+    out << '\n';
+}
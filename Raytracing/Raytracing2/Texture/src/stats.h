@@ -0,0 +1,80 @@
+#ifndef STATS_H_
+#define STATS_H_
+
+#include "json/json_fwd.h"
+
+#include <iosfwd>
+
+// Render statistics. Counters are kept per thread, Scene::render merges
+// those of its tiles. Configuring with -DRAYTRACER_STATS=OFF compiles all
+// counting out, leaving only the phase timings.
+class RenderStats
+{
+    public:
+        enum Counter
+        {
+            PRIMARY_RAYS,
+            SHADOW_RAYS,
+            REFLECTION_RAYS,
+            REFRACTION_RAYS,
+            SPHERE_TESTS,
+            QUAD_TESTS,
+            TRIANGLE_TESTS,
+            MESH_TESTS,
+            NODE_VISITS,            // acceleration structure nodes visited
+            SHADOW_CACHE_LOOKUPS,   // shadow rays that first tried a cached object
+            SHADOW_CACHE_HITS,      // of those, rays the cached object blocked
+            CLUSTER_HITS,           // streamed mesh clusters found in memory
+            CLUSTER_MISSES,         // and those read from disk
+            NUM_COUNTERS
+        };
+
+        enum Phase
+        {
+            PARSE,
+            BUILD,
+            TRACE,
+            DENOISE,
+            ENCODE,
+            NUM_PHASES
+        };
+
+        // shaded hits per recursion level, deeper levels share the last
+        static unsigned const MAX_DEPTH = 16;
+
+#ifdef RAYTRACER_STATS
+        static bool constexpr enabled = true;
+#else
+        static bool constexpr enabled = false;
+#endif
+
+        unsigned long counters[NUM_COUNTERS] = {};
+        unsigned long depth[MAX_DEPTH] = {};
+        double seconds[NUM_PHASES] = {};
+
+        // counters of the calling thread
+        static RenderStats &local()
+        {
+            static thread_local RenderStats stats;
+            return stats;
+        }
+
+        static void count(Counter counter, unsigned long amount = 1)
+        {
+            if (enabled)
+                local().counters[counter] += amount;
+        }
+
+        static void countDepth(unsigned level)
+        {
+            if (enabled)
+                ++local().depth[level < MAX_DEPTH ? level : MAX_DEPTH - 1];
+        }
+
+        RenderStats &operator+=(RenderStats const &other);
+
+        nlohmann::json toJson() const;
+        void print(std::ostream &out) const;
+};
+
+#endif
@@ -0,0 +1,71 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace std;
+
+ThreadPool::ThreadPool(unsigned numThreads)
+:
+    d_submitted(0),
+    d_stopping(false)
+{
+    if (numThreads == 0)
+        numThreads = max(thread::hardware_concurrency(), 1u);
+
+    d_workers.reserve(numThreads);
+    for (unsigned idx = 0; idx != numThreads; ++idx)
+        d_workers.emplace_back(&ThreadPool::work, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        lock_guard<mutex> lock(d_mutex);
+        d_stopping = true;
+    }
+    d_condition.notify_all();
+
+    for (thread &worker : d_workers)
+        worker.join();
+}
+
+future<void> ThreadPool::submit(function<void()> job, int priority)
+{
+    // std::function must be copyable, so share the (move-only) task
+    auto task = make_shared<packaged_task<void()>>(move(job));
+    future<void> result = task->get_future();
+
+    {
+        lock_guard<mutex> lock(d_mutex);
+        d_tasks.push(Task{priority, d_submitted++, [task]{ (*task)(); }});
+    }
+    d_condition.notify_one();
+
+    return result;
+}
+
+unsigned ThreadPool::size() const
+{
+    return d_workers.size();
+}
+
+void ThreadPool::work()
+{
+    while (true)
+    {
+        function<void()> job;
+        {
+            unique_lock<mutex> lock(d_mutex);
+            d_condition.wait(lock, [this]{ return d_stopping or not d_tasks.empty(); });
+
+            // Drain the queue before stopping
+            if (d_tasks.empty())
+                return;
+
+            job = d_tasks.top().job;
+            d_tasks.pop();
+        }
+        job();
+    }
+}
@@ -0,0 +1,55 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+class ThreadPool
+{
+    struct Task
+    {
+        int priority;           // higher runs first
+        unsigned long order;    // submission order, FIFO within a priority
+        std::function<void()> job;
+    };
+
+    struct TaskOrder
+    {
+        bool operator()(Task const &lhs, Task const &rhs) const
+        {
+            if (lhs.priority != rhs.priority)
+                return lhs.priority < rhs.priority;
+            return lhs.order > rhs.order;
+        }
+    };
+
+    std::vector<std::thread> d_workers;
+    std::priority_queue<Task, std::vector<Task>, TaskOrder> d_tasks;
+    std::mutex d_mutex;
+    std::condition_variable d_condition;
+    unsigned long d_submitted;
+    bool d_stopping;
+
+    public:
+        // numThreads == 0 starts one worker per hardware thread
+        explicit ThreadPool(unsigned numThreads = 0);
+        ~ThreadPool();
+
+        ThreadPool(ThreadPool const &) = delete;
+        ThreadPool &operator=(ThreadPool const &) = delete;
+
+        // Queue a job, the returned future rethrows its exceptions
+        std::future<void> submit(std::function<void()> job, int priority = 0);
+
+        unsigned size() const;
+
+    private:
+        void work();
+};
+
+#endif
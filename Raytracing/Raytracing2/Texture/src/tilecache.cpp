@@ -0,0 +1,127 @@
+#include "tilecache.h"
+
+#include "hash.h"
+#include "image.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+namespace
+{
+    char const MAGIC[4] = {'T', 'I', 'L', '1'};
+
+    struct Header
+    {
+        char magic[4];
+        uint32_t width;
+        uint32_t height;
+        uint64_t key;
+    };
+
+    // Followed by the pixels of the tile, row by row
+}
+
+TileCache::TileCache(string const &directory, uint64_t key, ostream &err)
+:
+    d_directory(directory),
+    d_key(key),
+    d_hits(0),
+    d_misses(0),
+    d_failed(false),
+    d_err(err)
+{}
+
+bool TileCache::read(uint64_t tileKey, Image &img, unsigned x0, unsigned y0,
+                     unsigned x1, unsigned y1)
+{
+    uint64_t key = address(tileKey);
+    ifstream infile(filename(key), ios::binary);
+
+    Header header;
+    bool found = infile
+        and infile.read(reinterpret_cast<char *>(&header), sizeof(header))
+        and memcmp(header.magic, MAGIC, sizeof(MAGIC)) == 0
+        and header.width == x1 - x0 and header.height == y1 - y0
+        and header.key == key;
+
+    // Read into a copy, a truncated file changes nothing
+    vector<RGB32F> pixels((x1 - x0) * (y1 - y0));
+    found = found and infile.read(reinterpret_cast<char *>(pixels.data()),
+                                  pixels.size() * sizeof(RGB32F));
+    if (!found)
+    {
+        ++d_misses;
+        return false;
+    }
+
+    for (unsigned y = y0; y != y1; ++y)
+        copy_n(&pixels[(y - y0) * (x1 - x0)], x1 - x0, &img(x0, y));
+    ++d_hits;
+    return true;
+}
+
+void TileCache::write(uint64_t tileKey, Image const &img, unsigned x0,
+                      unsigned y0, unsigned x1, unsigned y1)
+{
+    uint64_t key = address(tileKey);
+    string name = filename(key);
+
+    // Tiles are written from several threads
+    ostringstream tmpname;
+    tmpname << name << '.' << this_thread::get_id() << ".tmp";
+
+    bool written;
+    {
+        ofstream outfile(tmpname.str(), ios::binary);
+
+        // Zeroed, so the padding after height is not written uninitialised
+        Header header{};
+        memcpy(header.magic, MAGIC, sizeof(MAGIC));
+        header.width = x1 - x0;
+        header.height = y1 - y0;
+        header.key = key;
+
+        outfile.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        for (unsigned y = y0; y != y1; ++y)
+            outfile.write(reinterpret_cast<char const *>(&img(x0, y)),
+                          (x1 - x0) * sizeof(RGB32F));
+        written = outfile.flush().good();
+    }
+
+    if (written and rename(tmpname.str().c_str(), name.c_str()) == 0)
+        return;
+
+    remove(tmpname.str().c_str());
+    if (not d_failed.exchange(true))
+        d_err << "Warning: could not write to tile cache " << d_directory << ".\n";
+}
+
+unsigned TileCache::hits() const
+{
+    return d_hits;
+}
+
+unsigned TileCache::misses() const
+{
+    return d_misses;
+}
+
+uint64_t TileCache::address(uint64_t tileKey) const
+{
+    return Hash().add(d_key).add(tileKey).value();
+}
+
+string TileCache::filename(uint64_t key) const
+{
+    char name[17];
+    snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(key));
+    return d_directory + '/' + name + ".tile";
+}
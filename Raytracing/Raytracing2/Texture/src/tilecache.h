@@ -0,0 +1,54 @@
+#ifndef TILECACHE_H_
+#define TILECACHE_H_
+
+#include <atomic>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+
+class Image;
+
+// Rendered tiles kept on disk across runs, one file per tile named after
+// its key. Scene::render keys a tile by its camera rays and the objects
+// those rays can reach (see Scene::tileKey), this cache adds a key of the
+// remaining settings and lights. A tile whose file exists is copied into
+// the image instead of traced. Files are never invalidated: an edit gives
+// the tiles it affects new keys, so stale files are simply not read again.
+class TileCache
+{
+    std::string d_directory;            // must exist
+    std::uint64_t d_key;                // hash of the settings and lights
+
+    std::atomic<unsigned> d_hits;
+    std::atomic<unsigned> d_misses;
+    std::atomic<bool> d_failed;         // a write failed, warned once
+    std::ostream &d_err;                // where that warning goes
+
+    public:
+        TileCache(std::string const &directory, std::uint64_t key,
+                  std::ostream &err);
+
+        // Copy the tile of the given key into the pixels [x0, x1) x [y0, y1)
+        // of img. Returns false, leaving img untouched, if there is no file
+        // for this key and tile size.
+        bool read(std::uint64_t tileKey, Image &img, unsigned x0, unsigned y0,
+                  unsigned x1, unsigned y1);
+
+        // Store the pixels [x0, x1) x [y0, y1) of img under the key. Files
+        // are written under a temporary name and renamed, so concurrent
+        // renders never read a partial tile. A failed write is reported
+        // once, the render goes on.
+        void write(std::uint64_t tileKey, Image const &img, unsigned x0,
+                   unsigned y0, unsigned x1, unsigned y1);
+
+        // tiles read and tiles not found since construction
+        unsigned hits() const;
+        unsigned misses() const;
+
+    private:
+        // key of the file of a tile, mixing in d_key
+        std::uint64_t address(std::uint64_t tileKey) const;
+        std::string filename(std::uint64_t key) const;
+};
+
+#endif